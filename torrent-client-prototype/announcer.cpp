@@ -0,0 +1,197 @@
+#include "announcer.h"
+#include <algorithm>
+#include <random>
+
+
+Announcer::Announcer(const TorrentFile& tf, const std::string& peerId, int port, PeerPool& peerPool, const PieceStorage& pieces) :
+    tf_(tf), peerId_(peerId), port_(port), peerPool_(peerPool), pieces_(pieces) {
+    l = spdlog::get("mainLogger");
+    std::mt19937 random(std::random_device{}());
+    tiers_ = std::vector<Tier>(tf_.announceTiers.size());
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < tf_.announceTiers.size(); ++i) {
+        for (const std::string& url : tf_.announceTiers[i]) {
+            tiers_[i].trackers.push_back(std::make_unique<Tracker>(url));
+        }
+        // spreads the load of clients over the trackers of a tier
+        std::shuffle(tiers_[i].trackers.begin(), tiers_[i].trackers.end(), random);
+        tiers_[i].nextAnnounce = now;
+    }
+    for (Tier& tier : tiers_) {
+        tier.thread = std::thread(&Announcer::TierLoop, this, std::ref(tier));
+    }
+}
+
+Announcer::~Announcer() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (Tier& tier : tiers_) {
+        tier.thread.join();
+    }
+}
+
+void Announcer::RequestPeers() {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto now = std::chrono::steady_clock::now();
+    for (Tier& tier : tiers_) {
+        auto earliest = std::max(now, tier.lastAnnounce + std::max(tier.minInterval, std::chrono::seconds(minRequestInterval)));
+        tier.nextAnnounce = std::min(tier.nextAnnounce, earliest);
+    }
+    wake_.notify_all();
+}
+
+void Announcer::Completed() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (completed_) {
+        return;
+    }
+    completed_ = true;
+    // events are not bound by min interval
+    for (Tier& tier : tiers_) {
+        tier.nextAnnounce = std::chrono::steady_clock::now();
+    }
+    wake_.notify_all();
+}
+
+void Announcer::TierLoop(Tier& tier) {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+        while (!stop_ && std::chrono::steady_clock::now() < tier.nextAnnounce) {
+            wake_.wait_until(lock, tier.nextAnnounce);
+        }
+        if (stop_) {
+            break;
+        }
+        inFlight_++;
+        lock.unlock();
+        Tracker* answered = AnnounceTier(tier);
+        lock.lock();
+        inFlight_--;
+
+        auto now = std::chrono::steady_clock::now();
+        tier.lastAnnounce = now;
+        if (answered) {
+            std::chrono::seconds interval = answered->tracker.GetInterval();
+            tier.minInterval = answered->tracker.GetMinInterval();
+            tier.failedRounds = 0;
+            tier.nextAnnounce = now + (interval.count() > 0 ? interval : defaultInterval);
+            SPDLOG_LOGGER_DEBUG(l, "Next announce to {} in {}s", answered->url, (tier.nextAnnounce - now) / std::chrono::seconds(1));
+        } else {
+            std::chrono::seconds retry = failedRetry * (1 << std::min<size_t>(tier.failedRounds, 6));
+            tier.failedRounds++;
+            tier.nextAnnounce = now + std::min(retry, std::chrono::seconds(defaultInterval));
+        }
+    }
+    bool completed = completed_;
+    lock.unlock();
+
+    // say goodbye to every tracker that has our started event, a dead one only delays the exit by its timeout
+    for (auto& tracker : tier.trackers) {
+        if (!tracker->started) {
+            continue;
+        }
+        if (completed && !tracker->completedSent) {
+            Announce(*tracker, TrackerEvent::Completed);
+        }
+        Announce(*tracker, TrackerEvent::Stopped);
+    }
+}
+
+Announcer::Tracker* Announcer::AnnounceTier(Tier& tier) {
+    Tracker* answered = nullptr;
+    for (auto& tracker : tier.trackers) {
+        if (Announce(*tracker, NextEvent(*tracker))) {
+            answered = tracker.get();
+            break;
+        }
+    }
+    std::stable_sort(tier.trackers.begin(), tier.trackers.end(), &Announcer::Before);
+    return answered;
+}
+
+TrackerEvent Announcer::NextEvent(const Tracker& tracker) const {
+    if (!tracker.started) {
+        return TrackerEvent::Started;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    if (completed_ && !tracker.completedSent) {
+        return TrackerEvent::Completed;
+    }
+    return TrackerEvent::None;
+}
+
+AnnounceParams Announcer::MakeParams(TrackerEvent event) const {
+    AnnounceParams params;
+    params.uploaded = pieces_.bytesUploaded.load(std::memory_order_relaxed);
+    params.downloaded = pieces_.bytesDownloaded.load(std::memory_order_relaxed);
+    size_t total = pieces_.GetTotalBytesToDownload();
+    params.left = params.downloaded < total ? total - params.downloaded : 0;
+    params.event = event;
+    return params;
+}
+
+bool Announcer::Announce(Tracker& tracker, TrackerEvent event) {
+    l->info("Connecting to tracker {}", tracker.url);
+    TrackerStats& stats = tracker.stats;
+    stats.announces++;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        tracker.tracker.UpdatePeers(tf_, peerId_, port_, MakeParams(event));
+    } catch (const std::exception& e) {
+        stats.failures++;
+        stats.consecutiveFailures++;
+        l->warn("Error in update peers from {}: {}", tracker.url, e.what());
+        return false;
+    }
+    auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    switch (event) {
+        case TrackerEvent::Started:
+            tracker.started = true;
+            break;
+        case TrackerEvent::Completed:
+            tracker.completedSent = true;
+            break;
+        case TrackerEvent::Stopped:
+            tracker.started = false;
+            return true;  // the tracker drops us, its peers are of no use anymore
+        case TrackerEvent::None:
+            break;
+    }
+    const std::vector<Peer>& peers = tracker.tracker.GetPeers();
+    size_t added = peerPool_.Add(peers, PeerSource::Tracker);
+
+    bool first = stats.announces - stats.failures == 1;
+    stats.consecutiveFailures = 0;
+    stats.latency = first ? latency :
+        std::chrono::milliseconds(static_cast<long long>(statsWeight * latency.count() + (1 - statsWeight) * stats.latency.count()));
+    stats.peerYield = first ? peers.size() : statsWeight * peers.size() + (1 - statsWeight) * stats.peerYield;
+    l->info("Tracker {} returned {} peers, {} of them new", tracker.url, peers.size(), added);
+    SPDLOG_LOGGER_DEBUG(l, "Tracker {}: {} announces, {} failed, latency {}ms, {:.1f} peers per answer",
+                        tracker.url, stats.announces, stats.failures, stats.latency.count(), stats.peerYield);
+    return true;
+}
+
+bool Announcer::InFlight() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return inFlight_ > 0;
+}
+
+bool Announcer::Before(const std::unique_ptr<Tracker>& a, const std::unique_ptr<Tracker>& b) {
+    const TrackerStats& x = a->stats;
+    const TrackerStats& y = b->stats;
+    if (x.consecutiveFailures != y.consecutiveFailures) {
+        return x.consecutiveFailures < y.consecutiveFailures;
+    }
+    bool xAnswered = x.announces > x.failures;
+    bool yAnswered = y.announces > y.failures;
+    if (xAnswered != yAnswered) {
+        return xAnswered;
+    }
+    if (x.peerYield != y.peerYield) {
+        return x.peerYield > y.peerYield;
+    }
+    return x.latency < y.latency;
+}
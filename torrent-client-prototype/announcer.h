@@ -0,0 +1,114 @@
+#pragma once
+
+#include "torrent_tracker.h"
+#include "torrent_file.h"
+#include "peer_pool.h"
+#include "piece_storage.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include "spdlog/spdlog.h"
+
+/*
+ * What we know about a tracker from our announces to it
+ */
+struct TrackerStats {
+    size_t announces = 0;
+    size_t failures = 0;
+    size_t consecutiveFailures = 0;
+    std::chrono::milliseconds latency{0};  // moving average over answered announces
+    double peerYield = 0;  // moving average of peers per answer
+};
+
+/*
+ * Announces the torrent to its trackers for as long as it exists, https://www.bittorrent.org/beps/bep_0012.html
+ * Every tier has its own thread that re-announces on the schedule the tracker asked for ("interval"),
+ * reporting the real transfer state from PieceStorage and the started, completed and stopped events.
+ * Inside a tier the trackers are tried in order until one answers, the order starts shuffled and is then kept
+ * by the trackers' statistics: trackers that answer go before failing and untried ones,
+ * among them more peers and lower latency go first.
+ * Peers go to the PeerPool as soon as a tracker answers, the pool drops duplicates and running downloads
+ * take new peers from it, so the fastest tier starts the download and later answers join it.
+ */
+class Announcer {
+public:
+    // starts announcing at once
+    Announcer(const TorrentFile& tf, const std::string& peerId, int port, PeerPool& peerPool, const PieceStorage& pieces);
+
+    // sends the stopped event and waits for the tier threads, each announce is bounded by the tracker timeouts
+    ~Announcer();
+
+    Announcer(const Announcer&) = delete;
+    Announcer& operator=(const Announcer&) = delete;
+
+    /*
+     * We are short of peers: announce as soon as the trackers' "min interval" allows
+     */
+    void RequestPeers();
+
+    /*
+     * The download is complete, tell the trackers now
+     */
+    void Completed();
+
+    // some tier is announcing right now
+    bool InFlight() const;
+
+    static constexpr double statsWeight = 0.3;  // weight of the newest announce in the moving averages
+    static constexpr std::chrono::seconds defaultInterval{1800};  // the tracker did not say
+    static constexpr std::chrono::seconds minRequestInterval{60};  // RequestPeers never announces more often
+    static constexpr std::chrono::seconds failedRetry{30};  // first retry after a tier failed, doubles up to the interval
+
+private:
+    struct Tracker {
+        std::string url;
+        TorrentTracker tracker;
+        TrackerStats stats;
+        bool started = false;  // the tracker has our started event
+        bool completedSent = false;
+
+        explicit Tracker(const std::string& announceUrl) : url(announceUrl), tracker(announceUrl) {}
+    };
+
+    struct Tier {
+        std::vector<std::unique_ptr<Tracker>> trackers;  // in announce order, only changed by the tier's thread
+        std::chrono::steady_clock::time_point lastAnnounce;
+        std::chrono::steady_clock::time_point nextAnnounce;
+        std::chrono::seconds minInterval{0};
+        size_t failedRounds = 0;
+        std::thread thread;
+    };
+
+    void TierLoop(Tier& tier);
+
+    // announce to the trackers of the tier until one answers, returns that tracker or nullptr
+    Tracker* AnnounceTier(Tier& tier);
+
+    // true if the tracker answered
+    bool Announce(Tracker& tracker, TrackerEvent event);
+
+    // the event that goes with the next regular announce to the tracker
+    TrackerEvent NextEvent(const Tracker& tracker) const;
+
+    AnnounceParams MakeParams(TrackerEvent event) const;
+
+    // order for the next announces of a tier
+    static bool Before(const std::unique_ptr<Tracker>& a, const std::unique_ptr<Tracker>& b);
+
+    const TorrentFile& tf_;
+    std::string peerId_;
+    int port_;
+    PeerPool& peerPool_;
+    const PieceStorage& pieces_;
+    std::vector<Tier> tiers_;
+    mutable std::mutex mtx;
+    std::condition_variable wake_;  // schedule changed or stop
+    size_t inFlight_ = 0;
+    bool completed_ = false;
+    bool stop_ = false;
+    std::shared_ptr<spdlog::logger> l;
+};
@@ -1,4 +1,5 @@
 #include "bencode.h"
+#include <type_traits>
 
 namespace Bencode {
     
@@ -12,8 +13,8 @@ namespace Bencode {
         std::shared_ptr<spdlog::logger> l = spdlog::get("mainLogger");
         std::string expectedStringLengthString = str.substr(0, str.find(':'));
         long long expectedStringLength = std::stoll(expectedStringLengthString);
-        l->debug("ParseString, expected len {}", expectedStringLength);
-        if(str.size() < expectedStringLength){
+        SPDLOG_LOGGER_DEBUG(l, "ParseString, expected len {}", expectedStringLength);
+        if(expectedStringLength < 0 || str.size() < expectedStringLengthString.size() + 1 + static_cast<size_t>(expectedStringLength)){
             l->error("ParseString error, length of a string is less than expected");
             throw std::runtime_error("Error in Parse String length of a string is less than a len\n");
         }
@@ -41,7 +42,15 @@ namespace Bencode {
         std::shared_ptr<spdlog::logger> l = spdlog::get("mainLogger");
         auto lst = makeBencodeList();
         size_t cur_pos = 1;
-        while(str[cur_pos] != 'e'){
+        while(true){
+            // data from peers and trackers can be cut or malformed
+            if(cur_pos >= str.size()){
+                l->error("ParseListRec error, list is not terminated");
+                throw std::runtime_error("Error in Parse List, list is not terminated\n");
+            }
+            if(str[cur_pos] == 'e'){
+                break;
+            }
             if(isdigit(str[cur_pos])){
                 std::pair<std::string, size_t> listItem = ParseString(str.substr(cur_pos));
                 lst->elements.push_back(listItem.first);
@@ -54,10 +63,13 @@ namespace Bencode {
                 std::pair<size_t, size_t> listItem = ParseInt(str.substr(cur_pos));
                 lst->elements.push_back(listItem.first);
                 cur_pos += listItem.second;
-            }else{
+            }else if (str[cur_pos] == 'd'){
                 std::pair<std::unique_ptr<bencodeDict>, size_t> listItem = ParseDictRec(str.substr(cur_pos));
                 lst->elements.push_back(std::move(listItem.first));
                 cur_pos += listItem.second;
+            }else{
+                l->error("ParseListRec error, unexpected symbol at {}", cur_pos);
+                throw std::runtime_error("Error in Parse List, unexpected symbol\n");
             }
         }
         return {std::move(lst), cur_pos + 1}; 
@@ -72,36 +84,91 @@ namespace Bencode {
         std::shared_ptr<spdlog::logger> l = spdlog::get("mainLogger");
         auto dict = makeBencodeDict();
         size_t cur_pos = 1;
-        l->debug("Parse dict, averall size of dict {}", str.size());
-        while(str[cur_pos] != 'e'){
+        SPDLOG_LOGGER_DEBUG(l, "Parse dict, averall size of dict {}", str.size());
+        while(true){
+            if(cur_pos >= str.size()){
+                l->error("ParseDictRec error, dict is not terminated");
+                throw std::runtime_error("Error in Parse Dict, dict is not terminated\n");
+            }
+            if(str[cur_pos] == 'e'){
+                break;
+            }
             std::pair<std::string, size_t> key = ParseString(str.substr(cur_pos));
+            if(key.second == 0 || cur_pos + key.second >= str.size()){
+                l->error("ParseDictRec error, no value for key {}", key.first);
+                throw std::runtime_error("Error in Parse Dict, no value for a key\n");
+            }
             if(isdigit(str[cur_pos + key.second])){
-                l->debug("Parse dict, str on pos {}", cur_pos); 
+                SPDLOG_LOGGER_DEBUG(l, "Parse dict, str on pos {}", cur_pos); 
                 std::pair<std::string, size_t> dictItem = ParseString(str.substr(cur_pos + key.second));
                 dict->elements[key.first] = dictItem.first;
                 cur_pos += dictItem.second;
             }else if(str[cur_pos + key.second] == 'l'){
-                l->debug("Parse dict, list on pos {}", cur_pos); 
+                SPDLOG_LOGGER_DEBUG(l, "Parse dict, list on pos {}", cur_pos); 
                 std::pair<std::unique_ptr<bencodeList>, size_t>  dictItem = ParseListRec(str.substr(cur_pos + key.second));
                 dict->elements[key.first] = std::move(dictItem.first);
                 cur_pos += dictItem.second;
             }else if(str[cur_pos + key.second] == 'i'){
-                l->debug("Parse dict, int on pos {}", cur_pos); 
+                SPDLOG_LOGGER_DEBUG(l, "Parse dict, int on pos {}", cur_pos); 
                 std::pair<size_t, size_t> dictItem = ParseInt(str.substr(cur_pos + key.second));
                 dict->elements[key.first] = dictItem.first;
                 cur_pos += dictItem.second;
-            }else{
-                l->debug("Parse dict, dict on pos {}", cur_pos); 
+            }else if(str[cur_pos + key.second] == 'd'){
+                SPDLOG_LOGGER_DEBUG(l, "Parse dict, dict on pos {}", cur_pos); 
                 std::pair<std::unique_ptr<bencodeDict>, size_t> dictItem = ParseDictRec(str.substr(cur_pos + key.second));
                 dict->elements[key.first] = std::move(dictItem.first);
                 cur_pos += dictItem.second;
+            }else{
+                l->error("ParseDictRec error, unexpected symbol at {}", cur_pos + key.second);
+                throw std::runtime_error("Error in Parse Dict, unexpected symbol\n");
             }
             cur_pos += key.second;   
-            l->trace("Parse dict, in mp key {}", key.first); 
+            SPDLOG_LOGGER_TRACE(l, "Parse dict, in mp key {}", key.first); 
         }
         return {std::move(dict), cur_pos + 1}; 
     }
 
+    std::string EncodeString(const std::string& str){
+        return std::to_string(str.size()) + ":" + str;
+    }
+
+    std::string EncodeInt(size_t value){
+        return "i" + std::to_string(value) + "e";
+    }
+
+    std::string Encode(const bencodeList& list){
+        std::string result = "l";
+        for(const auto& element : list.elements){
+            result += Encode(element);
+        }
+        result += "e";
+        return result;
+    }
+
+    std::string Encode(const bencodeDict& dict){
+        std::string result = "d";
+        // std::map keeps keys sorted
+        for(const auto& [key, value] : dict.elements){
+            result += EncodeString(key);
+            result += Encode(value);
+        }
+        result += "e";
+        return result;
+    }
+
+    std::string Encode(const elementDict& element){
+        return std::visit([](const auto& value) -> std::string {
+            using T = std::decay_t<decltype(value)>;
+            if constexpr (std::is_same_v<T, std::string>) {
+                return EncodeString(value);
+            } else if constexpr (std::is_same_v<T, size_t>) {
+                return EncodeInt(value);
+            } else {
+                return Encode(*value);
+            }
+        }, element);
+    }
+
 
 }
 
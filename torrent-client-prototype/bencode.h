@@ -40,4 +40,14 @@ namespace Bencode {
     std::unique_ptr<bencodeDict> makeBencodeDict();
     std::pair<std::unique_ptr<bencodeDict>, size_t> ParseDictRec(const std::string& str);
 
+    /*
+     * Encoding back to bencode, used for extension protocol messages.
+     * Dictionary keys come out sorted, as the format requires
+     */
+    std::string EncodeString(const std::string& str);
+    std::string EncodeInt(size_t value);
+    std::string Encode(const bencodeList& list);
+    std::string Encode(const bencodeDict& dict);
+    std::string Encode(const elementDict& element);
+
 }
@@ -1,8 +1,9 @@
 #include "byte_tools.h"
-#include <openssl/sha.h>
+#include "sha1_engine.h"
 #include <vector>
 #include <sstream>
 #include <iomanip>
+#include <stdexcept>
 
 size_t BytesToInt(std::string_view bytes) {
 
@@ -14,17 +15,36 @@ size_t BytesToInt(std::string_view bytes) {
 }
 
 
-std::string CalculateSHA1(const std::string& msg) {
-    unsigned char SHA_info[20];
-    const unsigned char* to_encode = reinterpret_cast<const unsigned char *>(msg.c_str());
-    SHA1(to_encode, msg.size(), SHA_info);
+std::string CalculateSHA1(std::string_view msg) {
+    return Sha1Engine::ToString(Sha1Engine::Hash(msg));
+}
+
+Sha1Context::Sha1Context() : ctx_(EVP_MD_CTX_new(), &EVP_MD_CTX_free) {
+    if(!ctx_){
+        throw std::runtime_error("Failed to allocate SHA1 context");
+    }
+    Reset();
+}
+
+void Sha1Context::Update(std::string_view data){
+    if(EVP_DigestUpdate(ctx_.get(), data.data(), data.size()) != 1){
+        throw std::runtime_error("SHA1 update failed");
+    }
+}
+
+std::string Sha1Context::Final(){
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLength = 0;
+    if(EVP_DigestFinal_ex(ctx_.get(), digest, &digestLength) != 1){
+        throw std::runtime_error("SHA1 final failed");
+    }
+    return std::string(reinterpret_cast<const char*>(digest), digestLength);
+}
 
-    std::string s;
-    s.resize(20);
-    for(int i = 0; i < 20; ++i){
-        s[i] = SHA_info[i];
+void Sha1Context::Reset(){
+    if(EVP_DigestInit_ex(ctx_.get(), EVP_sha1(), nullptr) != 1){
+        throw std::runtime_error("SHA1 init failed");
     }
-    return s;
 }
 
 std::string IntToBytes(int num){
@@ -37,9 +57,13 @@ std::string IntToBytes(int num){
 }
 
 std::string HexEncode(const std::string& input){
+    static const char digits[] = "0123456789abcdef";
     std::string res;
+    res.reserve(input.size() * 2);
     for(size_t i = 0; i < input.size(); ++i ){
-        res += (unsigned int)input[i]; 
+        unsigned char c = static_cast<unsigned char>(input[i]);
+        res += digits[c >> 4];
+        res += digits[c & 0xF];
     }
     return res;
 
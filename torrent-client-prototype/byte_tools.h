@@ -1,6 +1,9 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <memory>
+#include <openssl/evp.h>
 
 /*
  * Преобразовать 4 байта в формате big endian в int
@@ -11,7 +14,26 @@ size_t BytesToInt(std::string_view bytes);
  * Расчет SHA1 хеш-суммы. Здесь в результате подразумевается не человеко-читаемая строка, а массив из 20 байтов
  * в том виде, в котором его генерирует библиотека OpenSSL
  */
-std::string CalculateSHA1(const std::string& msg);
+std::string CalculateSHA1(std::string_view msg);
+
+/*
+ * Incremental SHA1, data may be given in several chunks.
+ * Final returns the same 20 bytes as CalculateSHA1 over the concatenation of all chunks.
+ */
+class Sha1Context {
+public:
+    Sha1Context();
+
+    void Update(std::string_view data);
+
+    // finish the hash, the context has to be Reset before it can be used again
+    std::string Final();
+
+    void Reset();
+
+private:
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx_;
+};
 
 /*
  * Представить массив байтов в виде строки, содержащей только символы, соответствующие цифрам в шестнадцатеричном исчислении.
@@ -0,0 +1,68 @@
+#include "choker.h"
+
+#include <algorithm>
+
+
+Choker::Choker() : random_(std::random_device{}()) {
+    l = spdlog::get("mainLogger");
+}
+
+void Choker::Update(const std::vector<PeerConnect*>& peers) {
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastRechoke_ < rechokeInterval) {
+        return;
+    }
+    lastRechoke_ = now;
+    Rechoke(peers, now);
+}
+
+void Choker::Rechoke(const std::vector<PeerConnect*>& peers, std::chrono::steady_clock::time_point now) {
+    struct Candidate {
+        PeerConnect* peer;
+        size_t rate;  // bytes over the last interval
+    };
+    std::vector<Candidate> interested;
+    for (PeerConnect* peer : peers) {
+        // we are downloading for as long as we run, so peers are ranked by what they give us,
+        // the upload count only breaks ties between peers we get nothing from
+        size_t downloaded = peer->TakeDownloadedBytes();
+        size_t uploaded = peer->TakeUploadedBytes();
+        if (peer->PeerInterested()) {
+            interested.push_back(Candidate{peer, downloaded ? downloaded : uploaded / 2});
+        }
+    }
+    std::sort(interested.begin(), interested.end(), [](const Candidate& a, const Candidate& b) {
+        return a.rate > b.rate;
+    });
+
+    std::vector<PeerConnect*> unchoked;
+    for (size_t i = 0; i < interested.size() && i < regularSlots; ++i) {
+        unchoked.push_back(interested[i].peer);
+    }
+
+    bool optimisticAlive = std::any_of(interested.begin(), interested.end(), [this](const Candidate& candidate) {
+        return candidate.peer == optimistic_;
+    });
+    bool optimisticIsRegular = std::find(unchoked.begin(), unchoked.end(), optimistic_) != unchoked.end();
+    if (!optimisticAlive || optimisticIsRegular || now - lastOptimistic_ >= optimisticInterval) {
+        std::vector<PeerConnect*> choked;
+        for (const Candidate& candidate : interested) {
+            if (std::find(unchoked.begin(), unchoked.end(), candidate.peer) == unchoked.end()) {
+                choked.push_back(candidate.peer);
+            }
+        }
+        optimistic_ = nullptr;
+        if (!choked.empty()) {
+            optimistic_ = choked[std::uniform_int_distribution<size_t>(0, choked.size() - 1)(random_)];
+            lastOptimistic_ = now;
+        }
+    }
+    if (optimistic_) {
+        unchoked.push_back(optimistic_);
+    }
+
+    for (PeerConnect* peer : peers) {
+        peer->SetChoked(std::find(unchoked.begin(), unchoked.end(), peer) == unchoked.end());
+    }
+    SPDLOG_LOGGER_DEBUG(l, "Rechoke: {} interested peers, {} unchoked", interested.size(), unchoked.size());
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "peer_connect.h"
+#include <vector>
+#include <chrono>
+#include <random>
+#include "spdlog/spdlog.h"
+
+/*
+ * Decides which peers may download from us, https://wiki.theory.org/BitTorrentSpecification#Choking_and_Optimistic_Unchoking
+ * Every `rechokeInterval` the interested peers that gave us the most data are unchoked,
+ * one more interested peer is unchoked at random and kept for `optimisticInterval`,
+ * so new peers get a chance to show their rate.
+ */
+class Choker {
+public:
+    Choker();
+
+    /*
+     * Called periodically with all live connections, does nothing until the next rechoke is due.
+     * Pointers are only compared with each other, a connection that is gone is simply not in the list
+     */
+    void Update(const std::vector<PeerConnect*>& peers);
+
+    static constexpr size_t regularSlots = 3;
+    static constexpr std::chrono::seconds rechokeInterval{10};
+    static constexpr std::chrono::seconds optimisticInterval{30};
+
+private:
+    void Rechoke(const std::vector<PeerConnect*>& peers, std::chrono::steady_clock::time_point now);
+
+    std::chrono::steady_clock::time_point lastRechoke_;
+    std::chrono::steady_clock::time_point lastOptimistic_;
+    PeerConnect* optimistic_ = nullptr;
+    std::mt19937 random_;
+    std::shared_ptr<spdlog::logger> l;
+};
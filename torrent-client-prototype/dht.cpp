@@ -0,0 +1,717 @@
+#include "dht.h"
+#include "bencode.h"
+#include "byte_tools.h"
+#include "peer_pool.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+    constexpr size_t idSize = 20;
+    constexpr size_t compactNodeSize = idSize + 6;
+
+    const std::vector<std::pair<std::string, std::string>> bootstrapRouters = {
+        {"router.bittorrent.com", "6881"},
+        {"dht.transmissionbt.com", "6881"},
+        {"router.utorrent.com", "6881"},
+    };
+
+    // a is closer to target than b by XOR distance
+    bool Closer(const std::string& a, const std::string& b, const std::string& target) {
+        for (size_t i = 0; i < idSize; ++i) {
+            uint8_t x = static_cast<uint8_t>(a[i]) ^ static_cast<uint8_t>(target[i]);
+            uint8_t y = static_cast<uint8_t>(b[i]) ^ static_cast<uint8_t>(target[i]);
+            if (x != y) {
+                return x < y;
+            }
+        }
+        return false;
+    }
+
+    std::string RandomBytes(size_t count, std::mt19937& random) {
+        std::string result(count, '\0');
+        for (char& c : result) {
+            c = static_cast<char>(random() & 0xFF);
+        }
+        return result;
+    }
+
+    const std::string* GetString(const Bencode::bencodeDict& dict, const std::string& key) {
+        auto it = dict.elements.find(key);
+        return it == dict.elements.end() ? nullptr : std::get_if<std::string>(&it->second);
+    }
+
+    const size_t* GetInt(const Bencode::bencodeDict& dict, const std::string& key) {
+        auto it = dict.elements.find(key);
+        return it == dict.elements.end() ? nullptr : std::get_if<size_t>(&it->second);
+    }
+
+    const Bencode::bencodeDict* GetDict(const Bencode::bencodeDict& dict, const std::string& key) {
+        auto it = dict.elements.find(key);
+        if (it == dict.elements.end()) {
+            return nullptr;
+        }
+        auto* value = std::get_if<std::unique_ptr<Bencode::bencodeDict>>(&it->second);
+        return value ? value->get() : nullptr;
+    }
+
+    const std::string* GetId(const Bencode::bencodeDict& dict, const std::string& key) {
+        const std::string* id = GetString(dict, key);
+        return id && id->size() == idSize ? id : nullptr;
+    }
+
+    // 20 bytes of id and the compact address of every node
+    std::string EncodeNodes(const std::vector<DhtNode>& nodes) {
+        std::string result;
+        for (const DhtNode& node : nodes) {
+            std::string endpoint = EncodeCompactPeers({node.endpoint});
+            if (endpoint.empty()) {
+                continue;
+            }
+            result += node.id;
+            result += endpoint;
+        }
+        return result;
+    }
+
+    std::vector<DhtNode> ParseNodes(std::string_view compact) {
+        std::vector<DhtNode> nodes;
+        for (size_t pos = 0; pos + compactNodeSize <= compact.size(); pos += compactNodeSize) {
+            std::vector<Peer> endpoint = ParseCompactPeers(compact.substr(pos + idSize, 6));
+            if (endpoint.front().port == 0) {
+                continue;
+            }
+            nodes.push_back(DhtNode{std::string(compact.substr(pos, idSize)), endpoint.front(), {}});
+        }
+        return nodes;
+    }
+}
+
+
+DhtRoutingTable::DhtRoutingTable(const std::string& selfId) : selfId_(selfId) {}
+
+size_t DhtRoutingTable::BucketIndex(const std::string& id) const {
+    for (size_t i = 0; i < idSize; ++i) {
+        uint8_t diff = static_cast<uint8_t>(id[i]) ^ static_cast<uint8_t>(selfId_[i]);
+        if (diff) {
+            return i * 8 + __builtin_clz(diff) - 24;
+        }
+    }
+    return buckets_.size();
+}
+
+void DhtRoutingTable::Seen(const std::string& id, const Peer& endpoint) {
+    size_t index = BucketIndex(id);
+    if (index >= buckets_.size()) {
+        return;  // ourselves
+    }
+    std::vector<DhtNode>& bucket = buckets_[index];
+    auto now = std::chrono::steady_clock::now();
+    for (DhtNode& node : bucket) {
+        if (node.id == id) {
+            node.endpoint = endpoint;
+            node.lastSeen = now;
+            node.failedQueries = 0;
+            return;
+        }
+    }
+    if (bucket.size() < bucketSize) {
+        bucket.push_back(DhtNode{id, endpoint, now});
+        return;
+    }
+    auto worst = std::max_element(bucket.begin(), bucket.end(), [](const DhtNode& a, const DhtNode& b) {
+        return a.failedQueries < b.failedQueries;
+    });
+    if (worst->failedQueries >= maxFailedQueries) {
+        *worst = DhtNode{id, endpoint, now};
+    }
+}
+
+void DhtRoutingTable::Failed(const std::string& id) {
+    size_t index = BucketIndex(id);
+    if (index >= buckets_.size()) {
+        return;
+    }
+    for (DhtNode& node : buckets_[index]) {
+        if (node.id == id) {
+            node.failedQueries++;
+            return;
+        }
+    }
+}
+
+std::vector<DhtNode> DhtRoutingTable::Closest(const std::string& target, size_t count) const {
+    std::vector<DhtNode> nodes;
+    for (const auto& bucket : buckets_) {
+        for (const DhtNode& node : bucket) {
+            if (node.failedQueries < maxFailedQueries) {
+                nodes.push_back(node);
+            }
+        }
+    }
+    count = std::min(count, nodes.size());
+    std::partial_sort(nodes.begin(), nodes.begin() + count, nodes.end(), [&target](const DhtNode& a, const DhtNode& b) {
+        return Closer(a.id, b.id, target);
+    });
+    nodes.resize(count);
+    return nodes;
+}
+
+size_t DhtRoutingTable::Size() const {
+    size_t size = 0;
+    for (const auto& bucket : buckets_) {
+        size += bucket.size();
+    }
+    return size;
+}
+
+
+Dht::Dht(const std::string& bindAddress, int port, const std::filesystem::path& nodeCache) :
+    nodeCache_(nodeCache), selfId_(LoadNodeCache()), table_(selfId_), port_(port), random_(std::random_device{}()) {
+    l = spdlog::get("mainLogger");
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    if (inet_pton(AF_INET, bindAddress.c_str(), &addr.sin_addr) != 1) {
+        throw std::runtime_error("DHT bind address " + bindAddress + " is not an IPv4 address");
+    }
+    sock_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_ < 0) {
+        throw std::runtime_error(std::string("DHT socket error: ") + std::strerror(errno));
+    }
+    if (bind(sock_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        std::string err = std::strerror(errno);
+        close(sock_);
+        throw std::runtime_error("Can not bind DHT to " + bindAddress + ":" + std::to_string(port) + ": " + err);
+    }
+    fcntl(sock_, F_SETFL, O_NONBLOCK);
+
+    tokenSecrets_[0] = RandomBytes(16, random_);
+    tokenSecrets_[1] = tokenSecrets_[0];
+    secretRotated_ = std::chrono::steady_clock::now();
+    nextRefresh_ = secretRotated_;
+    l->info("DHT node {} on {}:{}, {} cached nodes", HexEncode(selfId_), bindAddress, port_, cachedNodes_.size());
+    thread_ = std::thread(&Dht::Run, this);
+}
+
+Dht::~Dht() {
+    stop_.store(true);
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    SaveNodeCache();
+    close(sock_);
+}
+
+void Dht::AddTorrent(const std::string& infoHash, int announcePort, PeersHandler handler) {
+    std::lock_guard<std::mutex> lock(mtx);
+    torrents_[infoHash] = Torrent{announcePort, std::move(handler), std::chrono::steady_clock::now()};
+}
+
+void Dht::RemoveTorrent(const std::string& infoHash) {
+    std::lock_guard<std::mutex> lock(mtx);
+    torrents_.erase(infoHash);
+}
+
+size_t Dht::NodeCount() const {
+    return nodeCount_.load();
+}
+
+void Dht::PingNode(const Peer& endpoint) {
+    // the socket is IPv4
+    if (!endpoint.Valid() || !endpoint.IsV4()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    if (nodesToPing_.size() >= maxNodesToPing ||
+        std::find(nodesToPing_.begin(), nodesToPing_.end(), endpoint) != nodesToPing_.end()) {
+        return;
+    }
+    nodesToPing_.push_back(endpoint);
+}
+
+void Dht::SendPings() {
+    std::vector<Peer> nodes;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        nodes.swap(nodesToPing_);
+    }
+    // the id is unknown until the node answers, HandleResponse puts it into the table then
+    for (const Peer& node : nodes) {
+        SendQuery("ping", Bencode::bencodeDict(), std::string(), node, 0);
+    }
+}
+
+void Dht::Run() {
+    while (!stop_.load()) {
+        pollfd p{sock_, POLLIN, 0};
+        int ready = poll(&p, 1, pollIntervalMs);
+        if (ready < 0 && errno != EINTR) {
+            l->error("DHT poll error: {}", std::strerror(errno));
+            return;
+        }
+        if (ready > 0) {
+            Receive();
+        }
+        ExpireTransactions();
+        SendPings();
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - secretRotated_ > tokenRotation) {
+            tokenSecrets_[1] = tokenSecrets_[0];
+            tokenSecrets_[0] = RandomBytes(16, random_);
+            secretRotated_ = now;
+        }
+        StartDueLookups();
+        nodeCount_.store(table_.Size());
+    }
+}
+
+void Dht::StartDueLookups() {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= nextRefresh_ && lookups_.empty()) {
+        // looking up our own id fills the buckets near us, the far ones fill with the nodes we meet
+        StartLookup(selfId_, false);
+        nextRefresh_ = now + (table_.Size() < DhtRoutingTable::bucketSize ? std::chrono::minutes(1) : refreshInterval);
+    }
+    if (table_.Size() == 0) {
+        return;  // the bootstrap lookup has to find someone first
+    }
+    std::vector<std::string> due;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto& [infoHash, torrent] : torrents_) {
+            if (now >= torrent.nextSearch) {
+                torrent.nextSearch = now + searchInterval;
+                due.push_back(infoHash);
+            }
+        }
+    }
+    for (const std::string& infoHash : due) {
+        StartLookup(infoHash, true);
+    }
+}
+
+uint64_t Dht::StartLookup(const std::string& target, bool getPeers) {
+    uint64_t id = nextLookupId_++;
+    Lookup& lookup = lookups_[id];
+    lookup.target = target;
+    lookup.getPeers = getPeers;
+    AddCandidates(lookup, table_.Closest(target, lookupCandidates));
+    SPDLOG_LOGGER_DEBUG(l, "DHT {} lookup for {}, {} nodes to start from", getPeers ? "get_peers" : "find_node",
+                        HexEncode(target), lookup.candidates.size());
+    if (table_.Size() < DhtRoutingTable::bucketSize) {
+        SeedLookup(id);
+    }
+    Step(id);
+    return id;
+}
+
+void Dht::SeedLookup(uint64_t lookupId) {
+    Lookup& lookup = lookups_.at(lookupId);
+    AddCandidates(lookup, cachedNodes_);
+    // routers are asked directly, their ids are unknown until they answer
+    std::string query = lookup.getPeers ? "get_peers" : "find_node";
+    for (const auto& [host, port] : bootstrapRouters) {
+        Peer router;
+        if (!ResolvePeer(host, std::atoi(port.c_str()), router, AF_INET)) {
+            SPDLOG_LOGGER_DEBUG(l, "Can not resolve DHT router {}", host);
+            continue;
+        }
+        Bencode::bencodeDict args;
+        args.elements[lookup.getPeers ? "info_hash" : "target"] = lookup.target;
+        SendQuery(query, std::move(args), std::string(), router, lookupId);
+        lookups_.at(lookupId).inFlight++;
+    }
+}
+
+void Dht::AddCandidates(Lookup& lookup, const std::vector<DhtNode>& nodes) {
+    for (const DhtNode& node : nodes) {
+        if (node.id == selfId_) {
+            continue;
+        }
+        bool known = std::any_of(lookup.candidates.begin(), lookup.candidates.end(), [&node](const Candidate& candidate) {
+            return candidate.node.id == node.id || candidate.node.endpoint == node.endpoint;
+        });
+        if (known) {
+            continue;
+        }
+        auto pos = std::find_if(lookup.candidates.begin(), lookup.candidates.end(), [&](const Candidate& candidate) {
+            return Closer(node.id, candidate.node.id, lookup.target);
+        });
+        if (pos == lookup.candidates.end() && lookup.candidates.size() >= lookupCandidates) {
+            continue;
+        }
+        lookup.candidates.insert(pos, Candidate{node, Candidate::State::Fresh, {}});
+        if (lookup.candidates.size() > lookupCandidates) {
+            // the farthest one is dropped, a query to it may still be running and is then ignored
+            lookup.candidates.pop_back();
+        }
+    }
+}
+
+void Dht::Step(uint64_t lookupId) {
+    Lookup& lookup = lookups_.at(lookupId);
+    size_t considered = 0;
+    for (Candidate& candidate : lookup.candidates) {
+        if (lookup.inFlight >= lookupAlpha || considered >= DhtRoutingTable::bucketSize) {
+            break;
+        }
+        if (candidate.state == Candidate::State::Failed) {
+            continue;
+        }
+        considered++;
+        if (candidate.state != Candidate::State::Fresh) {
+            continue;
+        }
+        Bencode::bencodeDict args;
+        args.elements[lookup.getPeers ? "info_hash" : "target"] = lookup.target;
+        SendQuery(lookup.getPeers ? "get_peers" : "find_node", std::move(args), candidate.node.id, candidate.node.endpoint, lookupId);
+        candidate.state = Candidate::State::Queried;
+        lookup.inFlight++;
+    }
+    // nothing in flight: the closest nodes all answered or failed
+    if (lookup.inFlight == 0) {
+        FinishLookup(lookupId);
+    }
+}
+
+void Dht::FinishLookup(uint64_t lookupId) {
+    Lookup lookup = std::move(lookups_.at(lookupId));
+    lookups_.erase(lookupId);
+    SPDLOG_LOGGER_DEBUG(l, "DHT lookup for {} done, {} peers found", HexEncode(lookup.target), lookup.peersFound);
+    if (!lookup.getPeers) {
+        return;
+    }
+    int announcePort = 0;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = torrents_.find(lookup.target);
+        if (it == torrents_.end()) {
+            return;
+        }
+        announcePort = it->second.announcePort;
+    }
+    size_t announced = 0;
+    for (const Candidate& candidate : lookup.candidates) {
+        if (announced >= DhtRoutingTable::bucketSize) {
+            break;
+        }
+        if (candidate.state != Candidate::State::Responded || candidate.token.empty()) {
+            continue;
+        }
+        Bencode::bencodeDict args;
+        args.elements["info_hash"] = lookup.target;
+        args.elements["port"] = static_cast<size_t>(announcePort);
+        args.elements["token"] = candidate.token;
+        SendQuery("announce_peer", std::move(args), candidate.node.id, candidate.node.endpoint, 0);
+        announced++;
+    }
+    l->info("DHT lookup for {} found {} peers, announced to {} nodes", HexEncode(lookup.target), lookup.peersFound, announced);
+}
+
+void Dht::Receive() {
+    char buf[2048];
+    while (true) {
+        sockaddr_in addr{};
+        socklen_t addrLen = sizeof(addr);
+        ssize_t received = recvfrom(sock_, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&addr), &addrLen);
+        if (received < 0) {
+            return;
+        }
+        if (received == 0 || buf[0] != 'd') {
+            continue;
+        }
+        Peer from = Peer::FromSockaddr(reinterpret_cast<sockaddr*>(&addr));
+
+        std::unique_ptr<Bencode::bencodeDict> message;
+        try {
+            message = Bencode::ParseDictRec(std::string(buf, static_cast<size_t>(received))).first;
+        } catch (const std::exception& e) {
+            SPDLOG_LOGGER_DEBUG(l, "Malformed DHT message from {}: {}", from.ToString(), e.what());
+            continue;
+        }
+        const std::string* transactionId = GetString(*message, "t");
+        const std::string* type = GetString(*message, "y");
+        if (!transactionId || !type) {
+            continue;
+        }
+        if (*type == "q") {
+            HandleQuery(*message, *transactionId, from);
+        } else if (*type == "r" || *type == "e") {
+            HandleResponse(*message, *transactionId, from);
+        }
+    }
+}
+
+void Dht::HandleQuery(const Bencode::bencodeDict& message, const std::string& transactionId, const Peer& from) {
+    const std::string* query = GetString(message, "q");
+    const Bencode::bencodeDict* args = GetDict(message, "a");
+    const std::string* nodeId = args ? GetId(*args, "id") : nullptr;
+    if (!query || !nodeId) {
+        SendError(203, "Protocol Error", transactionId, from);
+        return;
+    }
+    table_.Seen(*nodeId, from);
+
+    Bencode::bencodeDict response;
+    response.elements["id"] = selfId_;
+    if (*query == "ping") {
+        SendResponse(std::move(response), transactionId, from);
+    } else if (*query == "find_node") {
+        const std::string* target = GetId(*args, "target");
+        if (!target) {
+            SendError(203, "Protocol Error", transactionId, from);
+            return;
+        }
+        response.elements["nodes"] = EncodeNodes(table_.Closest(*target, DhtRoutingTable::bucketSize));
+        SendResponse(std::move(response), transactionId, from);
+    } else if (*query == "get_peers") {
+        const std::string* infoHash = GetId(*args, "info_hash");
+        if (!infoHash) {
+            SendError(203, "Protocol Error", transactionId, from);
+            return;
+        }
+        response.elements["token"] = MakeToken(from.Ip(), 0);
+        response.elements["nodes"] = EncodeNodes(table_.Closest(*infoHash, DhtRoutingTable::bucketSize));
+        auto stored = storedPeers_.find(*infoHash);
+        if (stored != storedPeers_.end()) {
+            auto expired = std::chrono::steady_clock::now() - storedPeerLifetime;
+            std::erase_if(stored->second, [expired](const StoredPeer& peer) { return peer.added < expired; });
+            auto values = Bencode::makeBencodeList();
+            for (const StoredPeer& peer : stored->second) {
+                values->elements.push_back(EncodeCompactPeers({peer.peer}));
+            }
+            if (!values->elements.empty()) {
+                response.elements["values"] = std::move(values);
+            }
+        }
+        SendResponse(std::move(response), transactionId, from);
+    } else if (*query == "announce_peer") {
+        const std::string* infoHash = GetId(*args, "info_hash");
+        const std::string* token = GetString(*args, "token");
+        const size_t* port = GetInt(*args, "port");
+        const size_t* impliedPort = GetInt(*args, "implied_port");
+        if (!infoHash || !token || (!port && !(impliedPort && *impliedPort))) {
+            SendError(203, "Protocol Error", transactionId, from);
+            return;
+        }
+        if (!CheckToken(*token, from.Ip())) {
+            SendError(203, "Bad token", transactionId, from);
+            return;
+        }
+        Peer peer = from;
+        if (!(impliedPort && *impliedPort)) {
+            if (*port == 0 || *port > 65535) {
+                SendError(203, "Protocol Error", transactionId, from);
+                return;
+            }
+            peer.port = static_cast<uint16_t>(*port);
+        }
+        std::deque<StoredPeer>& peers = storedPeers_[*infoHash];
+        std::erase_if(peers, [&peer](const StoredPeer& stored) { return stored.peer == peer; });
+        peers.push_back(StoredPeer{peer, std::chrono::steady_clock::now()});
+        if (peers.size() > maxStoredPeers) {
+            peers.pop_front();
+        }
+        SendResponse(std::move(response), transactionId, from);
+    } else {
+        SendError(204, "Method Unknown", transactionId, from);
+    }
+}
+
+void Dht::HandleResponse(const Bencode::bencodeDict& message, const std::string& transactionId, const Peer& from) {
+    auto it = transactions_.find(transactionId);
+    if (it == transactions_.end() || it->second.endpoint != from) {
+        return;
+    }
+    Transaction transaction = std::move(it->second);
+    transactions_.erase(it);
+
+    const Bencode::bencodeDict* values = GetDict(message, "r");
+    const std::string* nodeId = values ? GetId(*values, "id") : nullptr;
+    if (nodeId) {
+        table_.Seen(*nodeId, from);
+    } else {
+        SPDLOG_LOGGER_DEBUG(l, "DHT node {} answered {} with an error", from.ToString(), transaction.query);
+    }
+
+    auto lookupIt = lookups_.find(transaction.lookupId);
+    if (lookupIt == lookups_.end()) {
+        return;
+    }
+    Lookup& lookup = lookupIt->second;
+    lookup.inFlight--;
+    auto candidate = std::find_if(lookup.candidates.begin(), lookup.candidates.end(), [&from](const Candidate& c) {
+        return c.node.endpoint == from;
+    });
+    if (!nodeId) {
+        if (candidate != lookup.candidates.end()) {
+            candidate->state = Candidate::State::Failed;
+        }
+        Step(transaction.lookupId);
+        return;
+    }
+    if (candidate != lookup.candidates.end()) {
+        candidate->state = Candidate::State::Responded;
+        candidate->node.id = *nodeId;
+        if (const std::string* token = GetString(*values, "token")) {
+            candidate->token = *token;
+        }
+    }
+    if (const std::string* nodes = GetString(*values, "nodes")) {
+        AddCandidates(lookup, ParseNodes(*nodes));
+    }
+
+    auto peerValues = values->elements.find("values");
+    auto* peerList = peerValues == values->elements.end() ? nullptr :
+        std::get_if<std::unique_ptr<Bencode::bencodeList>>(&peerValues->second);
+    if (lookup.getPeers && peerList && *peerList) {
+        std::vector<Peer> peers;
+        for (const auto& value : (*peerList)->elements) {
+            if (const std::string* compact = std::get_if<std::string>(&value)) {
+                std::vector<Peer> parsed = ParseCompactPeers(*compact);
+                peers.insert(peers.end(), parsed.begin(), parsed.end());
+            }
+        }
+        lookup.peersFound += peers.size();
+        std::lock_guard<std::mutex> lock(mtx);
+        auto torrent = torrents_.find(lookup.target);
+        if (torrent != torrents_.end() && !peers.empty()) {
+            torrent->second.handler(peers);
+        }
+    }
+    Step(transaction.lookupId);
+}
+
+void Dht::ExpireTransactions() {
+    auto expired = std::chrono::steady_clock::now() - queryTimeout;
+    std::vector<Transaction> timedOut;
+    for (auto it = transactions_.begin(); it != transactions_.end();) {
+        if (it->second.sent < expired) {
+            timedOut.push_back(std::move(it->second));
+            it = transactions_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    // Step sends new queries, so the lookups continue only after the scan above
+    for (const Transaction& transaction : timedOut) {
+        if (!transaction.nodeId.empty()) {
+            table_.Failed(transaction.nodeId);
+        }
+        auto lookupIt = lookups_.find(transaction.lookupId);
+        if (lookupIt == lookups_.end()) {
+            continue;
+        }
+        Lookup& lookup = lookupIt->second;
+        lookup.inFlight--;
+        for (Candidate& candidate : lookup.candidates) {
+            if (candidate.node.endpoint == transaction.endpoint) {
+                candidate.state = Candidate::State::Failed;
+            }
+        }
+        Step(transaction.lookupId);
+    }
+}
+
+void Dht::SendQuery(const std::string& query, Bencode::bencodeDict&& args, const std::string& nodeId, const Peer& endpoint, uint64_t lookupId) {
+    std::string transactionId;
+    do {
+        uint16_t number = nextTransaction_++;
+        transactionId = std::string{static_cast<char>(number >> 8), static_cast<char>(number & 0xFF)};
+    } while (transactions_.count(transactionId));
+
+    args.elements["id"] = selfId_;
+    auto arguments = Bencode::makeBencodeDict();
+    arguments->elements = std::move(args.elements);
+    Bencode::bencodeDict message;
+    message.elements["t"] = transactionId;
+    message.elements["y"] = std::string("q");
+    message.elements["q"] = query;
+    message.elements["a"] = std::move(arguments);
+    SendTo(Bencode::Encode(message), endpoint);
+    transactions_[transactionId] = Transaction{query, nodeId, endpoint, lookupId, std::chrono::steady_clock::now()};
+}
+
+void Dht::SendResponse(Bencode::bencodeDict&& values, const std::string& transactionId, const Peer& to) {
+    auto response = Bencode::makeBencodeDict();
+    response->elements = std::move(values.elements);
+    Bencode::bencodeDict message;
+    message.elements["t"] = transactionId;
+    message.elements["y"] = std::string("r");
+    message.elements["r"] = std::move(response);
+    SendTo(Bencode::Encode(message), to);
+}
+
+void Dht::SendError(int code, const std::string& text, const std::string& transactionId, const Peer& to) {
+    auto error = Bencode::makeBencodeList();
+    error->elements.push_back(static_cast<size_t>(code));
+    error->elements.push_back(text);
+    Bencode::bencodeDict message;
+    message.elements["t"] = transactionId;
+    message.elements["y"] = std::string("e");
+    message.elements["e"] = std::move(error);
+    SendTo(Bencode::Encode(message), to);
+}
+
+void Dht::SendTo(const std::string& datagram, const Peer& to) {
+    // the socket is IPv4, BEP 32 nodes are not supported
+    if (!to.IsV4()) {
+        return;
+    }
+    sockaddr_storage addr;
+    socklen_t addrLen = to.ToSockaddr(addr);
+    // a full send buffer only loses this datagram, the query times out like any other lost one
+    sendto(sock_, datagram.data(), datagram.size(), 0, reinterpret_cast<sockaddr*>(&addr), addrLen);
+}
+
+std::string Dht::MakeToken(const std::string& ip, size_t secretIndex) const {
+    return CalculateSHA1(ip + tokenSecrets_[secretIndex]).substr(0, 8);
+}
+
+bool Dht::CheckToken(const std::string& token, const std::string& ip) const {
+    // tokens given out before the last rotation are still good
+    return token == MakeToken(ip, 0) || token == MakeToken(ip, 1);
+}
+
+std::string Dht::LoadNodeCache() {
+    std::ifstream file(nodeCache_, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (data.size() < idSize) {
+        std::mt19937 random(std::random_device{}());
+        return RandomBytes(idSize, random);
+    }
+    cachedNodes_ = ParseNodes(std::string_view(data).substr(idSize));
+    return data.substr(0, idSize);
+}
+
+void Dht::SaveNodeCache() const {
+    std::vector<DhtNode> nodes = table_.Closest(selfId_, table_.Size());
+    std::filesystem::path temporary = nodeCache_;
+    temporary += ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file << selfId_ << EncodeNodes(nodes);
+        if (!file) {
+            l->warn("Can not write DHT node cache {}", temporary.string());
+            return;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, nodeCache_, error);
+    if (error) {
+        l->warn("Can not save DHT node cache {}: {}", nodeCache_.string(), error.message());
+        return;
+    }
+    SPDLOG_LOGGER_DEBUG(l, "Saved {} DHT nodes to {}", nodes.size(), nodeCache_.string());
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include "peer.h"
+#include <string>
+#include <vector>
+#include <array>
+#include <map>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <filesystem>
+#include "spdlog/spdlog.h"
+
+namespace Bencode {
+    struct bencodeDict;
+}
+
+/*
+ * Node of the DHT, the id is 20 bytes like an infoHash
+ */
+struct DhtNode {
+    std::string id;
+    Peer endpoint;
+    std::chrono::steady_clock::time_point lastSeen;
+    int failedQueries = 0;
+};
+
+/*
+ * Kademlia routing table: nodes are kept in buckets by the length of the prefix their id shares with ours,
+ * at most `bucketSize` per bucket. A full bucket takes a new node only in place of one that stopped answering
+ */
+class DhtRoutingTable {
+public:
+    explicit DhtRoutingTable(const std::string& selfId);
+
+    // the node answered or sent a query
+    void Seen(const std::string& id, const Peer& endpoint);
+
+    // the node did not answer a query
+    void Failed(const std::string& id);
+
+    // up to `count` good nodes closest to `target`
+    std::vector<DhtNode> Closest(const std::string& target, size_t count) const;
+
+    size_t Size() const;
+
+    static constexpr size_t bucketSize = 8;  // K of Kademlia
+    static constexpr int maxFailedQueries = 2;  // a node that missed this many answers in a row can be replaced
+
+private:
+    size_t BucketIndex(const std::string& id) const;
+
+    std::string selfId_;
+    std::array<std::vector<DhtNode>, 160> buckets_;
+};
+
+/*
+ * Mainline DHT node, https://www.bittorrent.org/beps/bep_0005.html
+ * Answers ping, find_node, get_peers and announce_peer queries of other nodes and looks up peers
+ * for the torrents added to it: get_peers walks towards the infoHash, the peers found go to the torrent's handler
+ * and the closest nodes get our announce_peer. Torrents are looked up again every `searchInterval`.
+ * Known nodes are saved to a cache file and used for the next start instead of the bootstrap routers.
+ * Everything runs on one thread with one UDP socket.
+ */
+class Dht {
+public:
+    using PeersHandler = std::function<void(const std::vector<Peer>& peers)>;
+
+    /*
+     * bindAddress -- IPv4 address of the UDP socket, "0.0.0.0" for all interfaces
+     * nodeCache -- file with our node id and the nodes known at the last exit, created if missing
+     * Throws if the socket can not be bound
+     */
+    Dht(const std::string& bindAddress, int port, const std::filesystem::path& nodeCache);
+
+    // saves the node cache
+    ~Dht();
+
+    Dht(const Dht&) = delete;
+    Dht& operator=(const Dht&) = delete;
+
+    /*
+     * Look up peers for the torrent until RemoveTorrent, we are announced as a peer on `announcePort`.
+     * The handler is called on the DHT thread with the DHT lock held, it must not block
+     */
+    void AddTorrent(const std::string& infoHash, int announcePort, PeersHandler handler);
+
+    // after this returns the handler is not called anymore
+    void RemoveTorrent(const std::string& infoHash);
+
+    size_t NodeCount() const;
+
+    /*
+     * A peer told us its DHT port with a PORT message: the node is pinged from the DHT thread
+     * and goes into the routing table if it answers. Can be called from any thread
+     */
+    void PingNode(const Peer& endpoint);
+
+    int GetPort() const{
+        return port_;
+    }
+
+    static constexpr size_t lookupAlpha = 3;  // queries in flight per lookup
+    static constexpr std::chrono::seconds queryTimeout{5};
+    static constexpr std::chrono::minutes searchInterval{15};
+    static constexpr std::chrono::minutes refreshInterval{15};
+    static constexpr std::chrono::minutes tokenRotation{5};
+    static constexpr std::chrono::minutes storedPeerLifetime{30};
+    static constexpr size_t maxStoredPeers = 100;  // per infoHash from announce_peer of others
+    static constexpr size_t maxNodesToPing = 64;  // PORT messages waiting for the DHT thread, more are dropped
+
+private:
+    struct Torrent {
+        int announcePort;
+        PeersHandler handler;
+        std::chrono::steady_clock::time_point nextSearch;
+    };
+
+    struct Candidate {
+        DhtNode node;
+        enum class State {
+            Fresh,
+            Queried,
+            Responded,
+            Failed,
+        } state = State::Fresh;
+        std::string token;  // from the get_peers answer, needed to announce to the node
+    };
+
+    /*
+     * Iterative search for the nodes closest to `target`, get_peers for a torrent or find_node to fill the table
+     */
+    struct Lookup {
+        std::string target;
+        bool getPeers = false;
+        std::vector<Candidate> candidates;  // sorted by distance to target
+        size_t inFlight = 0;
+        size_t peersFound = 0;
+    };
+
+    struct Transaction {
+        std::string query;
+        std::string nodeId;  // empty for bootstrap routers
+        Peer endpoint;
+        uint64_t lookupId = 0;  // 0 if not sent by a lookup
+        std::chrono::steady_clock::time_point sent;
+    };
+
+    struct StoredPeer {
+        Peer peer;
+        std::chrono::steady_clock::time_point added;
+    };
+
+    void Run();
+
+    void Receive();
+    void HandleQuery(const Bencode::bencodeDict& message, const std::string& transactionId, const Peer& from);
+    void HandleResponse(const Bencode::bencodeDict& message, const std::string& transactionId, const Peer& from);
+    void ExpireTransactions();
+    void StartDueLookups();
+    void SendPings();
+
+    uint64_t StartLookup(const std::string& target, bool getPeers);
+
+    // lookup without nodes to start from: ask the bootstrap routers and the cached nodes
+    void SeedLookup(uint64_t lookupId);
+
+    // add nodes to the candidates, keeps the closest ones
+    void AddCandidates(Lookup& lookup, const std::vector<DhtNode>& nodes);
+
+    // send the next queries or finish the lookup
+    void Step(uint64_t lookupId);
+
+    void FinishLookup(uint64_t lookupId);
+
+    void SendQuery(const std::string& query, Bencode::bencodeDict&& args, const std::string& nodeId, const Peer& endpoint, uint64_t lookupId);
+    void SendResponse(Bencode::bencodeDict&& values, const std::string& transactionId, const Peer& to);
+    void SendError(int code, const std::string& text, const std::string& transactionId, const Peer& to);
+    void SendTo(const std::string& datagram, const Peer& to);
+
+    std::string MakeToken(const std::string& ip, size_t secretIndex) const;
+    bool CheckToken(const std::string& token, const std::string& ip) const;
+
+    // fills cachedNodes_ and returns the saved id, a new random one if there is no cache
+    std::string LoadNodeCache();
+    void SaveNodeCache() const;
+
+    // read before selfId_ is initialized, the cache keeps our id
+    std::filesystem::path nodeCache_;
+    std::vector<DhtNode> cachedNodes_;  // from the cache file, used to bootstrap
+    std::string selfId_;
+    DhtRoutingTable table_;
+    int sock_ = -1;
+    int port_;
+    std::unordered_map<std::string, Transaction> transactions_;
+    std::map<uint64_t, Lookup> lookups_;
+    uint64_t nextLookupId_ = 1;
+    uint16_t nextTransaction_ = 0;
+    std::map<std::string, std::deque<StoredPeer>> storedPeers_;  // infoHash -> peers announced to us
+    std::array<std::string, 2> tokenSecrets_;  // current and previous
+    std::chrono::steady_clock::time_point secretRotated_;
+    std::chrono::steady_clock::time_point nextRefresh_;
+    std::mt19937 random_;
+
+    mutable std::mutex mtx;  // guards torrents_ and nodesToPing_, everything else belongs to the DHT thread
+    std::map<std::string, Torrent> torrents_;  // infoHash -> torrent
+    std::vector<Peer> nodesToPing_;  // from PingNode
+    std::atomic<size_t> nodeCount_{0};
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+    std::shared_ptr<spdlog::logger> l;
+
+    static constexpr int pollIntervalMs = 250;
+    static constexpr size_t lookupCandidates = 3 * DhtRoutingTable::bucketSize;
+};
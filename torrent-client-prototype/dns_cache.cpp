@@ -0,0 +1,62 @@
+#include "dns_cache.h"
+
+#include <netdb.h>
+#include <algorithm>
+
+
+DnsCache& DnsCache::Shared() {
+    static DnsCache cache;
+    return cache;
+}
+
+std::vector<Peer> DnsCache::Resolve(const std::string& host, int port, int family) {
+    std::vector<Peer> addresses;
+    // textual addresses need no lookup
+    Peer literal(host, port);
+    if (literal.Valid()) {
+        if (family == AF_UNSPEC || (family == AF_INET) == literal.IsV4()) {
+            addresses.push_back(literal);
+        }
+        return addresses;
+    }
+
+    auto key = std::make_pair(host, family);
+    auto now = std::chrono::steady_clock::now();
+    bool cached = false;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries_.find(key);
+        if (it != entries_.end() && it->second.expires > now) {
+            addresses = it->second.addresses;
+            cached = true;
+        }
+    }
+    if (!cached) {
+        // outside of the lock, other hosts are looked up meanwhile
+        addrinfo hints{};
+        hints.ai_family = family;
+        hints.ai_socktype = SOCK_STREAM;  // one entry per address
+        addrinfo* info = nullptr;
+        if (getaddrinfo(host.c_str(), nullptr, &hints, &info) == 0) {
+            for (const addrinfo* node = info; node; node = node->ai_next) {
+                Peer address = Peer::FromSockaddr(node->ai_addr);
+                if (std::find(addresses.begin(), addresses.end(), address) == addresses.end()) {
+                    addresses.push_back(address);
+                }
+            }
+            freeaddrinfo(info);
+        }
+        std::chrono::seconds lifetime = addresses.empty() ? failureTtl : std::chrono::seconds(ttl);
+        std::lock_guard<std::mutex> lock(mtx);
+        entries_[key] = Entry{addresses, now + lifetime};
+    }
+    for (Peer& address : addresses) {
+        address.port = static_cast<uint16_t>(port);
+    }
+    return addresses;
+}
+
+void DnsCache::Forget(const std::string& host, int family) {
+    std::lock_guard<std::mutex> lock(mtx);
+    entries_.erase(std::make_pair(host, family));
+}
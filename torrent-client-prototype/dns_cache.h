@@ -0,0 +1,42 @@
+#pragma once
+
+#include "peer.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <sys/socket.h>
+
+/*
+ * Host name lookups shared by all trackers of all torrents. Re-announces and trackers on one host
+ * do not wait for getaddrinfo again until the entry expires, a host that can not be resolved is remembered too
+ * so a dead tracker does not cost a lookup on every retry.
+ * Lookups run on the announcing thread, never on a peer connection's
+ */
+class DnsCache {
+public:
+    /*
+     * Addresses of `host` with `port` filled in, IPv6 and IPv4 as getaddrinfo orders them
+     * unless `family` asks for one. Empty if the host can not be resolved
+     */
+    std::vector<Peer> Resolve(const std::string& host, int port, int family = AF_UNSPEC);
+
+    // none of the addresses of `host` could be reached, the next Resolve looks the host up again
+    void Forget(const std::string& host, int family = AF_UNSPEC);
+
+    // the cache of the process
+    static DnsCache& Shared();
+
+    static constexpr std::chrono::minutes ttl{15};
+    static constexpr std::chrono::seconds failureTtl{60};
+
+private:
+    struct Entry {
+        std::vector<Peer> addresses;  // port 0
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    std::mutex mtx;
+    std::map<std::pair<std::string, int>, Entry> entries_;  // (host, family) -> addresses
+};
@@ -0,0 +1,81 @@
+#include "http_session_pool.h"
+
+#include <cpr/cpr.h>
+
+
+bool ParseUrlOrigin(const std::string& url, UrlOrigin& origin) {
+    size_t schemeEnd = url.find("://");
+    if (schemeEnd == std::string::npos) {
+        return false;
+    }
+    origin.scheme = url.substr(0, schemeEnd);
+    if (origin.scheme != "http" && origin.scheme != "https") {
+        return false;
+    }
+    std::string authority = url.substr(schemeEnd + 3);
+    authority = authority.substr(0, authority.find_first_of("/?#"));
+    authority = authority.substr(authority.find('@') == std::string::npos ? 0 : authority.find('@') + 1);
+
+    std::string port;
+    if (!authority.empty() && authority.front() == '[') {
+        // IPv6 literal, http://[::1]:8080
+        size_t close = authority.find(']');
+        if (close == std::string::npos) {
+            return false;
+        }
+        origin.host = authority.substr(1, close - 1);
+        if (close + 1 < authority.size() && authority[close + 1] == ':') {
+            port = authority.substr(close + 2);
+        }
+    } else {
+        size_t colon = authority.rfind(':');
+        origin.host = authority.substr(0, colon);
+        if (colon != std::string::npos) {
+            port = authority.substr(colon + 1);
+        }
+    }
+    origin.port = port.empty() ? (origin.scheme == "https" ? 443 : 80) : std::atoi(port.c_str());
+    return !origin.host.empty() && origin.port > 0 && origin.port <= 65535;
+}
+
+HttpSessionPool::Lease::Lease(HttpSessionPool& pool, std::string origin, std::unique_ptr<cpr::Session> session) :
+    pool_(&pool), origin_(std::move(origin)), session_(std::move(session)) {}
+
+HttpSessionPool::Lease::~Lease() {
+    if (session_) {
+        pool_->Release(origin_, std::move(session_));
+    }
+}
+
+void HttpSessionPool::Lease::Discard() {
+    session_.reset();
+}
+
+HttpSessionPool::~HttpSessionPool() = default;
+
+HttpSessionPool& HttpSessionPool::Shared() {
+    static HttpSessionPool pool;
+    return pool;
+}
+
+HttpSessionPool::Lease HttpSessionPool::Acquire(const UrlOrigin& origin) {
+    std::string key = origin.Key();
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = idle_.find(key);
+        if (it != idle_.end() && !it->second.empty()) {
+            std::unique_ptr<cpr::Session> session = std::move(it->second.back());
+            it->second.pop_back();
+            return Lease(*this, std::move(key), std::move(session));
+        }
+    }
+    return Lease(*this, std::move(key), std::make_unique<cpr::Session>());
+}
+
+void HttpSessionPool::Release(const std::string& origin, std::unique_ptr<cpr::Session> session) {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<std::unique_ptr<cpr::Session>>& sessions = idle_[origin];
+    if (sessions.size() < maxIdlePerOrigin) {
+        sessions.push_back(std::move(session));
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace cpr {
+    class Session;
+}
+
+/*
+ * Scheme, host and port of an http(s) url, the part a connection can be reused for
+ */
+struct UrlOrigin {
+    std::string scheme;
+    std::string host;  // without the brackets of an IPv6 literal
+    int port = 0;
+
+    std::string Key() const{
+        return scheme + "://" + host + ":" + std::to_string(port);
+    }
+};
+
+// false if the url is not http:// or https://
+bool ParseUrlOrigin(const std::string& url, UrlOrigin& origin);
+
+/*
+ * Idle HTTP sessions by origin, shared by all trackers of all torrents.
+ * A session keeps its curl handle, so the next request to the same server reuses the kept-alive
+ * connection and the TLS session instead of a new handshake. A session is used by one thread at a time:
+ * Acquire takes it out of the pool and the lease puts it back
+ */
+class HttpSessionPool {
+public:
+    class Lease {
+    public:
+        Lease(HttpSessionPool& pool, std::string origin, std::unique_ptr<cpr::Session> session);
+
+        // gives the session back unless it was discarded
+        ~Lease();
+
+        Lease(Lease&&) = default;
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        cpr::Session& operator*() const{
+            return *session_;
+        }
+
+        cpr::Session* operator->() const{
+            return session_.get();
+        }
+
+        // the request failed, the connection may be broken: do not reuse it
+        void Discard();
+
+    private:
+        HttpSessionPool* pool_;
+        std::string origin_;
+        std::unique_ptr<cpr::Session> session_;
+    };
+
+    ~HttpSessionPool();
+
+    // an idle session for the origin or a new one
+    Lease Acquire(const UrlOrigin& origin);
+
+    // the pool of the process
+    static HttpSessionPool& Shared();
+
+    static constexpr size_t maxIdlePerOrigin = 4;
+
+private:
+    void Release(const std::string& origin, std::unique_ptr<cpr::Session> session);
+
+    std::mutex mtx;
+    std::map<std::string, std::vector<std::unique_ptr<cpr::Session>>> idle_;  // origin key -> sessions
+};
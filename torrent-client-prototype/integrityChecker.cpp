@@ -1,9 +1,223 @@
 #include "integrityChecker.h"
+#include "sha1_engine.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <numeric>
+#include <span>
+#include <cstring>
+#include <random>
+#include <iterator>
 
-bool CheckDownloadedPiecesIntegrity(const std::filesystem::path& outputPath, const TorrentFile& tf, PieceStorage& pieces, std::vector<size_t>& selectedIndices) {
+namespace {
+    // read-only mapping of a whole file, empty if the file is missing or empty
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::filesystem::path& path){
+            fd_ = open(path.c_str(), O_RDONLY);
+            if(fd_ < 0){
+                return;
+            }
+            struct stat st;
+            if(fstat(fd_, &st) < 0 || st.st_size == 0){
+                return;
+            }
+            void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+            if(mem == MAP_FAILED){
+                return;
+            }
+            madvise(mem, st.st_size, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(mem);
+            size_ = st.st_size;
+        }
+
+        ~MappedFile(){
+            if(data_){
+                munmap(const_cast<char*>(data_), size_);
+            }
+            if(fd_ >= 0){
+                close(fd_);
+            }
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const char* Data() const{
+            return data_;
+        }
+
+        size_t Size() const{
+            return size_;
+        }
+
+    private:
+        int fd_ = -1;
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+    };
+
+    // pieces claimed by a thread at once, consecutive pieces keep reads sequential
+    constexpr size_t CHUNK_PIECES = 16;
+
+    /*
+     * In Journal mode drop journaled pieces from `candidates`, except for a random sample of them.
+     * Pieces that are not in the journal are always kept.
+     */
+    std::vector<size_t> SelectPiecesToVerify(const std::vector<size_t>& candidates, const IntegrityCheckOptions& options, const PieceStorage& pieces){
+        auto l = spdlog::get("mainLogger");
+        if(options.mode == IntegrityCheckMode::Full){
+            return candidates;
+        }
+        std::vector<size_t> journaled = pieces.GetJournal().ReadVerifiedPieces();
+        std::sort(journaled.begin(), journaled.end());
+        journaled.erase(std::unique(journaled.begin(), journaled.end()), journaled.end());
+
+        std::vector<size_t> result;
+        std::vector<size_t> trusted;
+        for(size_t index : candidates){
+            if(std::binary_search(journaled.begin(), journaled.end(), index)){
+                trusted.push_back(index);
+            }else{
+                result.push_back(index);
+            }
+        }
+        std::vector<size_t> sample;
+        std::sample(trusted.begin(), trusted.end(), std::back_inserter(sample), options.spotCheckPieces, std::mt19937{std::random_device{}()});
+        l->info("Journal check: {} pieces journaled, {} not journaled, spot-checking {}", trusted.size(), result.size(), sample.size());
+        result.insert(result.end(), sample.begin(), sample.end());
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+}
+
+IntegrityCheckResult VerifyPiecesOnDisk(const TorrentFile& tf, const std::vector<size_t>& pieceIndices){
+    auto l = spdlog::get("mainLogger");
+    IntegrityCheckResult result;
+    result.piecesChecked = pieceIndices.size();
+    if(pieceIndices.empty()){
+        return result;
+    }
+
+    std::vector<std::unique_ptr<MappedFile>> files;
+    files.reserve(tf.filesList.size());
+    for(const auto& f : tf.filesList){
+        files.push_back(std::make_unique<MappedFile>(f.fullPath));
+    }
+
+    std::atomic<size_t> nextChunk{0};
+    size_t batchSize = std::max<size_t>(Sha1Engine::PreferredBatchSize(), 1);
+    size_t chunkPieces = std::max(CHUNK_PIECES, batchSize);
+    size_t chunksCount = (pieceIndices.size() + chunkPieces - 1) / chunkPieces;
+    size_t threadsCount = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, chunksCount);
+    std::vector<std::vector<size_t>> failedPerThread(threadsCount);
+
+    auto worker = [&](size_t threadIndex){
+        std::vector<size_t> batchPieces;
+        std::vector<std::span<const char>> batchData;
+        // pieces spanning several files are glued here, one buffer per batch slot
+        std::vector<std::string> scratch(batchSize);
+        std::vector<Sha1Digest> digests(batchSize);
+
+        auto flush = [&](){
+            Sha1Engine::HashBatch(batchData, std::span<Sha1Digest>(digests.data(), batchData.size()));
+            for(size_t i = 0; i < batchPieces.size(); ++i){
+                size_t pieceIndex = batchPieces[i];
+                if(Sha1Engine::ToString(digests[i]) != tf.pieceHashes[pieceIndex]){
+                    l->error("File piece with index {} has incorrect hash\n"
+                             "Expected: {}\n"
+                             "Got: {}",
+                             pieceIndex,
+                             HexEncode(tf.pieceHashes[pieceIndex]),
+                             HexEncode(Sha1Engine::ToString(digests[i])));
+                    failedPerThread[threadIndex].push_back(pieceIndex);
+                }
+            }
+            batchPieces.clear();
+            batchData.clear();
+        };
+
+        for(size_t chunk = nextChunk++; chunk < chunksCount; chunk = nextChunk++){
+            size_t chunkEnd = std::min(pieceIndices.size(), (chunk + 1) * chunkPieces);
+            for(size_t pos = chunk * chunkPieces; pos < chunkEnd; ++pos){
+                size_t pieceIndex = pieceIndices[pos];
+                size_t pieceBegin = pieceIndex * tf.pieceLength;
+                size_t pieceEnd = std::min(pieceBegin + tf.pieceLength, tf.length);
+                if(pieceIndex >= tf.pieceHashes.size() || pieceBegin >= pieceEnd){
+                    l->error("Piece index {} is out of the torrent range", pieceIndex);
+                    failedPerThread[threadIndex].push_back(pieceIndex);
+                    continue;
+                }
+
+                // collect the parts of the piece from every file it overlaps
+                std::vector<std::span<const char>> parts;
+                bool complete = true;
+                for(size_t fileIndex = 0; fileIndex < tf.filesList.size() && complete; ++fileIndex){
+                    const auto& f = tf.filesList[fileIndex];
+                    if(f.length == 0 || f.endOffset < pieceBegin || f.startOffset >= pieceEnd){
+                        continue;
+                    }
+                    size_t overlapBegin = std::max(pieceBegin, f.startOffset);
+                    size_t overlapEnd = std::min(pieceEnd, f.endOffset + 1);
+                    size_t localOffset = overlapBegin - f.startOffset;
+                    const MappedFile& mapped = *files[fileIndex];
+                    if(!mapped.Data() || localOffset + (overlapEnd - overlapBegin) > mapped.Size()){
+                        l->error("Piece index {}: {} is missing or too short", pieceIndex, f.fullPath.string());
+                        complete = false;
+                        break;
+                    }
+                    parts.emplace_back(mapped.Data() + localOffset, overlapEnd - overlapBegin);
+                }
+                if(!complete){
+                    failedPerThread[threadIndex].push_back(pieceIndex);
+                    continue;
+                }
+
+                if(parts.size() == 1){
+                    batchData.push_back(parts.front());
+                }else{
+                    std::string& glued = scratch[batchData.size()];
+                    glued.clear();
+                    for(const auto& part : parts){
+                        glued.append(part.data(), part.size());
+                    }
+                    batchData.emplace_back(glued.data(), glued.size());
+                }
+                batchPieces.push_back(pieceIndex);
+                if(batchData.size() == batchSize){
+                    flush();
+                }
+            }
+        }
+        flush();
+    };
+
+    std::vector<std::thread> threads;
+    for(size_t i = 1; i < threadsCount; ++i){
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for(auto& thread : threads){
+        thread.join();
+    }
+
+    for(const auto& failed : failedPerThread){
+        result.failedPieces.insert(result.failedPieces.end(), failed.begin(), failed.end());
+    }
+    std::sort(result.failedPieces.begin(), result.failedPieces.end());
+    l->info("Verified {} pieces on disk with {} threads, {} failed", result.piecesChecked, threadsCount, result.failedPieces.size());
+    return result;
+}
+
+bool CheckDownloadedPiecesIntegrity(const std::filesystem::path& outputPath, const TorrentFile& tf, PieceStorage& pieces, std::vector<size_t>& selectedIndices,
+                                    const IntegrityCheckOptions& options) {
     auto l = spdlog::get("mainLogger");
     l->info("Start downloaded pieces hash check for file: {}", outputPath.string());
     const auto& savedIndices = pieces.GetPiecesSavedToDiscIndices();
+    std::vector<size_t> failedPieces;
     
     // check for directory, file_size works?
     if(savedIndices.empty()){
@@ -46,58 +260,10 @@ bool CheckDownloadedPiecesIntegrity(const std::filesystem::path& outputPath, con
         }
 
 
-        std::ifstream file(outputPath, std::ios_base::binary);
-        
-        if (!file.is_open()) {
-            l->error("Cannot open file for integrity check: {} (no_such_file_or_directory)", 
-                    outputPath.string());
-            throw std::filesystem::filesystem_error(
-                "Cannot open file for integrity check:", outputPath,
-                std::make_error_code(std::errc::no_such_file_or_directory)
-            );
-        }
         // check each piece in the file and compare hashs
-        for (size_t pieceIndex = 0; pieceIndex <= maxPieceIndex; pieceIndex++) {
-            std::size_t pieceOffset = pieceIndex * tf.pieceLength;
-            std::size_t nextPieceOffset = (pieceIndex + 1) * tf.pieceLength;
-            std::size_t thisPieceSize = (nextPieceOffset > tf.length)
-                                        ? (tf.length - pieceOffset)
-                                        : tf.pieceLength;
-            
-            file.seekg(static_cast<std::streamoff>(pieceOffset), std::ios::beg);
-            if (!file.good()) {
-                l->error("Failed to seek to piece offset {} in file {}", 
-                        pieceOffset, outputPath.string());
-                throw std::filesystem::filesystem_error(
-                    "Failed to seek to piece offset", outputPath,
-                    std::make_error_code(std::errc::no_such_file_or_directory)
-                );
-            }
-            std::string pieceDataFromFile(thisPieceSize, '\0');
-            file.read(pieceDataFromFile.data(), static_cast<std::streamsize>(thisPieceSize));
-            size_t bytesRead = static_cast<std::size_t>(file.gcount());
-            
-            if (bytesRead != thisPieceSize) {
-                std::string errMsg = 
-                    "Could not read full piece from file. Expected " +
-                    std::to_string(thisPieceSize) + " bytes, got " + std::to_string(bytesRead);
-                l->error("{}", errMsg);
-                throw std::runtime_error(errMsg);
-            }
-
-            const std::string realHash = CalculateSHA1(pieceDataFromFile);
-            if (realHash != tf.pieceHashes[pieceIndex]) {
-                l->error("File piece with index {} has incorrect hash\n"
-                        "Expected: {}\n"
-                        "Got: {}",
-                        pieceIndex,
-                        HexEncode(tf.pieceHashes[pieceIndex]),
-                        HexEncode(realHash));
-                throw std::runtime_error(
-                    "Wrong piece hash for index " + std::to_string(pieceIndex)
-                );
-            }
-        }
+        std::vector<size_t> toVerify(maxPieceIndex + 1);
+        std::iota(toVerify.begin(), toVerify.end(), 0);
+        failedPieces = VerifyPiecesOnDisk(tf, SelectPiecesToVerify(toVerify, options, pieces)).failedPieces;
     }else{ // multi file 
       
         // We'll check each file in the torrent that was selected for download.
@@ -150,96 +316,11 @@ bool CheckDownloadedPiecesIntegrity(const std::filesystem::path& outputPath, con
         }
 
         // check all piece hashs
-        size_t maxPieceIndex = pieceIndices.back();
-
-        for (size_t pieceIndex : pieceIndices) {
-            // The global offset range for this piece
-            size_t pieceGlobalBegin = pieceIndex * tf.pieceLength;
-            size_t pieceGlobalEnd   = pieceGlobalBegin + tf.pieceLength;
-            if (pieceGlobalEnd > tf.length) {
-                pieceGlobalEnd = tf.length; 
-            }
-            size_t pieceSize = pieceGlobalEnd - pieceGlobalBegin;
-            if (pieceSize == 0) {
-                continue;
-            }
-
-            // We need to read [pieceGlobalBegin, pieceGlobalEnd) from the disk
-            std::string pieceData;
-            pieceData.reserve(pieceSize);
-
-            // Iterate over each file that might overlap this piece
-            size_t bytesRemaining = pieceSize;
-            size_t readCursor = pieceGlobalBegin; 
-
-            for (size_t fileIndex = 0; fileIndex < tf.filesList.size(); fileIndex++) {
-                const auto &f = tf.filesList[fileIndex];
-                if (readCursor >= pieceGlobalEnd) {
-                    break; // done
-                }
-                if (f.endOffset < readCursor || f.startOffset > pieceGlobalEnd) {
-                    // no overlap
-                    continue;
-                }
-
-                // Overlap region: [overlapBegin, overlapEnd)
-                size_t overlapBegin = std::max(readCursor, f.startOffset);
-                size_t overlapEnd   = std::min(pieceGlobalEnd, f.endOffset + 1);
-                if (overlapEnd <= overlapBegin) {
-                    continue;
-                }
-                size_t chunkSize = overlapEnd - overlapBegin;
-
-                std::ifstream ifs(f.fullPath, std::ios::binary);
-                if(!ifs.is_open()) {
-                    l->error("Failed to open file {} to read piece data", f.fullPath.string());
-                    throw std::runtime_error("Cannot open file for piece read");
-                }
-                // Seek to the appropriate offset
-                std::streamoff localOffset = static_cast<std::streamoff>(overlapBegin - f.startOffset);
-                ifs.seekg(localOffset, std::ios::beg);
-                if(!ifs.good()) {
-                    l->error("Cannot seek to offset {} in file {}", localOffset, f.fullPath.string());
-                    throw std::runtime_error("Seek error in multi-file read");
-                }
-
-                // Read chunkSize bytes
-                std::string chunk(chunkSize, '\0');
-                ifs.read(chunk.data(), static_cast<std::streamsize>(chunkSize));
-                size_t bytesRead = static_cast<size_t>(ifs.gcount());
-                if (bytesRead != chunkSize) {
-                    l->error("Wanted to read {} bytes from {}, got {} bytes", chunkSize, f.fullPath.string(), bytesRead);
-                    throw std::runtime_error("Partial read in multi-file check");
-                }
-
-                // Append to pieceData
-                pieceData.append(chunk);
-
-                // Advance readCursor
-                readCursor += chunkSize;
-                bytesRemaining -= chunkSize;
-                if (bytesRemaining == 0) {
-                    break; // we have the whole piece
-                }
-            }
-
-            //  pieceData should have the entire piece (pieceSize bytes) from 1 or multiple files.
-            if (pieceData.size() != pieceSize) {
-                l->error("Piece index {}: expected {} bytes, got {} in multi-file read", pieceIndex, pieceSize, pieceData.size());
-                throw std::runtime_error("Piece read mismatch in multi-file");
-            }
-
-            // Compare the SHA1 hash of pieceData and from .torrent file
-            const std::string realHash = CalculateSHA1(pieceData);
-            if (realHash != tf.pieceHashes[pieceIndex]) {
-                l->error("Multi-file piece index {} has incorrect hash.\n"
-                         "Expected: {}\nGot: {}",
-                         pieceIndex,
-                         HexEncode(tf.pieceHashes[pieceIndex]),
-                         HexEncode(realHash));
-                throw std::runtime_error("Wrong piece hash for index " + std::to_string(pieceIndex));
-            }
-        } // end for pieceIndex
+        failedPieces = VerifyPiecesOnDisk(tf, SelectPiecesToVerify(pieceIndices, options, pieces)).failedPieces;
+        if(!failedPieces.empty()){
+            l->error("Multi-file: {} of {} downloaded pieces have incorrect hash", failedPieces.size(), pieceIndices.size());
+            return false;
+        }
 
         l->info("Multi-file: all downloaded pieces have correct hash.");
         for (size_t fileIndex = 0; fileIndex < tf.filesList.size(); fileIndex++) {
@@ -248,6 +329,10 @@ bool CheckDownloadedPiecesIntegrity(const std::filesystem::path& outputPath, con
             }
         }
     } // end multipleFiles else
+    if(!failedPieces.empty()){
+        l->error("{} downloaded pieces have incorrect hash", failedPieces.size());
+        return false;
+    }
     l->info("All downloaded pieces have correct hash.");
     
     return true;
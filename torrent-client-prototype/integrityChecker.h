@@ -6,10 +6,34 @@
 #include <vector>
 #include <algorithm>
 #include <fstream>
+enum class IntegrityCheckMode {
+    Full,     // read back and hash every downloaded piece
+    Journal,  // trust pieces from the verification journal, re-read only a random sample of them
+};
+
+struct IntegrityCheckOptions {
+    IntegrityCheckMode mode = IntegrityCheckMode::Full;
+    size_t spotCheckPieces = 16;  // journaled pieces still read back in Journal mode
+};
+
+struct IntegrityCheckResult {
+    size_t piecesChecked = 0;
+    std::vector<size_t> failedPieces;  // hash mismatch or data missing on disk, sorted
+};
+
+/**
+ * Hash the given pieces straight from the files on disk (mmap), split across a thread pool.
+ * Every piece is checked, failures are collected instead of stopping at the first one.
+ * Files are taken from tf.filesList[i].fullPath.
+ */
+IntegrityCheckResult VerifyPiecesOnDisk(const TorrentFile& tf, const std::vector<size_t>& pieceIndices);
+
 /**
  * If -no-check is NOT specified, this function is called to verify
  * that all downloaded pieces match their expected SHA1 hash.
  * outputPath    - In single-file mode, the exact file path;
  *                 in multi-file mode, the base directory.
+ * Returns false if any piece has a wrong hash, every such piece is logged.
  */
-bool CheckDownloadedPiecesIntegrity(const std::filesystem::path& outputPath, const TorrentFile& tf, PieceStorage& pieces, std::vector<size_t>& selectedIndices);
\ No newline at end of file
+bool CheckDownloadedPiecesIntegrity(const std::filesystem::path& outputPath, const TorrentFile& tf, PieceStorage& pieces, std::vector<size_t>& selectedIndices,
+                                    const IntegrityCheckOptions& options = IntegrityCheckOptions());
\ No newline at end of file
@@ -0,0 +1,196 @@
+#include "lsd.h"
+#include "byte_tools.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+    constexpr size_t maxDatagramSize = 1400;
+
+    bool HexDecode(const std::string& hex, std::string& result) {
+        if (hex.size() % 2) {
+            return false;
+        }
+        result.clear();
+        for (size_t i = 0; i < hex.size(); i += 2) {
+            int value = 0;
+            for (size_t j = i; j < i + 2; ++j) {
+                char c = static_cast<char>(std::tolower(static_cast<unsigned char>(hex[j])));
+                if (!std::isxdigit(static_cast<unsigned char>(c))) {
+                    return false;
+                }
+                value = value * 16 + (std::isdigit(static_cast<unsigned char>(c)) ? c - '0' : c - 'a' + 10);
+            }
+            result += static_cast<char>(value);
+        }
+        return true;
+    }
+
+    std::string Trim(const std::string& str) {
+        size_t begin = str.find_first_not_of(" \t\r");
+        size_t end = str.find_last_not_of(" \t\r");
+        return begin == std::string::npos ? std::string() : str.substr(begin, end - begin + 1);
+    }
+}
+
+
+LocalDiscovery::LocalDiscovery() {
+    l = spdlog::get("mainLogger");
+    sock_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_ < 0) {
+        throw std::runtime_error(std::string("Local discovery socket error: ") + std::strerror(errno));
+    }
+    // every client on the host listens on the same port
+    int yes = 1;
+    setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    setsockopt(sock_, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(multicastPort);
+    ip_mreq group{};
+    inet_pton(AF_INET, multicastAddress, &group.imr_multiaddr);
+    group.imr_interface.s_addr = htonl(INADDR_ANY);
+    unsigned char ttl = 1;  // stay inside the LAN
+    if (bind(sock_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        setsockopt(sock_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &group, sizeof(group)) < 0 ||
+        setsockopt(sock_, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+        std::string err = std::strerror(errno);
+        close(sock_);
+        throw std::runtime_error("Can not join local discovery group: " + err);
+    }
+    fcntl(sock_, F_SETFL, O_NONBLOCK);
+
+    std::random_device random;
+    cookie_ = std::to_string(random()) + std::to_string(random());
+    l->info("Local peer discovery on {}:{}", multicastAddress, multicastPort);
+    thread_ = std::thread(&LocalDiscovery::Run, this);
+}
+
+LocalDiscovery::~LocalDiscovery() {
+    stop_.store(true);
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    close(sock_);
+}
+
+void LocalDiscovery::AddTorrent(const std::string& infoHash, int announcePort, PeersHandler handler) {
+    std::lock_guard<std::mutex> lock(mtx);
+    torrents_[infoHash] = Torrent{announcePort, std::move(handler), std::chrono::steady_clock::now()};
+}
+
+void LocalDiscovery::RemoveTorrent(const std::string& infoHash) {
+    std::lock_guard<std::mutex> lock(mtx);
+    torrents_.erase(infoHash);
+}
+
+void LocalDiscovery::Run() {
+    while (!stop_.load()) {
+        pollfd p{sock_, POLLIN, 0};
+        int ready = poll(&p, 1, pollIntervalMs);
+        if (ready < 0 && errno != EINTR) {
+            l->error("Local discovery poll error: {}", std::strerror(errno));
+            return;
+        }
+        if (ready > 0) {
+            Receive();
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        std::vector<std::pair<std::string, int>> due;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (auto& [infoHash, torrent] : torrents_) {
+                if (now >= torrent.nextAnnounce) {
+                    torrent.nextAnnounce = now + announceInterval;
+                    due.emplace_back(infoHash, torrent.announcePort);
+                }
+            }
+        }
+        for (const auto& [infoHash, port] : due) {
+            Announce(infoHash, port);
+        }
+    }
+}
+
+void LocalDiscovery::Announce(const std::string& infoHash, int port) {
+    std::string message = "BT-SEARCH * HTTP/1.1\r\n"
+                          "Host: " + std::string(multicastAddress) + ":" + std::to_string(multicastPort) + "\r\n"
+                          "Port: " + std::to_string(port) + "\r\n"
+                          "Infohash: " + HexEncode(infoHash) + "\r\n"
+                          "cookie: " + cookie_ + "\r\n"
+                          "\r\n\r\n";
+    sockaddr_in group{};
+    group.sin_family = AF_INET;
+    group.sin_port = htons(multicastPort);
+    inet_pton(AF_INET, multicastAddress, &group.sin_addr);
+    if (sendto(sock_, message.data(), message.size(), 0, reinterpret_cast<sockaddr*>(&group), sizeof(group)) < 0) {
+        SPDLOG_LOGGER_DEBUG(l, "Local discovery announce failed: {}", std::strerror(errno));
+        return;
+    }
+    SPDLOG_LOGGER_DEBUG(l, "Announced {} on the local network", HexEncode(infoHash));
+}
+
+void LocalDiscovery::Receive() {
+    char buf[maxDatagramSize];
+    while (true) {
+        sockaddr_in addr{};
+        socklen_t addrLen = sizeof(addr);
+        ssize_t received = recvfrom(sock_, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&addr), &addrLen);
+        if (received < 0) {
+            return;
+        }
+        std::istringstream message(std::string(buf, static_cast<size_t>(received)));
+        std::string line;
+        if (!std::getline(message, line) || Trim(line) != "BT-SEARCH * HTTP/1.1") {
+            continue;
+        }
+        int port = 0;
+        std::string cookie;
+        std::vector<std::string> infoHashes;  // one announce may carry several
+        while (std::getline(message, line)) {
+            size_t colon = line.find(':');
+            if (colon == std::string::npos) {
+                continue;
+            }
+            std::string name = Trim(line.substr(0, colon));
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+            std::string value = Trim(line.substr(colon + 1));
+            std::string infoHash;
+            if (name == "port") {
+                port = std::atoi(value.c_str());
+            } else if (name == "cookie") {
+                cookie = value;
+            } else if (name == "infohash" && value.size() == 40 && HexDecode(value, infoHash)) {
+                infoHashes.push_back(infoHash);
+            }
+        }
+        if (cookie == cookie_ || port <= 0 || port > 65535) {
+            continue;
+        }
+        // the announce carries only the port, the address is the sender's
+        Peer peer = Peer::FromSockaddr(reinterpret_cast<sockaddr*>(&addr));
+        peer.port = static_cast<uint16_t>(port);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        for (const std::string& infoHash : infoHashes) {
+            auto it = torrents_.find(infoHash);
+            if (it != torrents_.end()) {
+                l->info("Local peer {} has {}", peer.ToString(), HexEncode(infoHash));
+                it->second.handler({peer});
+            }
+        }
+    }
+}
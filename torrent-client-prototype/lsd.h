@@ -0,0 +1,66 @@
+#pragma once
+
+#include "peer.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include "spdlog/spdlog.h"
+
+/*
+ * Local Service Discovery, https://www.bittorrent.org/beps/bep_0014.html
+ * Announces our torrents to the LAN multicast group and listens for the announces of other clients,
+ * a peer on the same network is found without any tracker and is much faster to download from.
+ * Everything runs on one thread with one UDP socket.
+ */
+class LocalDiscovery {
+public:
+    using PeersHandler = std::function<void(const std::vector<Peer>& peers)>;
+
+    /*
+     * Join the multicast group on all interfaces, throws if the socket can not be set up
+     */
+    LocalDiscovery();
+    ~LocalDiscovery();
+
+    LocalDiscovery(const LocalDiscovery&) = delete;
+    LocalDiscovery& operator=(const LocalDiscovery&) = delete;
+
+    /*
+     * Announce the torrent with our peer port `announcePort` until RemoveTorrent and report the LAN peers that have it.
+     * The handler is called on the discovery thread with the lock held, it must not block
+     */
+    void AddTorrent(const std::string& infoHash, int announcePort, PeersHandler handler);
+
+    // after this returns the handler is not called anymore
+    void RemoveTorrent(const std::string& infoHash);
+
+    static constexpr const char* multicastAddress = "239.192.152.143";
+    static constexpr int multicastPort = 6771;
+    static constexpr std::chrono::minutes announceInterval{5};
+
+private:
+    struct Torrent {
+        int announcePort;
+        PeersHandler handler;
+        std::chrono::steady_clock::time_point nextAnnounce;
+    };
+
+    void Run();
+    void Receive();
+    void Announce(const std::string& infoHash, int port);
+
+    int sock_ = -1;
+    std::string cookie_;  // tells our own announces apart, the group loops them back to us
+    std::atomic<bool> stop_{false};
+    std::mutex mtx;
+    std::map<std::string, Torrent> torrents_;  // infoHash -> torrent
+    std::thread thread_;
+    std::shared_ptr<spdlog::logger> l;
+
+    static constexpr int pollIntervalMs = 500;
+};
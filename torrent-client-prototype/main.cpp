@@ -1,6 +1,12 @@
-#include "torrent_tracker.h"
+#include "announcer.h"
 #include "piece_storage.h"
 #include "peer_connect.h"
+#include "peer_pool.h"
+#include "peer_listener.h"
+#include "dht.h"
+#include "lsd.h"
+#include "webseed.h"
+#include "choker.h"
 #include "byte_tools.h"
 #include "integrityChecker.h"
 #include "userIO.h"
@@ -12,12 +18,21 @@
 #include <string>
 #include <system_error>
 #include <algorithm>
+#include <list>
+#include <atomic>
+#include <mutex>
 #include "spdlog/spdlog.h"
+#include "spdlog/async.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/sinks/basic_file_sink.h"
 
 
 const int peerRequestsForTrackerLimit = 10;
+const std::chrono::seconds noPeersWait{30};  // how long to wait for the trackers before counting a retry
+const size_t maxPeerConnections = 50;  // outgoing and incoming together
+const int defaultListenPort = 12345;
+const int defaultDhtPort = 6881;
+const size_t logQueueSize = 8192;  // messages waiting for the logging thread, producers block when it is full
 
 std::string RandomString(size_t length) {
     std::random_device random;
@@ -57,11 +72,14 @@ void logInit(spdlog::level::level_enum consoleLevel){
     auto debugLogFileSink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("Logs/debug.log");
     debugLogFileSink->set_level(spdlog::level::trace);
 
-    std::shared_ptr<spdlog::logger> logger = std::make_shared<spdlog::logger>("mainLogger");
-    logger->sinks().push_back(consoleSink);
-    logger->sinks().push_back(debugLogFileSink);
+    // formatting and writing happen on a separate logging thread, not in the peer threads
+    spdlog::init_thread_pool(logQueueSize, 1);
+    std::shared_ptr<spdlog::logger> logger = std::make_shared<spdlog::async_logger>(
+        "mainLogger", spdlog::sinks_init_list{consoleSink, debugLogFileSink}, spdlog::thread_pool(),
+        spdlog::async_overflow_policy::block);
     logger->set_level(spdlog::level::trace);
     logger->set_pattern("%d.%m.%Y %T [%^%l%$] [%n] %v");
+    logger->flush_on(spdlog::level::err);
     spdlog::flush_every(std::chrono::seconds(5));
 
     spdlog::register_logger(logger);
@@ -140,105 +158,256 @@ std::filesystem::path PrepareDownloadDirectory(const std::filesystem::path& user
     return userPath;
 }
 
-bool RunDownloadMultithread(PieceStorage& pieces, const TorrentFile& torrentFile, const std::string& ourId, const TorrentTracker& tracker, size_t percent) {
+/*
+ * Connection to one peer and the thread that runs it
+ */
+struct PeerWorker {
+    PeerWorker(const Peer& peer_, const TorrentFile& torrentFile, const std::string& ourId, PieceStorage& pieces, PeerPool& peerPool, Dht* dht) :
+        peer(peer_), connect(peer_, torrentFile, ourId, pieces, peerPool, dht) {}
+
+    // the peer connected to us, it is not in the PeerPool
+    PeerWorker(TcpConnect&& socket, std::string handshake, const TorrentFile& torrentFile, const std::string& ourId, PieceStorage& pieces, PeerPool& peerPool,
+               Dht* dht) :
+        peer(socket.GetPeer()), connect(std::move(socket), std::move(handshake), torrentFile, ourId, pieces, peerPool, dht), inbound(true) {}
+
+    Peer peer;
+    PeerConnect connect;
+    bool inbound = false;
+    std::thread thread;
+    std::atomic<bool> finished{false};
+};
+
+void StartPeerWorker(PeerWorker& worker) {
+    worker.thread = std::thread(
+            [&worker] () {
+                auto lthread = spdlog::get("mainLogger");
+                bool tryAgain = true;
+                int attempts = 0;
+                do {
+                    try {
+                        ++attempts;
+                        worker.connect.Run();
+                    } catch (const std::runtime_error& e) {
+                    lthread->error("Peer thread pool Runtime error: {}", e.what());
+                    } catch (const std::exception& e) {
+                        lthread->error("Peer thread pool Exception: {}", e.what());
+                    } catch (...) {
+                        lthread->error("Peer thread pool Unknown error");
+                    }
+                    tryAgain = worker.connect.Failed() && attempts < 1;//change back to 3 ! debug only
+                } while (tryAgain);
+                worker.finished.store(true);
+            }
+    );
+}
+
+/*
+ * Connections accepted by PeerListener for this torrent, waiting for a free worker slot
+ */
+struct InboundPeers {
+    struct Connection {
+        TcpConnect socket;
+        std::string handshake;
+    };
+
+    std::mutex mtx;
+    std::vector<Connection> connections;
+};
+
+bool AnyWebSeedActive(const std::list<WebSeed>& webSeeds) {
+    return std::any_of(webSeeds.begin(), webSeeds.end(), [](const WebSeed& seed) {
+        return seed.Active();
+    });
+}
+
+/*
+ * Download with peers from `peerPool`, new connections are opened as peers arrive (tracker, ut_pex)
+ * and closed ones are replaced. Web seeds download from the same queue on their own threads.
+ * dht -- exchanges DHT ports with the peers, nullptr if disabled
+ * Returns false if all connections are gone, the pool has no more peers and no web seed works
+ */
+bool RunDownloadMultithread(PieceStorage& pieces, const TorrentFile& torrentFile, const std::string& ourId, PeerPool& peerPool, Dht* dht,
+                            InboundPeers& inbound, Announcer& announcer, const std::list<WebSeed>& webSeeds, size_t percent) {
     using namespace std::chrono_literals;
     auto l = spdlog::get("mainLogger");
-    std::vector<std::thread> peerThreads;
-    std::vector<PeerConnect> peerConnections;
+    std::list<PeerWorker> workers;  // PeerConnect is referenced by its thread, std::list does not move elements
+    Choker choker;
+    std::vector<PeerConnect*> connections;
 
-    for (const Peer& peer : tracker.GetPeers()) {
-        peerConnections.emplace_back(peer, torrentFile, ourId, pieces);
-    }
-
-    for (PeerConnect& peerConnect : peerConnections) {
-        peerThreads.emplace_back(
-                [&peerConnect] () {
-                    auto lthread = spdlog::get("mainLogger");
-                    bool tryAgain = true;
-                    int attempts = 0;
-                    do {
-                        try {
-                            ++attempts;
-                            peerConnect.Run();
-                        } catch (const std::runtime_error& e) {
-                        lthread->error("Peer thread pool Runtime error: {}", e.what());
-                        } catch (const std::exception& e) {
-                            lthread->error("Peer thread pool Exception: {}", e.what());
-                        } catch (...) {
-                            lthread->error("Peer thread pool Unknown error");
-                        }
-                        tryAgain = peerConnect.Failed() && attempts < 1;//change back to 3 ! debug only
-                    } while (tryAgain);
-                }
-        );
-    }
+    auto stopAll = [&workers, &peerPool]() {
+        for (PeerWorker& worker : workers) {
+            worker.connect.Terminate();
+        }
+        for (PeerWorker& worker : workers) {
+            worker.thread.join();
+            if (!worker.inbound) {
+                peerPool.MarkDisconnected(worker.peer);
+            }
+        }
+        workers.clear();
+    };
 
-    std::this_thread::sleep_for(10s);
-    l->info("Main thread awake after sleep, all jobs are set");
     l->info("Expected number of pieces: {}", pieces.TotalPiecesCount());
     while (pieces.PiecesSavedToDiscCount() < pieces.TotalPiecesCount()) {
-        l->info("In loop, PiecesSavedToDiscCount = {}, PiecesInProgressCount = {}, peerThreads.size() = {}",
+        // reap finished connections
+        for (auto it = workers.begin(); it != workers.end();) {
+            if (it->finished.load()) {
+                it->thread.join();
+                if (!it->inbound) {
+                    peerPool.MarkDisconnected(it->peer);
+                }
+                it = workers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        // peers that came to us first, they are already connected
+        std::vector<InboundPeers::Connection> accepted;
+        {
+            std::lock_guard<std::mutex> lock(inbound.mtx);
+            accepted.swap(inbound.connections);
+        }
+        for (InboundPeers::Connection& connection : accepted) {
+            if (workers.size() >= maxPeerConnections) {
+                SPDLOG_LOGGER_DEBUG(l, "Connection limit reached, closing incoming peer {}", connection.socket.GetIp());
+                continue;
+            }
+            StartPeerWorker(workers.emplace_back(std::move(connection.socket), std::move(connection.handshake),
+                                                 torrentFile, ourId, pieces, peerPool, dht));
+        }
+
+        size_t freeSlots = workers.size() < maxPeerConnections ? maxPeerConnections - workers.size() : 0;
+        for (const Peer& peer : peerPool.TakePending(freeSlots)) {
+            StartPeerWorker(workers.emplace_back(peer, torrentFile, ourId, pieces, peerPool, dht));
+        }
+        if (workers.size() < maxPeerConnections / 2 && peerPool.PendingCount() == 0) {
+            announcer.RequestPeers();  // the announcer keeps to the trackers' min interval
+        }
+
+        connections.clear();
+        for (PeerWorker& worker : workers) {
+            connections.push_back(&worker.connect);
+        }
+        choker.Update(connections);
+
+        l->info("In loop, PiecesSavedToDiscCount = {}, PiecesInProgressCount = {}, connections = {}, known peers = {}, uploaded = {}",
                 pieces.PiecesSavedToDiscCount(),
                 pieces.PiecesInProgressCount(),
-                peerThreads.size());
-        if (pieces.PiecesInProgressCount() == 0) {
+                workers.size(),
+                peerPool.KnownCount(),
+                pieces.bytesUploaded.load());
+        // slower trackers may still bring peers
+        if (workers.empty() && !announcer.InFlight() && !AnyWebSeedActive(webSeeds)) {
             l->warn("Want to download more pieces but all peer connections are not working. Requesting new peers...");
-
-            for (PeerConnect& peerConnect : peerConnections) {
-                peerConnect.Terminate();
-            }
-            for (std::thread& thread : peerThreads) {
-                thread.join();
-            }
             return false;
         }
         std::this_thread::sleep_for(1s);
     }
     l->info("All pieces are saved to disk");
 
-    for (PeerConnect& peerConnect : peerConnections) {
-        peerConnect.Terminate();
-    }
-
-    for (std::thread& thread : peerThreads) {
-        thread.join();
-    }
+    stopAll();
     l->info("END RunDownloadMultithread");
     return true;
 }
 
-void DownloadTorrentFile(const TorrentFile& torrentFile, PieceStorage& pieces, const std::string& ourId, size_t percent) {
+/*
+ * Routes the listener's connections for one torrent into InboundPeers while it is alive
+ */
+class InboundRegistration {
+public:
+    InboundRegistration(PeerListener* listener, const std::string& infoHash, InboundPeers& inbound) :
+        listener_(listener), infoHash_(infoHash) {
+        if (!listener_) {
+            return;
+        }
+        listener_->AddTorrent(infoHash_, [&inbound](TcpConnect&& socket, std::string handshake) {
+            std::lock_guard<std::mutex> lock(inbound.mtx);
+            if (inbound.connections.size() < maxPeerConnections) {
+                inbound.connections.push_back(InboundPeers::Connection{std::move(socket), std::move(handshake)});
+            }
+        });
+    }
+
+    ~InboundRegistration() {
+        if (listener_) {
+            listener_->RemoveTorrent(infoHash_);
+        }
+    }
+
+    InboundRegistration(const InboundRegistration&) = delete;
+    InboundRegistration& operator=(const InboundRegistration&) = delete;
+private:
+    PeerListener* listener_;
+    std::string infoHash_;
+};
+
+/*
+ * Feeds the peers a discovery service (Dht, LocalDiscovery) finds for one torrent into its PeerPool while it is alive.
+ * Private torrents (BEP 27) get peers from their trackers only
+ */
+template <class Discovery>
+class DiscoveryRegistration {
+public:
+    DiscoveryRegistration(Discovery* discovery, PeerSource source, const TorrentFile& torrentFile, int listenPort, PeerPool& peerPool) :
+        discovery_(torrentFile.isPrivate ? nullptr : discovery), infoHash_(torrentFile.infoHash) {
+        if (!discovery_) {
+            return;
+        }
+        discovery_->AddTorrent(infoHash_, listenPort, [&peerPool, source](const std::vector<Peer>& peers) {
+            peerPool.Add(peers, source);
+        });
+    }
+
+    ~DiscoveryRegistration() {
+        if (discovery_) {
+            discovery_->RemoveTorrent(infoHash_);
+        }
+    }
+
+    DiscoveryRegistration(const DiscoveryRegistration&) = delete;
+    DiscoveryRegistration& operator=(const DiscoveryRegistration&) = delete;
+private:
+    Discovery* discovery_;
+    std::string infoHash_;
+};
+
+/*
+ * listener -- accepts incoming peers, nullptr if we could not listen and only connect to peers ourselves
+ * dht, lsd -- nullptr if disabled
+ */
+void DownloadTorrentFile(const TorrentFile& torrentFile, PieceStorage& pieces, const std::string& ourId, PeerListener* listener, int listenPort,
+                         Dht* dht, LocalDiscovery* lsd, size_t percent) {
     auto l = spdlog::get("mainLogger");
-    int trackerIndex = 0;
     bool fileSaved = false;
-    while(trackerIndex < torrentFile.announceList.size() && !fileSaved){
-        l->info("Connecting to tracker {}", torrentFile.announceList[trackerIndex]);
-        TorrentTracker tracker(torrentFile.announceList[trackerIndex]);
-        l->info("After tracker constructor");
-        int peersReqestLimit = peerRequestsForTrackerLimit; // req limit if 0 peers received.
-        bool requestMorePeers = true;
-        do {
-            try{
-                tracker.UpdatePeers(torrentFile, ourId, 12345);
-            }catch(const std::exception& e){
-                l->warn("Error in update peers: {}. Try next tracker.", e.what());
-                requestMorePeers = false;
-                break;
-            }
-            if (tracker.GetPeers().empty()) {
-                l->warn("No peers found. Retry...");
-                requestMorePeers = true;
-                peersReqestLimit--;
-            }else{
-                l->info("Found {} peers", tracker.GetPeers().size());
-                for (const Peer& peer : tracker.GetPeers()) {
-                    l->info("Found peer {}:{}", peer.ip, peer.port);
-                }
-                fileSaved = RunDownloadMultithread(pieces, torrentFile, ourId, tracker, percent);
-            }
-            
-        } while (peersReqestLimit && !fileSaved);
-        trackerIndex++;
+    PeerPool peerPool;
+    InboundPeers inbound;
+    InboundRegistration registration(listener, torrentFile.infoHash, inbound);
+    DiscoveryRegistration<Dht> dhtRegistration(dht, PeerSource::Dht, torrentFile, listenPort, peerPool);
+    DiscoveryRegistration<LocalDiscovery> lsdRegistration(lsd, PeerSource::Lsd, torrentFile, listenPort, peerPool);
+    Announcer announcer(torrentFile, ourId, listenPort, peerPool, pieces);
+    std::list<WebSeed> webSeeds;  // WebSeed is referenced by its thread, std::list does not move elements
+    for (const std::string& url : torrentFile.urlList) {
+        if (url.starts_with("http://") || url.starts_with("https://")) {
+            webSeeds.emplace_back(url, torrentFile, pieces);
+        } else {
+            l->warn("Web seed {} is not an HTTP url, skipped", url);
+        }
+    }
+    Dht* peerDht = torrentFile.isPrivate ? nullptr : dht;  // no PORT messages for private torrents either
+    int peersReqestLimit = peerRequestsForTrackerLimit; // req limit if 0 peers received.
+    while (peersReqestLimit && !fileSaved) {
+        // web seeds download while there are no peers, a retry is counted only without them
+        if (!AnyWebSeedActive(webSeeds) && !peerPool.WaitForPending(noPeersWait)) {
+            l->warn("No peers found. Retry...");
+            peersReqestLimit--;
+            announcer.RequestPeers();
+            continue;
+        }
+        fileSaved = RunDownloadMultithread(pieces, torrentFile, ourId, peerPool, peerDht, inbound, announcer, webSeeds, percent);
+    }
+    if (fileSaved) {
+        announcer.Completed();
     }
     if(!fileSaved){
         l->error("Need more peers but all trackers can not provide more");
@@ -247,7 +416,9 @@ void DownloadTorrentFile(const TorrentFile& torrentFile, PieceStorage& pieces, c
     l->info("END DownloadTorrentFile");
 }
 
-void ProcessTorrentFile(const std::filesystem::path& file, const std::filesystem::path& pathToSaveDirectory, size_t percent, bool doCheck) {
+void ProcessTorrentFile(const std::filesystem::path& file, const std::filesystem::path& pathToSaveDirectory, size_t percent, bool doCheck,
+                        size_t maxInFlightBytes, bool useHugePages, const IntegrityCheckOptions& checkOptions,
+                        PeerListener* listener, int listenPort, Dht* dht, LocalDiscovery* lsd) {
     TorrentFile torrentFile;
     auto l = spdlog::get("mainLogger");
     try {
@@ -285,12 +456,12 @@ void ProcessTorrentFile(const std::filesystem::path& file, const std::filesystem
         }
         std::cout.flush();
     }
-    PieceStorage pieces(torrentFile, pathToSaveDirectory, percent, selectedIndices, doCheck);
+    PieceStorage pieces(torrentFile, pathToSaveDirectory, percent, selectedIndices, doCheck, maxInFlightBytes, useHugePages);
     
     
     std::unique_ptr<std::thread> progressThreadPtr = startLiveProgress(pieces);
     try{
-        DownloadTorrentFile(torrentFile, pieces, PeerId, percent);
+        DownloadTorrentFile(torrentFile, pieces, PeerId, listener, listenPort, dht, lsd, percent);
     }catch(...){
         stopLiveProgress(std::move(progressThreadPtr));    
     }
@@ -298,8 +469,14 @@ void ProcessTorrentFile(const std::filesystem::path& file, const std::filesystem
 
     pieces.CloseOutputFile();
     if(doCheck){
-        if(CheckDownloadedPiecesIntegrity(pathToSaveDirectory / torrentFile.name, torrentFile, pieces, selectedIndices)){
-            std::cout << "All downloaded pieces have correct hash.";
+        if(CheckDownloadedPiecesIntegrity(pathToSaveDirectory / torrentFile.name, torrentFile, pieces, selectedIndices, checkOptions)){
+            if(checkOptions.mode == IntegrityCheckMode::Journal){
+                std::cout << "Downloaded pieces passed the journal check, journaled pieces were hash-checked before saving.";
+            }else{
+                std::cout << "All downloaded pieces have correct hash.";
+            }
+        }else{
+            std::cout << "Some downloaded pieces have incorrect hash, see Logs/debug.log.";
         }
         
     }
@@ -347,6 +524,14 @@ int main(int argc, char* argv[]) {
         std::filesystem::path pathToTorrentFile;
         size_t percent = -1;
         bool doCheck = true; 
+        size_t maxInFlightBytes = PieceStorage::defaultMaxInFlightBytes;
+        bool useHugePages = false;
+        IntegrityCheckOptions checkOptions;
+        int listenPort = defaultListenPort;
+        int dhtPort = defaultDhtPort;
+        std::string dhtBindAddress = "0.0.0.0";
+        bool useDht = true;
+        bool useLsd = true;
 
         // i defined above, if -log-level present shifted 
         for(; i < argc; ++i){
@@ -388,10 +573,107 @@ int main(int argc, char* argv[]) {
             }else if (arg == "-no-check") {
                 doCheck = false;
                 l->info("Integrity check will be skipped.");
+            }else if (arg == "-mem-limit") {
+                if (i + 1 < argc) {
+                    long long limitMiB = stoll(std::string(argv[++i]));
+                    if(limitMiB <= 0){
+                        std::string err = "Memory limit must be positive.";
+                        l->error("{}", err);
+                        throw std::invalid_argument(err);
+                    }
+                    maxInFlightBytes = static_cast<size_t>(limitMiB) * 1024 * 1024;
+                    l->info("-mem-limit correctly set to {} MiB", limitMiB);
+                } else {
+                    std::string err = "Missing memory limit after -mem-limit option.";
+                    l->error("{}", err);
+                    throw std::invalid_argument(err);
+                }
+            }else if (arg == "-check-mode") {
+                if (i + 1 < argc) {
+                    std::string mode = argv[++i];
+                    if (mode == "full") {
+                        checkOptions.mode = IntegrityCheckMode::Full;
+                    } else if (mode == "journal") {
+                        checkOptions.mode = IntegrityCheckMode::Journal;
+                    } else {
+                        std::string err = "Unknown check mode " + mode + ", expected full or journal.";
+                        l->error("{}", err);
+                        throw std::invalid_argument(err);
+                    }
+                    l->info("-check-mode correctly set to {}", mode);
+                } else {
+                    std::string err = "Missing mode after -check-mode option.";
+                    l->error("{}", err);
+                    throw std::invalid_argument(err);
+                }
+            }else if (arg == "-spot-check") {
+                if (i + 1 < argc) {
+                    long long spotCheck = stoll(std::string(argv[++i]));
+                    if(spotCheck < 0){
+                        std::string err = "Spot check sample can not be negative.";
+                        l->error("{}", err);
+                        throw std::invalid_argument(err);
+                    }
+                    checkOptions.spotCheckPieces = static_cast<size_t>(spotCheck);
+                    l->info("-spot-check correctly set to {}", spotCheck);
+                } else {
+                    std::string err = "Missing number of pieces after -spot-check option.";
+                    l->error("{}", err);
+                    throw std::invalid_argument(err);
+                }
+            }else if (arg == "-port") {
+                if (i + 1 < argc) {
+                    long long portLL = stoll(std::string(argv[++i]));
+                    if(portLL <= 0 || portLL > 65535){
+                        std::string err = "Port must be between 1 and 65535.";
+                        l->error("{}", err);
+                        throw std::invalid_argument(err);
+                    }
+                    listenPort = static_cast<int>(portLL);
+                    l->info("-port correctly set to {}", listenPort);
+                } else {
+                    std::string err = "Missing port number after -port option.";
+                    l->error("{}", err);
+                    throw std::invalid_argument(err);
+                }
+            }else if (arg == "-dht-port") {
+                if (i + 1 < argc) {
+                    long long portLL = stoll(std::string(argv[++i]));
+                    if(portLL <= 0 || portLL > 65535){
+                        std::string err = "DHT port must be between 1 and 65535.";
+                        l->error("{}", err);
+                        throw std::invalid_argument(err);
+                    }
+                    dhtPort = static_cast<int>(portLL);
+                    l->info("-dht-port correctly set to {}", dhtPort);
+                } else {
+                    std::string err = "Missing port number after -dht-port option.";
+                    l->error("{}", err);
+                    throw std::invalid_argument(err);
+                }
+            }else if (arg == "-dht-bind") {
+                if (i + 1 < argc) {
+                    dhtBindAddress = argv[++i];
+                    l->info("-dht-bind correctly set to {}", dhtBindAddress);
+                } else {
+                    std::string err = "Missing address after -dht-bind option.";
+                    l->error("{}", err);
+                    throw std::invalid_argument(err);
+                }
+            }else if (arg == "-no-dht") {
+                useDht = false;
+                l->info("DHT is disabled.");
+            }else if (arg == "-no-lsd") {
+                useLsd = false;
+                l->info("Local peer discovery is disabled.");
+            }else if (arg == "-hugepages") {
+                useHugePages = true;
+                l->info("Piece buffers will use huge pages if possible.");
             }else {
                 pathToTorrentFile = std::filesystem::path(arg);
                 if (!std::filesystem::exists(pathToTorrentFile)) {
                     l->error("Torrent file '{}' does not exist.", arg);
+                    spdlog::shutdown();
                     return 1;
                 }
             }
@@ -408,12 +690,38 @@ int main(int argc, char* argv[]) {
                                                    : ".")) / "Downloads"
             );
         }
-        ProcessTorrentFile(pathToTorrentFile, pathToSaveDirectory, percent, doCheck);
+        std::unique_ptr<PeerListener> listener;
+        try {
+            listener = std::make_unique<PeerListener>(listenPort);
+        } catch (const std::exception& e) {
+            l->warn("{}. Incoming peer connections are disabled.", e.what());
+        }
+        std::unique_ptr<Dht> dht;
+        if (useDht) {
+            try {
+                dht = std::make_unique<Dht>(dhtBindAddress, dhtPort, pathToSaveDirectory / ".dht_nodes");
+            } catch (const std::exception& e) {
+                l->warn("{}. DHT is disabled.", e.what());
+            }
+        }
+        std::unique_ptr<LocalDiscovery> lsd;
+        if (useLsd) {
+            try {
+                lsd = std::make_unique<LocalDiscovery>();
+            } catch (const std::exception& e) {
+                l->warn("{}. Local peer discovery is disabled.", e.what());
+            }
+        }
+        ProcessTorrentFile(pathToTorrentFile, pathToSaveDirectory, percent, doCheck, maxInFlightBytes, useHugePages, checkOptions,
+                           listener.get(), listenPort, dht.get(), lsd.get());
         l->critical("End of main.cpp, file has been saved successfully");
 
     }catch (const std::exception& e){
         l->error("Exception occurred in main: {}", e.what());
+        spdlog::shutdown();
         return 1;
     }
+    // drain the async log queue
+    spdlog::shutdown();
     return 0;
 }
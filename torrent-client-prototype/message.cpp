@@ -2,6 +2,21 @@
 #include "byte_tools.h"
 #include <sstream>
 
+namespace {
+    // looked up once, spdlog::get takes the registry lock
+    const std::shared_ptr<spdlog::logger>& Logger(){
+        static const std::shared_ptr<spdlog::logger> logger = spdlog::get("mainLogger");
+        return logger;
+    }
+
+    void WriteInt(char* out, uint32_t num){
+        out[0] = static_cast<char>((num >> 24) & 0xFF);
+        out[1] = static_cast<char>((num >> 16) & 0xFF);
+        out[2] = static_cast<char>((num >> 8) & 0xFF);
+        out[3] = static_cast<char>(num & 0xFF);
+    }
+}
+
 
 Message Message::Parse(const std::string& messageString){
     Message ms;
@@ -11,39 +26,57 @@ Message Message::Parse(const std::string& messageString){
         ms.payload = "";
        return ms;
     }
-    ms.l = spdlog::get("mainLogger");
+    auto& l = Logger();
     if(messageString[0] == char(0)){
         ms.id = MessageId::Choke;
-        ms.l->trace("Message Parse, type: Choke");
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: Choke");
     }else if(messageString[0] == char(1)){
         ms.id = MessageId::Unchoke;
-        ms.l->trace("Message Parse, type: Unchoke");
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: Unchoke");
     }else if(messageString[0] == char(2)){
         ms.id = MessageId::Interested;
-        ms.l->trace("Message Parse, type: Interested");
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: Interested");
     }else if(messageString[0] == char(3)){
         ms.id = MessageId::NotInterested;
-        ms.l->trace("Message Parse, type: NotInterested");
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: NotInterested");
     }else if(messageString[0] == char(4)){
         ms.id = MessageId::Have;
-        ms.l->trace("Message Parse, type: Have");
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: Have");
     }else if(messageString[0] == char(5)){
         ms.id = MessageId::BitField;
-        ms.l->trace("Message Parse, type: BitField");
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: BitField");
     }else if(messageString[0] == char(6)){
         ms.id = MessageId::Request;
-        ms.l->trace("Message Parse, type: Request");
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: Request");
     }else if(messageString[0] == char(7)){
         ms.id = MessageId::Piece;
-        ms.l->trace("Message Parse, type: Piece");
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: Piece");
     }else if(messageString[0] == char(8)){
         ms.id = MessageId::Cancel;
-        ms.l->trace("Message Parse, type: Cancel");
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: Cancel");
     }else if(messageString[0] == char(9)){
         ms.id = MessageId::Port;
-        ms.l->trace("Message Parse, type: Port");
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: Port");
+    }else if(messageString[0] == char(13)){
+        ms.id = MessageId::SuggestPiece;
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: SuggestPiece");
+    }else if(messageString[0] == char(14)){
+        ms.id = MessageId::HaveAll;
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: HaveAll");
+    }else if(messageString[0] == char(15)){
+        ms.id = MessageId::HaveNone;
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: HaveNone");
+    }else if(messageString[0] == char(16)){
+        ms.id = MessageId::RejectRequest;
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: RejectRequest");
+    }else if(messageString[0] == char(17)){
+        ms.id = MessageId::AllowedFast;
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: AllowedFast");
+    }else if(messageString[0] == char(20)){
+        ms.id = MessageId::Extended;
+        SPDLOG_LOGGER_TRACE(l, "Message Parse, type: Extended");
     }else{
-        ms.l->error("Message Parse Received incorrect id");
+        l->error("Message Parse Received incorrect id");
         throw std::runtime_error("Message Parse Received incorrect id");
     }
     ms.payload = messageString.substr(1);
@@ -54,7 +87,6 @@ Message Message::Parse(const std::string& messageString){
 
 Message Message::Init(MessageId id, const std::string& payload){
     Message ms;
-    ms.l = spdlog::get("mainLogger");
     ms.payload = payload;
     ms.id = id;
     if(id != MessageId::KeepAlive){
@@ -62,59 +94,86 @@ Message Message::Init(MessageId id, const std::string& payload){
     }else{
         ms.messageLength = 0;
     }
-    ms.l->trace("Message init success");
+    SPDLOG_LOGGER_TRACE(Logger(), "Message init success");
     return ms;
 }   
 
 
 std::string Message::ToString() const{  
+    auto& l = Logger();
     std::string result;
     if(id == MessageId::KeepAlive){
         for(int i = 0; i < 4; ++i){
             result += char(0);
         }
-        l->trace("Message ToString keepalive");
+        SPDLOG_LOGGER_TRACE(l, "Message ToString keepalive");
         return result;
     }
     
     if(id == MessageId::Choke){
         result += IntToBytes(1);
         result += char(0);
-        l->trace("Message ToString Choke");
+        SPDLOG_LOGGER_TRACE(l, "Message ToString Choke");
     }else if(id == MessageId::Unchoke){
         result += IntToBytes(1);
         result += char(1);
-        l->trace("Message ToString Unchoke");
+        SPDLOG_LOGGER_TRACE(l, "Message ToString Unchoke");
     }else if(id == MessageId::Interested){
         result += IntToBytes(1);
         result += char(2);
-        l->trace("Message ToString Interested");
+        SPDLOG_LOGGER_TRACE(l, "Message ToString Interested");
     }else if(id == MessageId::NotInterested){
         result += IntToBytes(1);
         result += char(3);
-        l->trace("Message ToString NotInterested");
+        SPDLOG_LOGGER_TRACE(l, "Message ToString NotInterested");
     }else if(id == MessageId::Have){
         result += IntToBytes(5);
         result += char(4);
-        l->trace("Message ToString Have");
+        SPDLOG_LOGGER_TRACE(l, "Message ToString Have");
     }else if(id == MessageId::BitField){
+        result += IntToBytes(1 + payload.size());
         result += char(5);
-        l->trace("Message ToString BitField");
+        SPDLOG_LOGGER_TRACE(l, "Message ToString BitField");
     }else if(id == MessageId::Request){
         result += IntToBytes(13);
         result += char(6);
-        l->trace("Message ToString Request");
+        SPDLOG_LOGGER_TRACE(l, "Message ToString Request");
     }else if(id == MessageId::Piece){
+        result += IntToBytes(1 + payload.size());
         result += char(7);
-        l->trace("Message ToString Piece");
+        SPDLOG_LOGGER_TRACE(l, "Message ToString Piece");
     }else if(id == MessageId::Cancel){
         result += IntToBytes(13);
         result += char(8);
-        l->trace("Message ToString Cancel");
+        SPDLOG_LOGGER_TRACE(l, "Message ToString Cancel");
     }else if(id == MessageId::Port){
         result += IntToBytes(3);
         result += char(9);
-        l->trace("Message ToString Port");
+        SPDLOG_LOGGER_TRACE(l, "Message ToString Port");
+    }else if(id == MessageId::SuggestPiece){
+        result += IntToBytes(5);
+        result += char(13);
+        SPDLOG_LOGGER_TRACE(l, "Message ToString SuggestPiece");
+    }else if(id == MessageId::HaveAll){
+        result += IntToBytes(1);
+        result += char(14);
+        SPDLOG_LOGGER_TRACE(l, "Message ToString HaveAll");
+    }else if(id == MessageId::HaveNone){
+        result += IntToBytes(1);
+        result += char(15);
+        SPDLOG_LOGGER_TRACE(l, "Message ToString HaveNone");
+    }else if(id == MessageId::RejectRequest){
+        result += IntToBytes(13);
+        result += char(16);
+        SPDLOG_LOGGER_TRACE(l, "Message ToString RejectRequest");
+    }else if(id == MessageId::AllowedFast){
+        result += IntToBytes(5);
+        result += char(17);
+        SPDLOG_LOGGER_TRACE(l, "Message ToString AllowedFast");
+    }else if(id == MessageId::Extended){
+        result += IntToBytes(1 + payload.size());
+        result += char(20);
+        SPDLOG_LOGGER_TRACE(l, "Message ToString Extended");
     }else{
         l->error("Message ToString Cancel");
         throw std::runtime_error("Message ToString Received incorrect id");
@@ -122,4 +181,122 @@ std::string Message::ToString() const{
     result += payload;
     return result;
 
-}
\ No newline at end of file
+}
+
+MessageView MessageView::Parse(std::string_view messageString){
+    MessageView ms;
+    if(messageString.empty()){
+        ms.id = MessageId::KeepAlive;
+        ms.messageLength = 0;
+        return ms;
+    }
+    unsigned char id = static_cast<unsigned char>(messageString[0]);
+    bool knownId = id <= static_cast<unsigned char>(MessageId::Port) ||
+                   (id >= static_cast<unsigned char>(MessageId::SuggestPiece) && id <= static_cast<unsigned char>(MessageId::AllowedFast)) ||
+                   id == static_cast<unsigned char>(MessageId::Extended);
+    if(!knownId){
+        Logger()->error("MessageView Parse Received incorrect id {}", id);
+        throw std::runtime_error("Message Parse Received incorrect id");
+    }
+    ms.id = static_cast<MessageId>(id);
+    ms.payload = messageString.substr(1);
+    ms.messageLength = messageString.size();
+
+    size_t payloadSize = ms.payload.size();
+    bool sizeOk = true;
+    switch(ms.id){
+        case MessageId::Have:
+        case MessageId::SuggestPiece:
+        case MessageId::AllowedFast:
+            sizeOk = payloadSize == 4;
+            break;
+        case MessageId::HaveAll:
+        case MessageId::HaveNone:
+            sizeOk = payloadSize == 0;
+            break;
+        case MessageId::Request:
+        case MessageId::Cancel:
+        case MessageId::RejectRequest:
+            sizeOk = payloadSize == 12;
+            break;
+        case MessageId::Piece:
+            sizeOk = payloadSize >= 8;
+            break;
+        case MessageId::Port:
+            sizeOk = payloadSize == 2;
+            break;
+        case MessageId::Extended:
+            sizeOk = payloadSize >= 1;
+            break;
+        default:
+            break;
+    }
+    if(!sizeOk){
+        Logger()->error("MessageView Parse, message {} has wrong payload size {}", id, payloadSize);
+        throw std::runtime_error("Message Parse Received payload of wrong size");
+    }
+    return ms;
+}
+
+uint32_t MessageView::HaveIndex() const{
+    return BytesToInt(payload);
+}
+
+uint32_t MessageView::PieceIndex() const{
+    return BytesToInt(payload);
+}
+
+uint32_t MessageView::PieceBegin() const{
+    return BytesToInt(payload.substr(4));
+}
+
+std::string_view MessageView::PieceBlock() const{
+    return payload.substr(8);
+}
+
+uint32_t MessageView::RequestIndex() const{
+    return BytesToInt(payload);
+}
+
+uint32_t MessageView::RequestBegin() const{
+    return BytesToInt(payload.substr(4));
+}
+
+uint32_t MessageView::RequestLength() const{
+    return BytesToInt(payload.substr(8));
+}
+
+std::string_view MessageView::BitField() const{
+    return payload;
+}
+
+uint16_t MessageView::DhtPort() const{
+    return static_cast<uint16_t>((static_cast<unsigned char>(payload[0]) << 8) | static_cast<unsigned char>(payload[1]));
+}
+
+uint8_t MessageView::ExtendedId() const{
+    return static_cast<uint8_t>(payload[0]);
+}
+
+std::string_view MessageView::ExtendedPayload() const{
+    return payload.substr(1);
+}
+
+std::array<char, 17> MakeRequestMessage(MessageId id, uint32_t index, uint32_t begin, uint32_t length){
+    std::array<char, 17> result;
+    WriteInt(result.data(), 13);
+    result[4] = static_cast<char>(id);
+    WriteInt(result.data() + 5, index);
+    WriteInt(result.data() + 9, begin);
+    WriteInt(result.data() + 13, length);
+    return result;
+}
+
+std::array<char, 13> MakePieceHeader(uint32_t index, uint32_t begin, uint32_t blockLength){
+    std::array<char, 13> result;
+    WriteInt(result.data(), 9 + blockLength);
+    result[4] = static_cast<char>(MessageId::Piece);
+    WriteInt(result.data() + 5, index);
+    WriteInt(result.data() + 9, begin);
+    return result;
+}
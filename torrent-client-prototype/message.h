@@ -1,12 +1,17 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <array>
+#include <cstdint>
 #include <cstdlib>
 #include "spdlog/spdlog.h"
 
 /*
  * Тип сообщения в протоколе торрента.
  * https://wiki.theory.org/BitTorrentSpecification#Messages
+ * Ids 13-17 are the Fast Extension, https://www.bittorrent.org/beps/bep_0006.html
+ * Id 20 is the Extension Protocol, https://www.bittorrent.org/beps/bep_0010.html
  */
 enum class MessageId : uint8_t {
     Choke = 0,
@@ -19,14 +24,19 @@ enum class MessageId : uint8_t {
     Piece,
     Cancel,
     Port,
-    KeepAlive,
+    KeepAlive,  // not sent on the wire, a message of zero length
+    SuggestPiece = 13,
+    HaveAll,
+    HaveNone,
+    RejectRequest,
+    AllowedFast,
+    Extended = 20,
 };
 
 struct Message {
     MessageId id;
     size_t messageLength;
     std::string payload;
-    std::shared_ptr<spdlog::logger> l;
 
     /*
      * Выделяем тип сообщения и длину и создаем объект типа Message.
@@ -43,7 +53,57 @@ struct Message {
      * Формируем строку с сообщением, которую можно будет послать пиру в соответствии с протоколом.
      * Получается строка вида "<1 + payload length><message id><payload>"
      * Секция с длиной сообщения занимает 4 байта и представляет собой целое число в формате big-endian
-     * id сообщения занимает 1 байт и может принимать значения от 0 до 9 включительно
+     * id сообщения занимает 1 байт и может принимать значения от 0 до 9 включительно, 13-17 для Fast Extension, 20 для Extension Protocol
      */
     std::string ToString() const;
 };
+
+/*
+ * Non-owning message parsed in place from the receive buffer.
+ * The payload points into the buffer of TcpConnect and is valid until the next read from the socket.
+ */
+struct MessageView {
+    MessageId id;
+    size_t messageLength;
+    std::string_view payload;
+
+    /*
+     * Same as Message::Parse, but without copying the payload.
+     * Payload length of messages with a fixed layout is checked here, so the accessors below are safe
+     */
+    static MessageView Parse(std::string_view messageString);
+
+    // Have, Suggest Piece, Allowed Fast: index of the piece
+    uint32_t HaveIndex() const;
+
+    // Piece: <index><begin><block>
+    uint32_t PieceIndex() const;
+    uint32_t PieceBegin() const;
+    std::string_view PieceBlock() const;
+
+    // Request, Cancel and Reject Request: <index><begin><length>
+    uint32_t RequestIndex() const;
+    uint32_t RequestBegin() const;
+    uint32_t RequestLength() const;
+
+    // BitField: raw bitfield bytes
+    std::string_view BitField() const;
+
+    // Port: UDP port of the peer's DHT node, https://www.bittorrent.org/beps/bep_0005.html
+    uint16_t DhtPort() const;
+
+    // Extended: <extended message id><bencoded dictionary and maybe raw data>
+    uint8_t ExtendedId() const;
+    std::string_view ExtendedPayload() const;
+};
+
+/*
+ * Request or Cancel message built on the stack: <len=13><id><index><begin><length>
+ */
+std::array<char, 17> MakeRequestMessage(MessageId id, uint32_t index, uint32_t begin, uint32_t length);
+
+/*
+ * Everything of a Piece message but the block: <len=9+blockLength><id><index><begin>,
+ * the block itself is sent right after it from the file
+ */
+std::array<char, 13> MakePieceHeader(uint32_t index, uint32_t begin, uint32_t blockLength);
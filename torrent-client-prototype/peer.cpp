@@ -0,0 +1,126 @@
+#include "peer.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <cstring>
+
+namespace {
+    constexpr uint8_t v4MappedPrefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+}
+
+Peer::Peer(const std::string& ip, int port_) {
+    if (port_ <= 0 || port_ > 65535) {
+        return;
+    }
+    in_addr addr4;
+    in6_addr addr6;
+    if (inet_pton(AF_INET, ip.c_str(), &addr4) == 1) {
+        std::memcpy(address.data(), v4MappedPrefix, 12);
+        std::memcpy(address.data() + 12, &addr4.s_addr, 4);
+    } else if (inet_pton(AF_INET6, ip.c_str(), &addr6) == 1) {
+        std::memcpy(address.data(), addr6.s6_addr, 16);
+    } else {
+        return;
+    }
+    port = static_cast<uint16_t>(port_);
+}
+
+Peer Peer::FromCompact(const char* bytes, size_t addressSize) {
+    Peer peer;
+    if (addressSize == 4) {
+        std::memcpy(peer.address.data(), v4MappedPrefix, 12);
+        std::memcpy(peer.address.data() + 12, bytes, 4);
+    } else {
+        std::memcpy(peer.address.data(), bytes, 16);
+    }
+    peer.port = static_cast<uint16_t>((static_cast<uint8_t>(bytes[addressSize]) << 8) | static_cast<uint8_t>(bytes[addressSize + 1]));
+    return peer;
+}
+
+Peer Peer::FromSockaddr(const sockaddr* addr) {
+    Peer peer;
+    if (addr->sa_family == AF_INET) {
+        const sockaddr_in* addr4 = reinterpret_cast<const sockaddr_in*>(addr);
+        std::memcpy(peer.address.data(), v4MappedPrefix, 12);
+        std::memcpy(peer.address.data() + 12, &addr4->sin_addr.s_addr, 4);
+        peer.port = ntohs(addr4->sin_port);
+    } else if (addr->sa_family == AF_INET6) {
+        const sockaddr_in6* addr6 = reinterpret_cast<const sockaddr_in6*>(addr);
+        std::memcpy(peer.address.data(), addr6->sin6_addr.s6_addr, 16);
+        peer.port = ntohs(addr6->sin6_port);
+    }
+    return peer;
+}
+
+bool Peer::IsV4() const {
+    return std::memcmp(address.data(), v4MappedPrefix, 12) == 0;
+}
+
+bool Peer::IsLan() const {
+    if (IsV4()) {
+        const uint8_t* ip = address.data() + 12;
+        return ip[0] == 10 || ip[0] == 127 || (ip[0] == 172 && (ip[1] & 0xF0) == 16) ||
+               (ip[0] == 192 && ip[1] == 168) || (ip[0] == 169 && ip[1] == 254);
+    }
+    static constexpr uint8_t loopback[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    return std::memcmp(address.data(), loopback, 16) == 0 || (address[0] & 0xFE) == 0xFC ||
+           (address[0] == 0xFE && (address[1] & 0xC0) == 0x80);
+}
+
+std::string Peer::Ip() const {
+    char ip[INET6_ADDRSTRLEN];
+    if (IsV4()) {
+        inet_ntop(AF_INET, address.data() + 12, ip, sizeof(ip));
+    } else {
+        inet_ntop(AF_INET6, address.data(), ip, sizeof(ip));
+    }
+    return ip;
+}
+
+std::string Peer::ToString() const {
+    return (IsV4() ? Ip() : "[" + Ip() + "]") + ":" + std::to_string(port);
+}
+
+socklen_t Peer::ToSockaddr(sockaddr_storage& storage) const {
+    std::memset(&storage, 0, sizeof(storage));
+    if (IsV4()) {
+        sockaddr_in& addr4 = reinterpret_cast<sockaddr_in&>(storage);
+        addr4.sin_family = AF_INET;
+        addr4.sin_port = htons(port);
+        std::memcpy(&addr4.sin_addr.s_addr, address.data() + 12, 4);
+        return sizeof(sockaddr_in);
+    }
+    sockaddr_in6& addr6 = reinterpret_cast<sockaddr_in6&>(storage);
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_port = htons(port);
+    std::memcpy(addr6.sin6_addr.s6_addr, address.data(), 16);
+    return sizeof(sockaddr_in6);
+}
+
+size_t PeerHash::operator()(const Peer& peer) const noexcept {
+    // the 18 bytes of a peer, FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (uint8_t byte : peer.address) {
+        hash = (hash ^ byte) * 1099511628211ull;
+    }
+    hash = (hash ^ (peer.port >> 8)) * 1099511628211ull;
+    hash = (hash ^ (peer.port & 0xFF)) * 1099511628211ull;
+    return static_cast<size_t>(hash);
+}
+
+bool ResolvePeer(const std::string& host, int port, Peer& result, int family) {
+    result = Peer(host, port);
+    if (result.Valid()) {
+        return family == AF_UNSPEC || (family == AF_INET) == result.IsV4();
+    }
+    addrinfo hints{};
+    hints.ai_family = family;
+    addrinfo* info = nullptr;
+    if (port <= 0 || port > 65535 || getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &info) != 0) {
+        return false;
+    }
+    result = Peer::FromSockaddr(info->ai_addr);
+    freeaddrinfo(info);
+    return result.Valid();
+}
@@ -1,8 +1,58 @@
 #pragma once
 
 #include <string>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <sys/socket.h>
 
+/*
+ * Peer address in binary, as it comes in compact peer lists. IPv4 addresses are kept IPv4-mapped (::ffff:a.b.c.d),
+ * so peers of both families compare and hash alike and go into a sockaddr without parsing text again
+ */
 struct Peer {
-    std::string ip;
-    int port;
-};
\ No newline at end of file
+    std::array<uint8_t, 16> address{};
+    uint16_t port = 0;
+
+    Peer() = default;
+
+    /*
+     * From a textual IPv4 or IPv6 address, host names are not resolved here, see ResolvePeer.
+     * The peer is not Valid if the address can not be parsed or the port is out of range
+     */
+    Peer(const std::string& ip, int port);
+
+    // 4 or 16 bytes of address and the port, all in network order, as in compact peer lists
+    static Peer FromCompact(const char* bytes, size_t addressSize);
+
+    static Peer FromSockaddr(const sockaddr* addr);
+
+    bool Valid() const{
+        return port != 0;
+    }
+
+    bool IsV4() const;
+
+    // private, loopback and link-local addresses of both families
+    bool IsLan() const;
+
+    std::string Ip() const;
+
+    // "ip:port", "[ip]:port" for IPv6
+    std::string ToString() const;
+
+    // fills AF_INET for IPv4 peers and AF_INET6 for the others, returns the size of the address
+    socklen_t ToSockaddr(sockaddr_storage& storage) const;
+
+    bool operator==(const Peer& other) const = default;
+};
+
+struct PeerHash {
+    size_t operator()(const Peer& peer) const noexcept;
+};
+
+/*
+ * Resolve `host` (a name or a textual address) to its first address of `family`, AF_UNSPEC for any.
+ * false if it can not be resolved
+ */
+bool ResolvePeer(const std::string& host, int port, Peer& result, int family = AF_UNSPEC);
@@ -1,16 +1,50 @@
 #include "byte_tools.h"
 #include "peer_connect.h"
 #include "message.h"
+#include "bencode.h"
+#include "dht.h"
 #include <sstream>
 #include <utility>
+#include <algorithm>
 
 
 
 using namespace std::chrono_literals;
+
+namespace {
+    // reserved handshake bytes, https://www.bittorrent.org/beps/bep_0004.html
+    constexpr size_t fastExtensionByte = 7;
+    constexpr char fastExtensionBit = 0x04;
+    constexpr size_t extensionProtocolByte = 5;
+    constexpr char extensionProtocolBit = 0x10;
+    constexpr size_t dhtByte = 7;
+    constexpr char dhtBit = 0x01;
+
+    constexpr uint8_t extendedHandshakeId = 0;
+    const std::string clientVersion = "Simple-torrent";
+
+    // string value of a bencoded dictionary, nullptr if there is no such key or it is not a string
+    const std::string* GetDictString(const Bencode::bencodeDict& dict, const std::string& key) {
+        auto it = dict.elements.find(key);
+        if (it == dict.elements.end()) {
+            return nullptr;
+        }
+        return std::get_if<std::string>(&it->second);
+    }
+}
+
 PeerPiecesAvailability::PeerPiecesAvailability() {}
 
 PeerPiecesAvailability::PeerPiecesAvailability(std::string bitfield) : bitfield_(bitfield) {}
 
+PeerPiecesAvailability::PeerPiecesAvailability(size_t piecesCount, bool haveAll) :
+    bitfield_((piecesCount + 7) / 8, haveAll ? char(0xFF) : char(0)) {
+    // spare bits at the end stay cleared
+    if(haveAll && piecesCount % 8 != 0){
+        bitfield_.back() = static_cast<char>(0xFF << (8 - piecesCount % 8));
+    }
+}
+
 bool PeerPiecesAvailability::IsPieceAvailable(size_t pieceIndex) const{
     size_t pos = pieceIndex / 8;
     size_t bit_pos = pieceIndex % 8;
@@ -38,11 +72,28 @@ size_t PeerPiecesAvailability::Size() const{
     return bitfield_.size() * 8;
 }
 
-PeerConnect::PeerConnect(const Peer& peer, const TorrentFile &tf, std::string selfPeerId, PieceStorage& pieceStorage) :
+PeerConnect::PeerConnect(const Peer& peer, const TorrentFile &tf, std::string selfPeerId, PieceStorage& pieceStorage, PeerPool& peerPool, Dht* dht) :
  tf_(tf), selfPeerId_(selfPeerId), terminated_(false), choked_(true),
- socket_(TcpConnect (peer.ip, peer.port, std::chrono::milliseconds(6000), std::chrono::milliseconds(6000))), pieceInProgress_(nullptr), pieceStorage_(pieceStorage), pendingBlock_(false) {
+ socket_(TcpConnect (peer, std::chrono::milliseconds(6000), std::chrono::milliseconds(6000))), pieceInProgress_(nullptr), pieceStorage_(pieceStorage), failed_(false),
+ peerPool_(peerPool), dht_(dht) {
+    l = spdlog::get("mainLogger");
+    // until the peer tells otherwise, so Have works without a bitfield
+    piecesAvailability_ = PeerPiecesAvailability(tf_.pieceHashes.size(), false);
+    SPDLOG_LOGGER_TRACE(l, "RUN PEER WITH IP : {}", peer.ToString());
+    if(selfPeerId_.size() != 20){
+        l->error("Self id is not 20 bytes long");
+        throw std::runtime_error("Self id is not 20 bytes long");
+    }
+ }
+
+PeerConnect::PeerConnect(TcpConnect&& socket, std::string handshake, const TorrentFile &tf, std::string selfPeerId, PieceStorage& pieceStorage, PeerPool& peerPool,
+                         Dht* dht) :
+ tf_(tf), socket_(std::move(socket)), selfPeerId_(selfPeerId), terminated_(false), choked_(true),
+ pieceInProgress_(nullptr), pieceStorage_(pieceStorage), failed_(false),
+ peerPool_(peerPool), dht_(dht), inboundHandshake_(std::move(handshake)) {
     l = spdlog::get("mainLogger");
-    l->trace("RUN PEER WITH IP : {}", peer.ip);
+    piecesAvailability_ = PeerPiecesAvailability(tf_.pieceHashes.size(), false);
+    SPDLOG_LOGGER_TRACE(l, "RUN INCOMING PEER WITH IP : {}", socket_.GetIp());
     if(selfPeerId_.size() != 20){
         l->error("Self id is not 20 bytes long");
         throw std::runtime_error("Self id is not 20 bytes long");
@@ -61,18 +112,22 @@ void PeerConnect::Run() {
     }
 }
 
-void PeerConnect::PerformHandshake() {
-    socket_.EstablishConnection();
+std::string PeerConnect::MakeHandshake() const {
     std::string s(1, char(19));
     s += "BitTorrent protocol";
-    for(int i = 0; i < 8; ++i){
-        s += char(0);
+    std::string reserved(8, char(0));
+    reserved[fastExtensionByte] |= fastExtensionBit;
+    reserved[extensionProtocolByte] |= extensionProtocolBit;
+    if (dht_) {
+        reserved[dhtByte] |= dhtBit;
     }
+    s += reserved;
     s += tf_.infoHash;
     s += selfPeerId_; 
-    socket_.SendData(s);
-    std::string handshake_recieved = socket_.ReceiveFixedSize(68);
-    
+    return s;
+}
+
+void PeerConnect::CheckHandshake(const std::string& handshake_recieved) {
     if((unsigned char)handshake_recieved[0] != 19){
         l->info("Peer {} 1 Not a BIttorrent (pstrlen wrong)", socket_.GetIp());
         throw std::runtime_error("1 Not a BIttorrent (pstrlen wrong)");
@@ -85,13 +140,42 @@ void PeerConnect::PerformHandshake() {
         l->info("Peer {} 3 Not a BIttorrent InfoHash mismatch", socket_.GetIp());
         throw std::runtime_error("3 Not a BIttorrent InfoHash mismatch");
     }
-    l->trace("Successful handshake with peer {}", socket_.GetIp());
+    fastExtension_ = (handshake_recieved[20 + fastExtensionByte] & fastExtensionBit) != 0;
+    extensionProtocol_ = (handshake_recieved[20 + extensionProtocolByte] & extensionProtocolBit) != 0;
+    peerDht_ = (handshake_recieved[20 + dhtByte] & dhtBit) != 0;
+    SPDLOG_LOGGER_TRACE(l, "Peer {} fast extension: {}, extension protocol: {}, dht: {}", socket_.GetIp(), fastExtension_, extensionProtocol_, peerDht_);
+}
+
+void PeerConnect::PerformHandshake() {
+    if (!inboundHandshake_.empty()) {
+        // the peer connected to us and already sent its handshake, we answer it
+        std::string handshake_recieved = std::move(inboundHandshake_);
+        inboundHandshake_.clear();
+        CheckHandshake(handshake_recieved);
+        socket_.SendData(MakeHandshake());
+        SPDLOG_LOGGER_TRACE(l, "Successful handshake with incoming peer {}", socket_.GetIp());
+        return;
+    }
+    socket_.EstablishConnection();
+    socket_.SendData(MakeHandshake());
+    std::string handshake_recieved = socket_.ReceiveFixedSize(68);
+    CheckHandshake(handshake_recieved);
+    peerPool_.MarkConnected(socket_.GetPeer());
+    SPDLOG_LOGGER_TRACE(l, "Successful handshake with peer {}", socket_.GetIp());
 
 }
 
 bool PeerConnect::EstablishConnection() {
     try {
         PerformHandshake();
+        SendAvailability();
+        if (extensionProtocol_) {
+            SendExtendedHandshake();
+        }
+        if (dht_ && peerDht_) {
+            uint16_t port = static_cast<uint16_t>(dht_->GetPort());
+            socket_.SendData(Message::Init(MessageId::Port, std::string{static_cast<char>(port >> 8), static_cast<char>(port & 0xFF)}).ToString());
+        }
         SendInterested();
         return true;
     } catch (const std::exception& e) {
@@ -107,6 +191,169 @@ void PeerConnect::SendInterested() {
     socket_.SendData(send);
 }
 
+void PeerConnect::SendAvailability() {
+    // pieces saved before this point are in the bitfield, later ones go out as Have
+    haveSent_ = pieceStorage_.PiecesSavedToDiscCount();
+    std::string bitfield = pieceStorage_.GetBitfield();
+    if (std::any_of(bitfield.begin(), bitfield.end(), [](char byte) { return byte != 0; })) {
+        socket_.SendData(Message::Init(MessageId::BitField, bitfield).ToString());
+    } else if (fastExtension_) {
+        socket_.SendData(Message::Init(MessageId::HaveNone, std::string()).ToString());
+    }
+}
+
+void PeerConnect::HandleRequest(const MessageView& ms) {
+    BlockRequest request{ms.RequestIndex(), ms.RequestBegin(), ms.RequestLength()};
+    if (amChoking_) {
+        // requests sent before our Choke arrived, without the fast extension they are silently dropped
+        RejectRequest(request);
+        return;
+    }
+    if (request.length == 0 || request.length > maxRequestLength || !pieceStorage_.HasPiece(request.index)) {
+        SPDLOG_LOGGER_DEBUG(l, "Peer {} requested piece {} we can not upload, {} bytes at {}", socket_.GetIp(), request.index, request.length, request.begin);
+        RejectRequest(request);
+        return;
+    }
+    if (peerRequests_.size() >= maxPeerRequests) {
+        RejectRequest(request);
+        return;
+    }
+    peerRequests_.push_back(request);
+}
+
+void PeerConnect::RejectRequest(const BlockRequest& request) {
+    if (!fastExtension_) {
+        return;
+    }
+    auto reject = MakeRequestMessage(MessageId::RejectRequest, request.index, request.begin, request.length);
+    socket_.SendData(std::string_view(reject.data(), reject.size()));
+}
+
+void PeerConnect::ApplyChoke() {
+    bool choke = chokeWanted_.load();
+    if (choke == amChoking_) {
+        return;
+    }
+    amChoking_ = choke;
+    socket_.SendData(Message::Init(choke ? MessageId::Choke : MessageId::Unchoke, std::string()).ToString());
+    SPDLOG_LOGGER_DEBUG(l, "{} peer {}", choke ? "Choked" : "Unchoked", socket_.GetIp());
+    if (choke) {
+        // BEP 6: with the fast extension a choke does not discard requests implicitly
+        for (const BlockRequest& request : peerRequests_) {
+            RejectRequest(request);
+        }
+        peerRequests_.clear();
+    }
+}
+
+void PeerConnect::SendHaves() {
+    std::vector<size_t> saved = pieceStorage_.SavedPiecesSince(haveSent_);
+    haveSent_ += saved.size();
+    for (size_t index : saved) {
+        if (pieceStorage_.HasPiece(index)) {
+            socket_.SendData(Message::Init(MessageId::Have, IntToBytes(static_cast<int>(index))).ToString());
+        }
+    }
+}
+
+void PeerConnect::ServeRequests() {
+    while (!peerRequests_.empty()) {
+        BlockRequest request = peerRequests_.front();
+        peerRequests_.pop_front();
+        if (!pieceStorage_.GetBlockSlices(request.index, request.begin, request.length, slices_)) {
+            RejectRequest(request);
+            continue;
+        }
+        auto header = MakePieceHeader(request.index, request.begin, request.length);
+        socket_.SendData(std::string_view(header.data(), header.size()));
+        for (const FileSlice& slice : slices_) {
+            socket_.SendFile(slice.fd, slice.offset, slice.length);
+        }
+        uploadedBytes_.fetch_add(request.length, std::memory_order_relaxed);
+        pieceStorage_.bytesUploaded.fetch_add(request.length, std::memory_order_relaxed);
+        SPDLOG_LOGGER_TRACE(l, "Uploaded piece {} offset {} length {} to {}", request.index, request.begin, request.length, socket_.GetIp());
+    }
+}
+
+bool PeerConnect::PeerInterested() const {
+    return peerInterested_.load();
+}
+
+void PeerConnect::SetChoked(bool choked) {
+    chokeWanted_.store(choked);
+}
+
+size_t PeerConnect::TakeDownloadedBytes() {
+    return downloadedBytes_.exchange(0);
+}
+
+size_t PeerConnect::TakeUploadedBytes() {
+    return uploadedBytes_.exchange(0);
+}
+
+std::string PeerConnect::ExtendedHandshake(const TorrentFile& tf) {
+    auto supported = Bencode::makeBencodeDict();
+    if (!tf.isPrivate) {
+        supported->elements["ut_pex"] = static_cast<size_t>(localPexId);
+    }
+    Bencode::bencodeDict handshake;
+    handshake.elements["m"] = std::move(supported);
+    handshake.elements["v"] = clientVersion;
+
+    std::string payload(1, static_cast<char>(extendedHandshakeId));
+    payload += Bencode::Encode(handshake);
+    return payload;
+}
+
+void PeerConnect::SendExtendedHandshake() {
+    socket_.SendData(Message::Init(MessageId::Extended, ExtendedHandshake(tf_)).ToString());
+}
+
+void PeerConnect::SendPex() {
+    std::vector<Peer> connected = peerPool_.ConnectedPeers();
+    // the peer knows about itself
+    std::erase(connected, socket_.GetPeer());
+    auto contains = [](const std::vector<Peer>& peers, const Peer& peer) {
+        return std::find(peers.begin(), peers.end(), peer) != peers.end();
+    };
+
+    std::vector<Peer> added, dropped;
+    for (const Peer& peer : connected) {
+        if (added.size() < maxPexPeers && !contains(pexSent_, peer)) {
+            added.push_back(peer);
+        }
+    }
+    for (const Peer& peer : pexSent_) {
+        if (dropped.size() < maxPexPeers && !contains(connected, peer)) {
+            dropped.push_back(peer);
+        }
+    }
+    lastPexSent_ = std::chrono::steady_clock::now();
+    if (added.empty() && dropped.empty()) {
+        return;
+    }
+
+    // remember what the peer was told, not the whole list, peers over the limit go in the next message
+    std::erase_if(pexSent_, [&](const Peer& peer) { return contains(dropped, peer); });
+    pexSent_.insert(pexSent_.end(), added.begin(), added.end());
+
+    Bencode::bencodeDict pex;
+    // each encoder skips the peers of the other address family
+    std::string added4 = EncodeCompactPeers(added);
+    std::string added6 = EncodeCompactPeers6(added);
+    pex.elements["added"] = added4;
+    pex.elements["added.f"] = std::string(added4.size() / 6, char(0));
+    pex.elements["dropped"] = EncodeCompactPeers(dropped);
+    pex.elements["added6"] = added6;
+    pex.elements["added6.f"] = std::string(added6.size() / 18, char(0));
+    pex.elements["dropped6"] = EncodeCompactPeers6(dropped);
+
+    std::string payload(1, static_cast<char>(peerPexId_));
+    payload += Bencode::Encode(pex);
+    socket_.SendData(Message::Init(MessageId::Extended, payload).ToString());
+    SPDLOG_LOGGER_DEBUG(l, "Sent ut_pex to {}: {} added, {} dropped", socket_.GetIp(), added.size(), dropped.size());
+}
+
 void PeerConnect::Terminate() {
     l->warn("Terminate, peer {}", socket_.GetIp());
     terminated_ = true;
@@ -118,141 +365,465 @@ bool PeerConnect::Failed() const{
 
 
 void PeerConnect::RequestPiece() {
-    l->trace("In RequestPiece, peer {}", socket_.GetIp());
+    SPDLOG_LOGGER_TRACE(l, "In RequestPiece, peer {}", socket_.GetIp());
+    NoPieceReason noPiece = NoPieceReason::None;
     if(pieceInProgress_ == nullptr){
-        l->trace("In RequestPiece, peer {}, piece == null,try call GetNextPieceToDownload", socket_.GetIp());
-        pieceInProgress_ = pieceStorage_.GetNextPieceToDownload();// piecesInProgress++
+        SPDLOG_LOGGER_TRACE(l, "In RequestPiece, peer {}, piece == null,try call GetNextPieceToDownload", socket_.GetIp());
+        pieceInProgress_ = NextPieceToDownload(noPiece);// piecesInProgress++
+        rejectsForPiece_ = 0;
         if(pieceInProgress_){
-            l->trace("In RequestPiece, peer {}, piece was null, get piece index {}", socket_.GetIp(), pieceInProgress_->GetIndex());
+            SPDLOG_LOGGER_TRACE(l, "In RequestPiece, peer {}, piece was null, get piece index {}", socket_.GetIp(), pieceInProgress_->GetIndex());
         }else{
-            l->trace("In RequestPiece, peer {}, piece was null, and still null", socket_.GetIp());
+            SPDLOG_LOGGER_TRACE(l, "In RequestPiece, peer {}, piece was null, and still null", socket_.GetIp());
 
         }
     }else if(pieceInProgress_ && pieceInProgress_->AllBlocksRetrieved()){
-        l->trace("In RequestPiece, peer {}, In else pieceInProgress", socket_.GetIp());
+        SPDLOG_LOGGER_TRACE(l, "In RequestPiece, peer {}, In else pieceInProgress", socket_.GetIp());
         pieceStorage_.PieceProcessed(pieceInProgress_);
-        pieceInProgress_ = pieceStorage_.GetNextPieceToDownload();
+        pieceInProgress_ = NextPieceToDownload(noPiece);
+        rejectsForPiece_ = 0;
     }
-    l->trace("In RequestPiece, peer {}, after if/else pieceInProgress", socket_.GetIp());
+    SPDLOG_LOGGER_TRACE(l, "In RequestPiece, peer {}, after if/else pieceInProgress", socket_.GetIp());
     if(pieceInProgress_ == nullptr){
-        l->trace("In RequestPiece, peer {}, pieceInProgress_ == nullptr", socket_.GetIp());
-        terminated_ = true;
+        if(choked_){
+            // no Allowed Fast piece we can take, wait for unchoke
+            SPDLOG_LOGGER_TRACE(l, "In RequestPiece, peer {}, choked and no allowed fast piece", socket_.GetIp());
+            return;
+        }
+        if(noPiece == NoPieceReason::BudgetExhausted){
+            // pieces are left, but memory limit is reached, try again on the next timer tick
+            SPDLOG_LOGGER_TRACE(l, "In RequestPiece, peer {}, in-flight memory budget exhausted", socket_.GetIp());
+            retryRequest_ = true;
+            return;
+        }
+        SPDLOG_LOGGER_TRACE(l, "In RequestPiece, peer {}, pieceInProgress_ == nullptr", socket_.GetIp());
+        if(noPiece == NoPieceReason::QueueEmpty && !peerInterested_.load()){
+            terminated_ = true;
+        }
+        // otherwise nothing is left to download from this peer, the connection stays for uploading
         return;
     }
 
-    std::string payload;
-
-    payload += IntToBytes(pieceInProgress_->GetIndex());
-    payload += IntToBytes(pieceInProgress_->FirstMissingBlock()->offset);
-    payload += IntToBytes(pieceInProgress_->FirstMissingBlock()->length);
-    l->trace("{} peer, requested piece index {} with offset {}",socket_.GetIp(), pieceInProgress_->GetIndex(), pieceInProgress_->FirstMissingBlock()->offset);
-    
-    pieceInProgress_->FirstMissingBlock()->status = Block::Status::Pending;
-    
-    Message ms;
-    ms = ms.Init(MessageId::Request, payload);
-    try{
-        socket_.SendData(ms.ToString());
-        pendingBlock_ = true;
-        l->trace("{} peer after successful data send", socket_.GetIp());
-    }catch (const std::exception& e ){
-        l->warn("Error sending message to the peer {}, cancelling piece {}, error {}", socket_.GetIp(), pieceInProgress_->GetIndex(), e.what());
-        // hashes mismatch
-        pieceStorage_.PieceProcessed(pieceInProgress_);
-        Terminate();
+    while(outstanding_.size() < maxOutstandingRequests){
+        Block* block = pieceInProgress_->FirstMissingBlock();
+        if(block == nullptr){
+            // the rest is requested already
+            return;
+        }
+        uint32_t index = static_cast<uint32_t>(pieceInProgress_->GetIndex());
+        auto request = MakeRequestMessage(MessageId::Request, index, block->offset, block->length);
+        SPDLOG_LOGGER_TRACE(l, "{} peer, requested piece index {} with offset {}",socket_.GetIp(), index, block->offset);
+
+        block->status = Block::Status::Pending;
+
+        try{
+            socket_.SendData(std::string_view(request.data(), request.size()));
+            outstanding_.push_back(OutstandingRequest{index, block->offset, block->length, ArmRequestTimer(index, block->offset)});
+            SPDLOG_LOGGER_TRACE(l, "{} peer after successful data send", socket_.GetIp());
+        }catch (const std::exception& e ){
+            l->warn("Error sending message to the peer {}, cancelling piece {}, error {}", socket_.GetIp(), index, e.what());
+            // the piece is given back when the main loop ends
+            Terminate();
+            return;
+        }
     }
+}
 
+PeerConnect::OutstandingRequest* PeerConnect::FindOutstanding(uint32_t index, uint32_t begin) {
+    auto it = std::find_if(outstanding_.begin(), outstanding_.end(), [index, begin](const OutstandingRequest& request) {
+        return request.index == index && request.begin == begin;
+    });
+    return it == outstanding_.end() ? nullptr : &*it;
 }
 
+void PeerConnect::EraseOutstanding(OutstandingRequest* request) {
+    timers_.Cancel(request->timer);
+    outstanding_.erase(outstanding_.begin() + (request - outstanding_.data()));
+}
 
-void PeerConnect::MainLoop() {
-    while (!terminated_) {
-        std::string receivedData;
-        l->trace("{} peer, PeerConnect::MainLoop BEFORE receive from socket", socket_.GetIp());
-        try {
-            receivedData = socket_.ReceiveOneMessage();
-        } catch (const std::exception& e) {
-            l->warn("{} peer, Error in receiveData, del piece, term the peer: {}", socket_.GetIp(), e.what());
+void PeerConnect::CancelOutstanding(bool sendCancel) {
+    for (const OutstandingRequest& request : outstanding_) {
+        timers_.Cancel(request.timer);
+        if (sendCancel) {
+            auto cancel = MakeRequestMessage(MessageId::Cancel, request.index, request.begin, request.length);
+            socket_.SendData(std::string_view(cancel.data(), cancel.size()));
+        }
+    }
+    outstanding_.clear();
+}
 
-            // Handle mismatched hash and return the piece to the queue
-            if (pieceInProgress_) {
-                pieceStorage_.PieceProcessed(pieceInProgress_);
-            }
+void PeerConnect::ReturnPieceInProgress(bool sendCancel) {
+    CancelOutstanding(sendCancel);
+    if (pieceInProgress_) {
+        pieceStorage_.ReturnPiece(pieceInProgress_);
+        pieceInProgress_ = nullptr;
+    }
+}
 
-            Terminate();
-            break;
+
+PiecePtr PeerConnect::NextPieceToDownload(NoPieceReason& reason) {
+    reason = NoPieceReason::None;
+    if(choked_){
+        for(size_t index : allowedFast_){
+            if(!piecesAvailability_.IsPieceAvailable(index)){
+                continue;
+            }
+            if(PiecePtr piece = pieceStorage_.TakePieceToDownload(index)){
+                return piece;
+            }
         }
+        return nullptr;
+    }
+    while(!suggestedPieces_.empty()){
+        size_t index = suggestedPieces_.front();
+        suggestedPieces_.pop_front();
+        if(PiecePtr piece = pieceStorage_.TakePieceToDownload(index)){
+            return piece;
+        }
+    }
+    return pieceStorage_.GetNextPieceToDownload(reason, std::chrono::milliseconds::zero());
+}
 
-        l->trace("{} peer, AFTER receive from socket", socket_.GetIp());
+bool PeerConnect::CanRequestWhileChoked() const {
+    if(!fastExtension_){
+        return false;
+    }
+    if(pieceInProgress_){
+        return std::find(allowedFast_.begin(), allowedFast_.end(), pieceInProgress_->GetIndex()) != allowedFast_.end();
+    }
+    return !allowedFast_.empty();
+}
 
-        Message ms = ms.Parse(receivedData);
-        
-        switch (ms.id) {
-            case MessageId::Have: {
-                size_t index = BytesToInt(ms.payload);
-                piecesAvailability_.SetPieceAvailability(index);
+void PeerConnect::HandleMessage(const MessageView& ms) {
+    switch (ms.id) {
+        case MessageId::Have: {
+            size_t index = ms.HaveIndex();
+            piecesAvailability_.SetPieceAvailability(index);
+            break;
+        }
+        case MessageId::KeepAlive: {
+            // the idle timer is reset for every batch of messages
+            SPDLOG_LOGGER_TRACE(l, "PeerConnect main loop, received keep-alive from peer {}", socket_.GetIp());
+            break;
+        }
+        case MessageId::Choke: {
+            choked_ = true;
+            if (!fastExtension_ && pieceInProgress_) {
+                // the peer drops our requests on choke, the blocks go back to other peers right away
+                SPDLOG_LOGGER_DEBUG(l, "Choked by {}, returning piece with {} outstanding requests", socket_.GetIp(), outstanding_.size());
+                ReturnPieceInProgress(false);
+            }
+            // with the fast extension the peer rejects each request it drops
+            break;
+        }
+        case MessageId::Unchoke: {
+            // the pipeline is filled after this batch of messages
+            choked_ = false;
+            break;
+        }
+        case MessageId::Interested: {
+            peerInterested_.store(true);
+            break;
+        }
+        case MessageId::NotInterested: {
+            peerInterested_.store(false);
+            break;
+        }
+        case MessageId::Request: {
+            HandleRequest(ms);
+            break;
+        }
+        case MessageId::Cancel: {
+            uint32_t index = ms.RequestIndex(), begin = ms.RequestBegin(), length = ms.RequestLength();
+            std::erase_if(peerRequests_, [&](const BlockRequest& request) {
+                return request.index == index && request.begin == begin && request.length == length;
+            });
+            break;
+        }
+        case MessageId::Port: {
+            if (dht_ && ms.DhtPort() != 0) {
+                Peer node = socket_.GetPeer();
+                node.port = ms.DhtPort();
+                dht_->PingNode(node);
+            }
+            break;
+        }
+        case MessageId::BitField: {
+            std::string_view bitfield = ms.BitField();
+            size_t expectedSize = (size_t)std::ceil(tf_.pieceHashes.size() / 8.0);
+            if(expectedSize != ms.messageLength - 1) {
+                l->warn("Bitfieldis of incorrect size, expected {}, got {}, terminating connection, peer {}",expectedSize, ms.messageLength, socket_.GetIp());
+                Terminate();
                 break;
             }
-            case MessageId::KeepAlive: {
-                socket_.updateConnectionTimeout();
-                l->trace("PeerConnect main loop, received keep-alive, updated connection timeout for peer {}", socket_.GetIp());
+            piecesAvailability_ = PeerPiecesAvailability(std::string(bitfield));
+            SPDLOG_LOGGER_TRACE(l, "Received bitfield from {}", socket_.GetIp());
+            break;
+        }
+        case MessageId::Piece: {
+            size_t indexReceived = ms.PieceIndex();
+            size_t beginReceived = ms.PieceBegin();
+            std::string_view dataReceived = ms.PieceBlock();
+
+            // blocks of a piece given back after a timeout may still arrive, they are dropped
+            if (pieceInProgress_ && pieceInProgress_->GetIndex() == indexReceived) {
+                Block* blk = pieceInProgress_->GetBlockByOffset(beginReceived);
+                if(blk){
+                    size_t savedBytes = pieceInProgress_->SaveBlock(beginReceived, dataReceived);
+                    if(savedBytes){
+                        pieceStorage_.bytesDownloaded.fetch_add(savedBytes, std::memory_order_relaxed);
+                        downloadedBytes_.fetch_add(savedBytes, std::memory_order_relaxed);
+                        if (OutstandingRequest* request = FindOutstanding(indexReceived, beginReceived)) {
+                            EraseOutstanding(request);
+                        }
+                    }
+                }
+                SPDLOG_LOGGER_TRACE(l, "Saved piece data for index {} offset {}", indexReceived, beginReceived);
+            }
+            
+            SPDLOG_LOGGER_TRACE(l, "In main loop, peer: {} index {} offset {} saved", socket_.GetIp(), indexReceived, beginReceived);
+            break;
+        }
+        case MessageId::Extended: {
+            if (!extensionProtocol_) {
+                l->warn("Peer {} sent extended message without negotiating it, terminating", socket_.GetIp());
+                Terminate();
                 break;
             }
-            case MessageId::Choke: {
-                choked_ = true;
+            HandleExtendedMessage(ms);
+            break;
+        }
+        case MessageId::HaveAll:
+        case MessageId::HaveNone:
+        case MessageId::SuggestPiece:
+        case MessageId::AllowedFast:
+        case MessageId::RejectRequest: {
+            if (!fastExtension_) {
+                l->warn("Peer {} sent fast extension message {} without negotiating it, terminating", socket_.GetIp(), static_cast<int>(ms.id));
+                Terminate();
                 break;
             }
-            case MessageId::Unchoke: {
-                choked_ = false;
+            HandleFastMessage(ms);
+            break;
+        }
+        default: {
+            l->error("{} peer BEFORE ERROR THROW: {}", socket_.GetIp(), ms.payload.empty() ? std::string_view("empty payload") : ms.payload);
+            throw std::runtime_error("Something bad occurred in main loop");
+        }
+    }
+}
+
+void PeerConnect::HandleFastMessage(const MessageView& ms) {
+    switch (ms.id) {
+        case MessageId::HaveAll:
+        case MessageId::HaveNone: {
+            piecesAvailability_ = PeerPiecesAvailability(tf_.pieceHashes.size(), ms.id == MessageId::HaveAll);
+            SPDLOG_LOGGER_TRACE(l, "Received have all/none from {}", socket_.GetIp());
+            break;
+        }
+        case MessageId::SuggestPiece: {
+            size_t index = ms.HaveIndex();
+            if (index < tf_.pieceHashes.size() && suggestedPieces_.size() < maxSuggestedPieces) {
+                suggestedPieces_.push_back(index);
+            }
+            break;
+        }
+        case MessageId::AllowedFast: {
+            size_t index = ms.HaveIndex();
+            if (index < tf_.pieceHashes.size() &&
+                std::find(allowedFast_.begin(), allowedFast_.end(), index) == allowedFast_.end()) {
+                allowedFast_.push_back(index);
+                SPDLOG_LOGGER_TRACE(l, "Peer {} allows fast piece {}", socket_.GetIp(), index);
+            }
+            break;
+        }
+        case MessageId::RejectRequest: {
+            // rejects for pieces we already gave back are stale
+            OutstandingRequest* request = FindOutstanding(ms.RequestIndex(), ms.RequestBegin());
+            if (!request || !pieceInProgress_) {
                 break;
             }
-            case MessageId::BitField: {
-                std::string bitfield = ms.payload;
-                size_t expectedSize = (size_t)std::ceil(tf_.pieceHashes.size() / 8.0);
-                if(expectedSize != ms.messageLength - 1) {
-                    l->warn("Bitfieldis of incorrect size, expected {}, got {}, terminating connection, peer {}",expectedSize, ms.messageLength, socket_.GetIp());
-                    Terminate();
+            Block* blk = pieceInProgress_->GetBlockByOffset(ms.RequestBegin());
+            EraseOutstanding(request);
+            if (blk && blk->status == Block::Status::Pending) {
+                // request it again right away instead of waiting for a timeout
+                blk->status = Block::Status::Missing;
+            }
+            if (++rejectsForPiece_ >= maxRejectsPerPiece) {
+                l->info("Peer {} rejected piece {} {} times, giving it back", socket_.GetIp(), pieceInProgress_->GetIndex(), rejectsForPiece_);
+                ReturnPieceInProgress(true);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void PeerConnect::HandleExtendedMessage(const MessageView& ms) {
+    std::string_view payload = ms.ExtendedPayload();
+    if (payload.empty() || payload[0] != 'd') {
+        l->warn("Peer {} sent extended message {} without a dictionary", socket_.GetIp(), ms.ExtendedId());
+        return;
+    }
+    std::unique_ptr<Bencode::bencodeDict> dict;
+    try {
+        dict = Bencode::ParseDictRec(std::string(payload)).first;
+    } catch (const std::exception& e) {
+        l->warn("Peer {} sent malformed extended message {}: {}", socket_.GetIp(), ms.ExtendedId(), e.what());
+        return;
+    }
+
+    if (ms.ExtendedId() == extendedHandshakeId) {
+        // no peer exchange for private torrents, peerPexId_ stays 0 and SendPex is never called
+        if (tf_.isPrivate) {
+            return;
+        }
+        auto m = dict->elements.find("m");
+        if (m == dict->elements.end()) {
+            return;
+        }
+        auto* supported = std::get_if<std::unique_ptr<Bencode::bencodeDict>>(&m->second);
+        if (!supported || !*supported) {
+            return;
+        }
+        auto pex = (*supported)->elements.find("ut_pex");
+        if (pex == (*supported)->elements.end()) {
+            return;
+        }
+        // id 0 means the extension was disabled
+        const size_t* pexId = std::get_if<size_t>(&pex->second);
+        peerPexId_ = (pexId && *pexId <= 255) ? static_cast<uint8_t>(*pexId) : 0;
+        SPDLOG_LOGGER_DEBUG(l, "Peer {} ut_pex id {}", socket_.GetIp(), peerPexId_);
+        if (peerPexId_) {
+            SendPex();
+        }
+    } else if (ms.ExtendedId() == localPexId) {
+        // ut_pex was not offered, peers a private torrent's tracker did not give out are not taken
+        if (tf_.isPrivate) {
+            SPDLOG_LOGGER_DEBUG(l, "Peer {} sent ut_pex for a private torrent, ignored", socket_.GetIp());
+            return;
+        }
+        const std::string* added = GetDictString(*dict, "added");
+        if (added) {
+            [[maybe_unused]] size_t queued = peerPool_.Add(ParseCompactPeers(*added), PeerSource::Pex);
+            SPDLOG_LOGGER_DEBUG(l, "Peer {} sent {} peers over ut_pex, {} new", socket_.GetIp(), added->size() / 6, queued);
+        }
+        const std::string* added6 = GetDictString(*dict, "added6");
+        if (added6) {
+            [[maybe_unused]] size_t queued = peerPool_.Add(ParseCompactPeers6(*added6), PeerSource::Pex);
+            SPDLOG_LOGGER_DEBUG(l, "Peer {} sent {} IPv6 peers over ut_pex, {} new", socket_.GetIp(), added6->size() / 18, queued);
+        }
+    } else {
+        SPDLOG_LOGGER_DEBUG(l, "Peer {} sent unknown extended message {}", socket_.GetIp(), ms.ExtendedId());
+    }
+}
+
+TimerWheel::TimerId PeerConnect::ArmRequestTimer(uint32_t index, uint32_t begin) {
+    return timers_.Schedule(requestTimeout, [this, index, begin]() {
+        OnRequestTimeout(index, begin);
+    });
+}
+
+void PeerConnect::OnRequestTimeout(uint32_t index, uint32_t begin) {
+    OutstandingRequest* request = FindOutstanding(index, begin);
+    if (!request) {
+        return;
+    }
+    // the timer has fired already, nothing to cancel
+    request->timer = TimerWheel::noTimer;
+    l->info("Peer {} did not send block {} of piece {} in {}s, giving the piece to other peers",
+            socket_.GetIp(), begin, index, requestTimeout.count());
+    ReturnPieceInProgress(true);
+    if (++requestTimeouts_ >= maxRequestTimeouts) {
+        l->info("Peer {} timed out {} requests, closing the connection", socket_.GetIp(), requestTimeouts_);
+        Terminate();
+        return;
+    }
+    retryRequest_ = true;
+}
+
+void PeerConnect::ScheduleKeepAlive() {
+    timers_.Schedule(keepAliveInterval, [this]() {
+        socket_.SendData(Message::Init(MessageId::KeepAlive, std::string()).ToString());
+        ScheduleKeepAlive();
+    });
+}
+
+void PeerConnect::ResetIdleTimer(std::chrono::seconds timeout) {
+    timers_.Cancel(idleTimer_);
+    idleTimer_ = timers_.Schedule(timeout, [this, timeout]() {
+        idleTimer_ = TimerWheel::noTimer;
+        l->info("Peer {} sent nothing for {}s, closing the connection", socket_.GetIp(), timeout.count());
+        Terminate();
+    });
+}
+
+void PeerConnect::MainLoop() {
+    ResetIdleTimer(handshakeTimeout);
+    ScheduleKeepAlive();
+    while (!terminated_) {
+        SPDLOG_LOGGER_TRACE(l, "{} peer, PeerConnect::MainLoop BEFORE receive from socket", socket_.GetIp());
+        bool requestNeeded = false;
+        try {
+            // sleep until a message arrives or the next timer tick
+            const std::vector<std::string_view>& received = socket_.ReceiveMessages(timers_.UntilNextTick(TimerWheel::Clock::now()));
+            SPDLOG_LOGGER_TRACE(l, "{} peer, AFTER receive from socket, {} messages", socket_.GetIp(), received.size());
+            if (!received.empty()) {
+                ResetIdleTimer(idleTimeout);
+                requestNeeded = true;
+            }
+
+            // all buffered messages first, then one round of requests for the whole batch
+            for (std::string_view receivedData : received) {
+                HandleMessage(MessageView::Parse(receivedData));
+                if (terminated_) {
                     break;
                 }
-                piecesAvailability_ = PeerPiecesAvailability(bitfield);
-                l->trace("Received bitfield from {}", socket_.GetIp());
+            }
+            if (terminated_) {
                 break;
             }
-            case MessageId::Piece: {
-                pendingBlock_ = false;
-                size_t indexReceived = BytesToInt(ms.payload.substr(0, 4));
-                size_t beginReceived = BytesToInt(ms.payload.substr(4, 4));
-                std::string dataReceived = ms.payload.substr(8);
-
-                if (pieceInProgress_) {                    
-                    Block* blk = pieceInProgress_->GetBlockByOffset(beginReceived);
-                    if(blk){
-                        size_t savedBytes = pieceInProgress_->SaveBlock(beginReceived, dataReceived);
-                        if(savedBytes){
-                            pieceStorage_.bytesDownloaded.fetch_add(savedBytes, std::memory_order_relaxed);
-                        }
-                    }
-                    l->trace("Saved piece data for index {} offset {}", indexReceived, beginReceived);
-                }
-                
-                l->trace("In main loop, peer: {} index {} offset {} saved", socket_.GetIp(), indexReceived, beginReceived);
+
+            timers_.Advance(TimerWheel::Clock::now());
+            if (terminated_) {
                 break;
             }
-            default: {
-                l->error("{} peer BEFORE ERROR THROW: {}", socket_.GetIp(), ms.payload.empty() ? "empty payload" : ms.payload);
-                throw std::runtime_error("Something bad occurred in main loop");
+
+            if (peerPexId_ && std::chrono::steady_clock::now() - lastPexSent_ >= pexInterval) {
+                SendPex();
             }
+
+            ApplyChoke();
+            SendHaves();
+            ServeRequests();
+        } catch (const std::exception& e) {
+            l->warn("{} peer, Error in receiveData, del piece, term the peer: {}", socket_.GetIp(), e.what());
+            Terminate();
+            break;
         }
 
-        if (!choked_ && !pendingBlock_) {
-            l->trace("Unchoked, no pending, request piece call, peer {}", socket_.GetIp());
+        if ((requestNeeded || retryRequest_) && (!choked_ || CanRequestWhileChoked())) {
+            SPDLOG_LOGGER_TRACE(l, "Unchoked or allowed fast, no pending, request piece call, peer {}", socket_.GetIp());
+            retryRequest_ = false;
             RequestPiece();
         }
 
-        l->trace("{} peer, requested piece, back to loop, terminated? {}", socket_.GetIp(), terminated_);
+        SPDLOG_LOGGER_TRACE(l, "{} peer, requested piece, back to loop, terminated? {}", socket_.GetIp(), terminated_);
+    }
+
+    // give the unfinished piece back to the queue for other peers, a finished one goes to verification
+    CancelOutstanding(false);
+    if (pieceInProgress_) {
+        if (pieceInProgress_->AllBlocksRetrieved()) {
+            pieceStorage_.PieceProcessed(pieceInProgress_);
+        } else {
+            pieceStorage_.ReturnPiece(pieceInProgress_);
+        }
+        pieceInProgress_ = nullptr;
     }
 
-    l->trace("{} peer, Main loop ended", socket_.GetIp());
+    SPDLOG_LOGGER_TRACE(l, "{} peer, Main loop ended", socket_.GetIp());
 }
 
 
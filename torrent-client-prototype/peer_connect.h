@@ -1,9 +1,18 @@
 #pragma once
 
 #include "tcp_connect.h"
+#include "message.h"
 #include "peer.h"
 #include "torrent_file.h"
 #include "piece_storage.h"
+#include "peer_pool.h"
+#include "timer_wheel.h"
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <atomic>
+
+class Dht;
 
 /*
  * Структура, хранящая информацию о доступности частей скачиваемого файла у данного пира
@@ -18,6 +27,11 @@ public:
      */
     explicit PeerPiecesAvailability(std::string bitfield);
 
+    /*
+     * Bitfield of `piecesCount` pieces with all of them set (Have All) or none (Have None)
+     */
+    PeerPiecesAvailability(size_t piecesCount, bool haveAll);
+
     /*
      * Если ли часть под номером `pieceIndex` у пира?
      */
@@ -42,7 +56,17 @@ private:
  */
 class PeerConnect {
 public:
-    PeerConnect(const Peer& peer, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage);
+    /*
+     * dht -- our DHT node, its port is sent to peers that support the DHT and their ports are pinged by it,
+     * nullptr if the DHT is disabled
+     */
+    PeerConnect(const Peer& peer, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage, PeerPool& peerPool, Dht* dht = nullptr);
+
+    /*
+     * Connection accepted by PeerListener, `handshake` is the one the peer has already sent
+     */
+    PeerConnect(TcpConnect&& socket, std::string handshake, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage, PeerPool& peerPool,
+                Dht* dht = nullptr);
 
     /*
      * Основная функция, в которой будет происходить цикл общения с пиром.
@@ -56,6 +80,23 @@ public:
      * Соединение не удалось установить или оно было разорвано в результате ошибки.
      */
     bool Failed() const;
+
+    /*
+     * For the Choker, called from another thread.
+     * The Choke / Unchoke message is sent by the peer thread after its next wakeup
+     */
+    bool PeerInterested() const;
+    void SetChoked(bool choked);
+
+    // bytes received from / sent to the peer since the previous call
+    size_t TakeDownloadedBytes();
+    size_t TakeUploadedBytes();
+
+    /*
+     * Payload of our extended handshake message. Private torrents (BEP 27) get peers from their trackers only,
+     * so ut_pex is not offered for them
+     */
+    static std::string ExtendedHandshake(const TorrentFile& tf);
 private:
     const TorrentFile& tf_;
     TcpConnect socket_;  // tcp-соединение с пиром
@@ -66,19 +107,88 @@ private:
     bool choked_;  // https://wiki.theory.org/BitTorrentSpecification#Overview
     PiecePtr pieceInProgress_;
     PieceStorage& pieceStorage_;
-    bool pendingBlock_;  // уже послали запрос на скачивание части файла и ждем ответ
     bool failed_;  // соединение не удалось установить или оно было разорвано в результате ошибки
     std::shared_ptr<spdlog::logger> l;
 
+    // blocks of pieceInProgress_ requested from the peer and not received yet, in request order
+    struct OutstandingRequest {
+        uint32_t index;
+        uint32_t begin;
+        uint32_t length;
+        TimerWheel::TimerId timer;
+    };
+    std::vector<OutstandingRequest> outstanding_;
+    static constexpr size_t maxOutstandingRequests = 16;  // pipeline depth, keeps the connection busy between round trips
+
+    // BEP 6 Fast Extension, https://www.bittorrent.org/beps/bep_0006.html
+    bool fastExtension_ = false;  // both sides set the fast bit in the handshake
+    std::vector<size_t> allowedFast_;  // pieces the peer lets us download while choked
+    std::deque<size_t> suggestedPieces_;  // Suggest Piece hints, tried before the common queue
+    size_t rejectsForPiece_ = 0;  // Reject Request messages for pieceInProgress_
+    static constexpr size_t maxRejectsPerPiece = 3;  // then the piece is given back to the storage
+    static constexpr size_t maxSuggestedPieces = 16;
+
+    // BEP 10 Extension Protocol and BEP 11 ut_pex
+    PeerPool& peerPool_;  // peers from ut_pex go here, connected peers are announced from here
+    bool extensionProtocol_ = false;  // both sides set the extension bit in the handshake
+    uint8_t peerPexId_ = 0;  // id of ut_pex in the peer's extended handshake, 0 if not supported
+    std::vector<Peer> pexSent_;  // connected peers as of our last ut_pex message
+    std::chrono::steady_clock::time_point lastPexSent_;
+    static constexpr uint8_t localPexId = 1;  // id of ut_pex in our extended handshake
+    static constexpr std::chrono::seconds pexInterval{60};  // BEP 11 allows one message per minute
+    static constexpr size_t maxPexPeers = 50;  // per added / dropped list
+
+    // BEP 5 DHT, https://www.bittorrent.org/beps/bep_0005.html
+    Dht* dht_;
+    bool peerDht_ = false;  // the peer set the DHT bit in the handshake
+
+    // upload side, https://wiki.theory.org/BitTorrentSpecification#Overview
+    struct BlockRequest {
+        uint32_t index;
+        uint32_t begin;
+        uint32_t length;
+    };
+    bool amChoking_ = true;  // Choke / Unchoke last sent to the peer
+    std::atomic<bool> chokeWanted_{true};  // set by the Choker
+    std::atomic<bool> peerInterested_{false};
+    std::deque<BlockRequest> peerRequests_;  // blocks the peer asked for, served after each batch of messages
+    std::vector<FileSlice> slices_;  // scratch for ServeRequests
+    size_t haveSent_ = 0;  // pieces of PieceStorage::SavedPiecesSince already announced
+    std::atomic<size_t> downloadedBytes_{0};
+    std::atomic<size_t> uploadedBytes_{0};
+    static constexpr size_t maxPeerRequests = 64;
+    static constexpr uint32_t maxRequestLength = 1 << 17;  // peers ask for 16 KiB, larger requests are refused
+
+    // timeouts of this connection, driven by MainLoop
+    TimerWheel timers_{timerTick};
+    TimerWheel::TimerId idleTimer_ = TimerWheel::noTimer;
+    bool retryRequest_ = false;  // request again without waiting for a message, set by timers
+    size_t requestTimeouts_ = 0;
+    static constexpr std::chrono::milliseconds timerTick{500};
+    static constexpr std::chrono::seconds requestTimeout{30};  // then the piece goes to other peers
+    static constexpr size_t maxRequestTimeouts = 2;  // then the connection is closed
+    static constexpr std::chrono::seconds keepAliveInterval{90};  // peers drop connections silent for 2 minutes
+    static constexpr std::chrono::seconds handshakeTimeout{30};  // for the first message after the handshake
+    static constexpr std::chrono::seconds idleTimeout{120};  // for every next message
+
+    std::string inboundHandshake_;  // handshake of a peer that connected to us, empty for outgoing connections
+
     /*
      * Функция производит handshake.
      * - Подключиться к пиру по протоколу TCP
      * - Отправить пиру сообщение handshake
      * - Проверить правильность ответа пира
+     * For an incoming connection the peer's handshake is checked first and then answered
      * https://wiki.theory.org/BitTorrentSpecification#Handshake
      */
     void PerformHandshake();
 
+    // our handshake with the extension bits we support
+    std::string MakeHandshake() const;
+
+    // throws if the peer's handshake is not for our torrent, reads the extension bits
+    void CheckHandshake(const std::string& handshake);
+
     /*
      * - Провести handshake
      * - Получить bitfield с информацией о наличии у пира различных частей файла
@@ -98,9 +208,104 @@ private:
      * За одно сообщение запрашивается не часть целиком, а блок данных размером 2^14 байт или меньше.
      * Если в данный момент мы не знаем, какую часть файла надо запросить у пира, то надо получить эту информацию у
      * PieceStorage
+     * Blocks are requested until maxOutstandingRequests are outstanding or the piece has no missing blocks left
      */
     void RequestPiece();
 
+    // outstanding request for the block, nullptr if we did not ask for it
+    OutstandingRequest* FindOutstanding(uint32_t index, uint32_t begin);
+
+    // stop the request timer and forget the request
+    void EraseOutstanding(OutstandingRequest* request);
+
+    /*
+     * Forget all outstanding requests, optionally telling the peer with Cancel messages.
+     * The blocks stay Pending, ReturnPiece makes them Missing
+     */
+    void CancelOutstanding(bool sendCancel);
+
+    // give pieceInProgress_ and its outstanding requests back to PieceStorage
+    void ReturnPieceInProgress(bool sendCancel);
+
+    /*
+     * Next piece for this peer: an Allowed Fast piece while choked,
+     * otherwise a suggested piece or the next one from PieceStorage.
+     * Never waits for piece memory, `reason` tells why nullptr was returned
+     */
+    PiecePtr NextPieceToDownload(NoPieceReason& reason);
+
+    /*
+     * With the fast extension blocks of Allowed Fast pieces can be requested while choked
+     */
+    bool CanRequestWhileChoked() const;
+
+    /*
+     * Our pieces after the handshake: a bitfield, or Have None (fast extension) while we have nothing
+     */
+    void SendAvailability();
+
+    /*
+     * Queue a block request from the peer, refuse it (Reject Request with the fast extension) if it can not be served
+     */
+    void HandleRequest(const MessageView& ms);
+
+    // refuse a request, only the fast extension has a message for it
+    void RejectRequest(const BlockRequest& request);
+
+    /*
+     * Send Choke / Unchoke if the Choker changed its mind, a choke drops the queued requests
+     */
+    void ApplyChoke();
+
+    /*
+     * Have for every piece saved since the last call
+     */
+    void SendHaves();
+
+    /*
+     * Send the queued blocks, the data goes from the files to the socket with sendfile
+     */
+    void ServeRequests();
+
+    /*
+     * Обработать одно сообщение от пира
+     */
+    void HandleMessage(const MessageView& ms);
+
+    /*
+     * Have All, Have None, Suggest Piece, Allowed Fast and Reject Request, only after the fast extension was negotiated
+     */
+    void HandleFastMessage(const MessageView& ms);
+
+    /*
+     * Extended handshake with the extensions we support (only ut_pex)
+     */
+    void SendExtendedHandshake();
+
+    /*
+     * Extended handshake and ut_pex messages
+     */
+    void HandleExtendedMessage(const MessageView& ms);
+
+    /*
+     * Tell the peer about connections opened and closed since the previous ut_pex message
+     */
+    void SendPex();
+
+    // time out the block just requested
+    TimerWheel::TimerId ArmRequestTimer(uint32_t index, uint32_t begin);
+
+    /*
+     * The block was not received in time, the piece is given back to PieceStorage for other peers
+     */
+    void OnRequestTimeout(uint32_t index, uint32_t begin);
+
+    // keep-alive every keepAliveInterval, reschedules itself
+    void ScheduleKeepAlive();
+
+    // close the connection if the peer sends nothing for `timeout`
+    void ResetIdleTimer(std::chrono::seconds timeout);
+
     /*
      * Основной цикл общения с пиром. Здесь мы ждем следующее сообщение от пира и обрабатываем его.
      * Также, если мы не ждем в данный момент от пира содержимого части файла, то надо отправить соответствующий запрос
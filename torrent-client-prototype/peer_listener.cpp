@@ -0,0 +1,181 @@
+#include "peer_listener.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <stdexcept>
+
+
+PeerListener::PeerListener(int port) : port_(port) {
+    l = spdlog::get("mainLogger");
+    // one dual-stack socket for IPv6 and IPv4 peers, IPv4 only if the host has no IPv6
+    bool ipv6 = true;
+    listenSock_ = socket(AF_INET6, SOCK_STREAM, 0);
+    if (listenSock_ < 0) {
+        ipv6 = false;
+        listenSock_ = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (listenSock_ < 0) {
+        throw std::runtime_error(std::string("Listener socket error: ") + std::strerror(errno));
+    }
+    int yes = 1;
+    setsockopt(listenSock_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+    sockaddr_storage addr{};
+    socklen_t addrLen;
+    if (ipv6) {
+        int no = 0;
+        setsockopt(listenSock_, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(int));
+        sockaddr_in6& addr6 = reinterpret_cast<sockaddr_in6&>(addr);
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_addr = in6addr_any;
+        addr6.sin6_port = htons(static_cast<uint16_t>(port));
+        addrLen = sizeof(sockaddr_in6);
+    } else {
+        sockaddr_in& addr4 = reinterpret_cast<sockaddr_in&>(addr);
+        addr4.sin_family = AF_INET;
+        addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr4.sin_port = htons(static_cast<uint16_t>(port));
+        addrLen = sizeof(sockaddr_in);
+    }
+    if (bind(listenSock_, reinterpret_cast<sockaddr*>(&addr), addrLen) < 0 || listen(listenSock_, SOMAXCONN) < 0) {
+        std::string err = std::strerror(errno);
+        close(listenSock_);
+        throw std::runtime_error("Can not listen on port " + std::to_string(port) + ": " + err);
+    }
+    fcntl(listenSock_, F_SETFL, O_NONBLOCK);
+    l->info("Listening for incoming {} peers on port {}", ipv6 ? "IPv4 and IPv6" : "IPv4", port_);
+    thread_ = std::thread(&PeerListener::AcceptLoop, this);
+}
+
+PeerListener::~PeerListener() {
+    stop_.store(true);
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    for (PendingHandshake& pending : pending_) {
+        close(pending.sock);
+    }
+    close(listenSock_);
+}
+
+void PeerListener::AddTorrent(const std::string& infoHash, InboundHandler handler) {
+    std::lock_guard<std::mutex> lock(mtx);
+    torrents_[infoHash] = std::move(handler);
+}
+
+void PeerListener::RemoveTorrent(const std::string& infoHash) {
+    std::lock_guard<std::mutex> lock(mtx);
+    torrents_.erase(infoHash);
+}
+
+void PeerListener::AcceptLoop() {
+    std::vector<pollfd> fds;
+    while (!stop_.load()) {
+        fds.clear();
+        fds.push_back(pollfd{listenSock_, POLLIN, 0});
+        for (const PendingHandshake& pending : pending_) {
+            fds.push_back(pollfd{pending.sock, POLLIN, 0});
+        }
+        int ready = poll(fds.data(), fds.size(), pollIntervalMs);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            l->error("Listener poll error: {}", std::strerror(errno));
+            return;
+        }
+
+        // fds[i + 1] belongs to pending_[i], new connections are appended after this pass
+        auto now = std::chrono::steady_clock::now();
+        size_t kept = 0;
+        for (size_t i = 0; i < pending_.size(); ++i) {
+            bool keep = true;
+            if (fds[i + 1].revents) {
+                keep = ReadHandshake(pending_[i]);
+            } else if (now > pending_[i].deadline) {
+                SPDLOG_LOGGER_DEBUG(l, "Incoming peer {} did not send a handshake in time", pending_[i].peer.ToString());
+                close(pending_[i].sock);
+                keep = false;
+            }
+            if (keep) {
+                if (kept != i) {
+                    pending_[kept] = std::move(pending_[i]);
+                }
+                kept++;
+            }
+        }
+        pending_.resize(kept);
+
+        if (fds[0].revents & POLLIN) {
+            AcceptNew();
+        }
+    }
+}
+
+void PeerListener::AcceptNew() {
+    while (true) {
+        sockaddr_storage addr{};
+        socklen_t addrLen = sizeof(addr);
+        int sock = accept(listenSock_, reinterpret_cast<sockaddr*>(&addr), &addrLen);
+        if (sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                l->warn("Accept error: {}", std::strerror(errno));
+            }
+            return;
+        }
+        // IPv4 peers of the dual-stack socket come IPv4-mapped, the way Peer keeps IPv4 anyway
+        Peer peer = Peer::FromSockaddr(reinterpret_cast<sockaddr*>(&addr));
+        if (pending_.size() >= maxPendingHandshakes) {
+            SPDLOG_LOGGER_DEBUG(l, "Too many incoming handshakes, dropping {}", peer.ToString());
+            close(sock);
+            continue;
+        }
+        fcntl(sock, F_SETFL, O_NONBLOCK);
+        SPDLOG_LOGGER_DEBUG(l, "Incoming connection from {}", peer.ToString());
+        pending_.push_back(PendingHandshake{sock, peer, std::string(),
+                                            std::chrono::steady_clock::now() + handshakeTimeout});
+    }
+}
+
+bool PeerListener::ReadHandshake(PendingHandshake& pending) {
+    // read exactly the handshake, whatever follows is read by the peer connection
+    char buf[handshakeSize];
+    ssize_t received = recv(pending.sock, buf, handshakeSize - pending.received.size(), 0);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return true;
+    }
+    if (received <= 0) {
+        close(pending.sock);
+        return false;
+    }
+    pending.received.append(buf, static_cast<size_t>(received));
+    if (pending.received.size() < handshakeSize) {
+        return true;
+    }
+    Dispatch(pending);
+    return false;
+}
+
+void PeerListener::Dispatch(PendingHandshake& pending) {
+    const std::string& handshake = pending.received;
+    if (static_cast<unsigned char>(handshake[0]) != 19 || handshake.compare(1, 19, "BitTorrent protocol") != 0) {
+        SPDLOG_LOGGER_DEBUG(l, "Incoming peer {} is not a BitTorrent peer", pending.peer.ToString());
+        close(pending.sock);
+        return;
+    }
+    std::string infoHash = handshake.substr(28, 20);
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = torrents_.find(infoHash);
+    if (it == torrents_.end()) {
+        SPDLOG_LOGGER_DEBUG(l, "Incoming peer {} asked for an unknown torrent", pending.peer.ToString());
+        close(pending.sock);
+        return;
+    }
+    l->info("Incoming peer {} handshake accepted", pending.peer.ToString());
+    it->second(TcpConnect(pending.sock, pending.peer, peerReadTimeout), handshake);
+}
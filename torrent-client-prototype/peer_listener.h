@@ -0,0 +1,78 @@
+#pragma once
+
+#include "tcp_connect.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include "spdlog/spdlog.h"
+
+/*
+ * Listening socket for incoming peer connections.
+ * The accept thread reads the handshake of every new connection, finds the torrent by its infoHash
+ * and gives the connection to that torrent's handler. Connections for unknown torrents,
+ * with a broken handshake or too slow to send it are closed.
+ */
+class PeerListener {
+public:
+    /*
+     * socket -- connected socket, the peer's handshake is already read from it
+     * handshake -- the 68 bytes of that handshake
+     * Called on the listener thread with the listener lock held, it must not block
+     */
+    using InboundHandler = std::function<void(TcpConnect&& socket, std::string handshake)>;
+
+    /*
+     * Bind to `port` on all interfaces, IPv6 and IPv4, and start accepting, throws if the port can not be bound
+     */
+    explicit PeerListener(int port);
+    ~PeerListener();
+
+    PeerListener(const PeerListener&) = delete;
+    PeerListener& operator=(const PeerListener&) = delete;
+
+    void AddTorrent(const std::string& infoHash, InboundHandler handler);
+
+    // after this returns the handler is not called anymore
+    void RemoveTorrent(const std::string& infoHash);
+
+    int GetPort() const{
+        return port_;
+    }
+
+    static constexpr size_t handshakeSize = 68;
+    static constexpr std::chrono::milliseconds peerReadTimeout{6000};
+
+private:
+    struct PendingHandshake {
+        int sock;
+        Peer peer;
+        std::string received;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    void AcceptLoop();
+    void AcceptNew();
+
+    // false if the connection is done with: handed to a torrent or closed
+    bool ReadHandshake(PendingHandshake& pending);
+
+    void Dispatch(PendingHandshake& pending);
+
+    int listenSock_ = -1;
+    int port_;
+    std::atomic<bool> stop_{false};
+    std::mutex mtx;
+    std::map<std::string, InboundHandler> torrents_;  // infoHash -> handler
+    std::vector<PendingHandshake> pending_;  // only used by the accept thread
+    std::thread thread_;
+    std::shared_ptr<spdlog::logger> l;
+
+    static constexpr size_t maxPendingHandshakes = 32;
+    static constexpr std::chrono::seconds handshakeTimeout{10};
+    static constexpr int pollIntervalMs = 500;  // how often the stop flag is checked
+};
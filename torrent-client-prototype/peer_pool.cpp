@@ -0,0 +1,151 @@
+#include "peer_pool.h"
+
+
+PeerPool::PeerPool() {
+    l = spdlog::get("mainLogger");
+}
+
+bool PeerPool::AddLocked(const Peer& peer, PeerSource source) {
+    if (!peer.Valid()) {
+        return false;
+    }
+    auto [it, inserted] = known_.try_emplace(peer, State::Pending);
+    if (!inserted) {
+        if (it->second != State::Tried || source == PeerSource::Pex) {
+            return false;
+        }
+        it->second = State::Pending;
+    }
+    if (source == PeerSource::Lsd || peer.IsLan()) {
+        pending_.push_front(peer);
+    } else {
+        pending_.push_back(peer);
+    }
+    return true;
+}
+
+bool PeerPool::Add(const Peer& peer, PeerSource source) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!AddLocked(peer, source)) {
+        return false;
+    }
+    queued_.notify_all();
+    return true;
+}
+
+size_t PeerPool::Add(const std::vector<Peer>& peers, PeerSource source) {
+    std::lock_guard<std::mutex> lock(mtx);
+    size_t added = 0;
+    for (const Peer& peer : peers) {
+        if (AddLocked(peer, source)) {
+            added++;
+        }
+    }
+    if (added) {
+        queued_.notify_all();
+        l->info("Peer pool: {} new peers, {} known, {} waiting for connection", added, known_.size(), pending_.size());
+    }
+    return added;
+}
+
+std::vector<Peer> PeerPool::TakePending(size_t count) {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<Peer> result;
+    while (result.size() < count && !pending_.empty()) {
+        result.push_back(std::move(pending_.front()));
+        pending_.pop_front();
+        known_[result.back()] = State::Connecting;
+    }
+    return result;
+}
+
+void PeerPool::MarkConnected(const Peer& peer) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = known_.find(peer);
+    if (it != known_.end() && it->second == State::Connecting) {
+        it->second = State::Connected;
+    }
+}
+
+void PeerPool::MarkDisconnected(const Peer& peer) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = known_.find(peer);
+    if (it != known_.end() && (it->second == State::Connecting || it->second == State::Connected)) {
+        it->second = State::Tried;
+    }
+}
+
+std::vector<Peer> PeerPool::ConnectedPeers() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<Peer> result;
+    for (const auto& [peer, state] : known_) {
+        if (state == State::Connected) {
+            result.push_back(peer);
+        }
+    }
+    return result;
+}
+
+size_t PeerPool::PendingCount() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return pending_.size();
+}
+
+bool PeerPool::WaitForPending(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mtx);
+    return queued_.wait_for(lock, timeout, [this]() {
+        return !pending_.empty();
+    });
+}
+
+size_t PeerPool::KnownCount() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return known_.size();
+}
+
+std::vector<Peer> ParseCompactPeers(std::string_view compact) {
+    std::vector<Peer> peers;
+    peers.reserve(compact.size() / 6);
+    for (size_t pos = 0; pos + 6 <= compact.size(); pos += 6) {
+        peers.push_back(Peer::FromCompact(compact.data() + pos, 4));
+    }
+    return peers;
+}
+
+std::vector<Peer> ParseCompactPeers6(std::string_view compact) {
+    std::vector<Peer> peers;
+    peers.reserve(compact.size() / 18);
+    for (size_t pos = 0; pos + 18 <= compact.size(); pos += 18) {
+        peers.push_back(Peer::FromCompact(compact.data() + pos, 16));
+    }
+    return peers;
+}
+
+namespace {
+    void AppendCompact(std::string& out, const Peer& peer, size_t addressOffset) {
+        out.append(reinterpret_cast<const char*>(peer.address.data()) + addressOffset, 16 - addressOffset);
+        out += static_cast<char>(peer.port >> 8);
+        out += static_cast<char>(peer.port & 0xFF);
+    }
+}
+
+std::string EncodeCompactPeers(const std::vector<Peer>& peers) {
+    std::string result;
+    result.reserve(peers.size() * 6);
+    for (const Peer& peer : peers) {
+        if (peer.IsV4()) {
+            AppendCompact(result, peer, 12);
+        }
+    }
+    return result;
+}
+
+std::string EncodeCompactPeers6(const std::vector<Peer>& peers) {
+    std::string result;
+    for (const Peer& peer : peers) {
+        if (!peer.IsV4()) {
+            AppendCompact(result, peer, 0);
+        }
+    }
+    return result;
+}
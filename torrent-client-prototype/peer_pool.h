@@ -0,0 +1,102 @@
+#pragma once
+
+#include "peer.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "spdlog/spdlog.h"
+
+/*
+ * Where we learned about a peer
+ */
+enum class PeerSource {
+    Tracker,
+    Pex,  // ut_pex message from a connected peer, https://www.bittorrent.org/beps/bep_0011.html
+    Dht,  // get_peers lookup, https://www.bittorrent.org/beps/bep_0005.html
+    Lsd,  // local service discovery, https://www.bittorrent.org/beps/bep_0014.html
+};
+
+/*
+ * All peers known for the torrent, shared by the tracker code and every peer connection.
+ * Each address and port is kept once, a peer is handed out for connecting only while it is not connected already.
+ * Peers on the local network are handed out first, they are the fastest to download from.
+ */
+class PeerPool {
+public:
+    PeerPool();
+
+    /*
+     * Add a peer, returns true if it was queued for connecting.
+     * Peers that were already tried are queued again only when a tracker or the DHT returns them,
+     * PEX lists the same peers over and over and would make us reconnect to dead ones
+     */
+    bool Add(const Peer& peer, PeerSource source);
+
+    // returns the number of peers queued
+    size_t Add(const std::vector<Peer>& peers, PeerSource source);
+
+    /*
+     * Take up to `count` queued peers, they are marked as connecting
+     */
+    std::vector<Peer> TakePending(size_t count);
+
+    /*
+     * Handshake with a peer from TakePending succeeded, from now on it is announced with ut_pex
+     */
+    void MarkConnected(const Peer& peer);
+
+    /*
+     * Connection to the peer ended or could not be established, it can be queued again by the tracker
+     */
+    void MarkDisconnected(const Peer& peer);
+
+    // peers we have a connection with, for PEX messages
+    std::vector<Peer> ConnectedPeers() const;
+
+    size_t PendingCount() const;
+
+    /*
+     * Block until some peer is queued or `timeout` passes, returns true in the first case
+     */
+    bool WaitForPending(std::chrono::milliseconds timeout);
+    size_t KnownCount() const;
+
+private:
+    enum class State {
+        Pending,
+        Connecting,  // handed out by TakePending, no handshake yet
+        Connected,
+        Tried,
+    };
+
+    bool AddLocked(const Peer& peer, PeerSource source);
+
+    mutable std::mutex mtx;
+    std::condition_variable queued_;
+    std::unordered_map<Peer, State, PeerHash> known_;
+    std::deque<Peer> pending_;
+    std::shared_ptr<spdlog::logger> l;
+};
+
+/*
+ * Compact peer list: 4 bytes of IPv4 address and 2 bytes of port per peer, both big-endian.
+ * Used by trackers and ut_pex, https://www.bittorrent.org/beps/bep_0023.html
+ */
+std::vector<Peer> ParseCompactPeers(std::string_view compact);
+
+// IPv6 peers are skipped
+std::string EncodeCompactPeers(const std::vector<Peer>& peers);
+
+/*
+ * IPv6 variant: 16 bytes of address and 2 bytes of port per peer, "peers6" of trackers, "added6" of ut_pex,
+ * https://www.bittorrent.org/beps/bep_0007.html
+ */
+std::vector<Peer> ParseCompactPeers6(std::string_view compact);
+
+// IPv4 peers are skipped
+std::string EncodeCompactPeers6(const std::vector<Peer>& peers);
@@ -1,5 +1,7 @@
 #include "byte_tools.h"
 #include "piece.h"
+#include <cstring>
+#include <stdexcept>
 
 constexpr size_t BLOCK_SIZE = 1 << 14;
 
@@ -8,12 +10,12 @@ Piece::Piece(size_t index, size_t length, std::string hash) : index_(index), len
     int times = 0;
     localDownloadedBytes_ = 0;
     while (len >= BLOCK_SIZE){
-        blocks_.emplace_back(Block(index, times * BLOCK_SIZE, BLOCK_SIZE, Block::Status::Missing, std::string()));
+        blocks_.emplace_back(Block(index, times * BLOCK_SIZE, BLOCK_SIZE, Block::Status::Missing));
         times++;
         len -= BLOCK_SIZE;
     }
     if(len > 0){
-        blocks_.emplace_back(Block(index, times * BLOCK_SIZE, len, Block::Status::Missing, std::string()));
+        blocks_.emplace_back(Block(index, times * BLOCK_SIZE, len, Block::Status::Missing));
     }
 
 
@@ -24,7 +26,7 @@ bool Piece::HashMatches() const{
         return false;
     }
     std::string my_own_hash = GetDataHash();
-    std::string expected_hash = GetHash();
+    const std::string& expected_hash = GetHash();
     return my_own_hash == expected_hash;
 
 }
@@ -42,13 +44,20 @@ size_t Piece::GetIndex() const{
     return index_;
 }
 
-size_t Piece::SaveBlock(size_t blockOffset, std::string data){
+size_t Piece::SaveBlock(size_t blockOffset, std::string_view data){
+    if(!buffer_){
+        return 0;
+    }
     for(int i = 0; i < blocks_.size(); ++i){
         if(blocks_[i].offset == blockOffset && blocks_[i].status != Block::Status::Retrieved){
-            blocks_[i].data = std::move(data);
+            if(data.size() != blocks_[i].length){
+                return 0;
+            }
+            std::memcpy(buffer_.Data() + blockOffset, data.data(), data.size());
             blocks_[i].status = Block::Status::Retrieved;
             localDownloadedBytes_ += blocks_[i].length;
-            return blocks_[i].data.length();
+            AdvanceHash();
+            return data.size();
         }
     }
     return 0;
@@ -57,7 +66,7 @@ size_t Piece::SaveBlock(size_t blockOffset, std::string data){
 
 bool Piece::AllBlocksRetrieved() const{
     for(int i = 0; i < blocks_.size(); ++i){
-        if(blocks_[i].status == Block::Status::Missing){
+        if(blocks_[i].status != Block::Status::Retrieved){
             return false;
         }
     }
@@ -66,16 +75,32 @@ bool Piece::AllBlocksRetrieved() const{
 
 
 std::string Piece::GetData() const{
-    std::string res;
-    for(auto blk : blocks_){
-        res += blk.data;
+    return std::string(GetDataView());
+}
+
+std::string_view Piece::GetDataView() const{
+    if(!buffer_){
+        return {};
+    }
+    return std::string_view(buffer_.Data(), length_);
+}
+
+void Piece::AdvanceHash(){
+    while(hashedBlocks_ < blocks_.size() && blocks_[hashedBlocks_].status == Block::Status::Retrieved){
+        const Block& blk = blocks_[hashedBlocks_];
+        hasher_.Update(std::string_view(buffer_.Data() + blk.offset, blk.length));
+        hashedBlocks_++;
+    }
+    if(hashedBlocks_ == blocks_.size() && dataHash_.empty()){
+        dataHash_ = hasher_.Final();
     }
-    return res;
 }
 
 std::string Piece::GetDataHash() const{
-    std::string data = GetData();
-    std::string hsh = CalculateSHA1(data);
+    if(!dataHash_.empty()){
+        return dataHash_;
+    }
+    std::string hsh = CalculateSHA1(GetDataView());
     return hsh;
 }
 
@@ -85,10 +110,32 @@ const std::string& Piece::GetHash() const{
 
 void Piece::Reset(){
     for(int i = 0; i < blocks_.size(); ++i){
-        blocks_[i].data = "";
         blocks_[i].status = Block::Status::Missing;
     }        
     localDownloadedBytes_ = 0;
+    buffer_.Release();
+    hasher_.Reset();
+    hashedBlocks_ = 0;
+    dataHash_.clear();
+}
+
+void Piece::ResetPendingBlocks(){
+    for(auto& blk : blocks_){
+        if(blk.status == Block::Status::Pending){
+            blk.status = Block::Status::Missing;
+        }
+    }
+}
+
+void Piece::AttachBuffer(PieceBuffer buffer){
+    if(buffer.Size() < length_){
+        throw std::runtime_error("Piece buffer is smaller than the piece");
+    }
+    buffer_ = std::move(buffer);
+}
+
+void Piece::ReleaseBuffer(){
+    buffer_.Release();
 }
 
 
@@ -4,6 +4,9 @@
 #include <vector>
 #include <optional>
 #include <memory>
+#include <string_view>
+#include "piece_buffer_pool.h"
+#include "byte_tools.h"
 
 /*
  * Части файла скачиваются не за одно сообщение, а блоками размером 2^14 байт или меньше (последний блок обычно меньше)
@@ -17,13 +20,12 @@ struct Block {
     };
     
     Block() = delete;
-    Block(uint32_t piece_, uint32_t offset_, uint32_t length_, Status status_, std::string data_) : piece(piece_), offset(offset_), length(length_), status(status_), data(data_) {}
+    Block(uint32_t piece_, uint32_t offset_, uint32_t length_, Status status_) : piece(piece_), offset(offset_), length(length_), status(status_) {}
 
     uint32_t piece;  // id части файла, к которой относится данный блок
     uint32_t offset;  // смещение начала блока относительно начала части файла в байтах
     uint32_t length;  // длина блока в байтах
     Status status;  // статус загрузки данного блока
-    std::string data;  // бинарные данные
 };
 
 /*
@@ -40,6 +42,7 @@ public:
 
     /*
      * Совпадает ли хеш скачанных данных с ожидаемым
+     * The hash is computed while blocks arrive, so this is only a comparison once all blocks are retrieved
      */
     bool HashMatches() const;
 
@@ -56,19 +59,28 @@ public:
     /*
      * Сохранить скачанные данные для какого-то блока,
      return number of bytes saved
+     * Data is copied into the piece buffer, nothing is saved if the piece has no buffer attached
      */
-    size_t SaveBlock(size_t blockOffset, std::string data);
+    size_t SaveBlock(size_t blockOffset, std::string_view data);
 
     /*
      * Скачали ли уже все блоки
      */
     bool AllBlocksRetrieved() const;
 
+    /*
+     * Requested but not received blocks become Missing again, retrieved data is kept
+     */
+    void ResetPendingBlocks();
+
     /*
      * Получить скачанные данные для части файла
      */
     std::string GetData() const;
 
+    // same as GetData, but without a copy, valid while the piece holds its buffer
+    std::string_view GetDataView() const;
+
     /*
      * Посчитать хеш по скачанным данным
      */
@@ -81,9 +93,24 @@ public:
 
     /*
      * Удалить все скачанные данные и отметить все блоки как Missing
+     * The buffer is returned to the pool
      */
     void Reset();
 
+    // give the piece memory from the buffer pool before downloading it
+    void AttachBuffer(PieceBuffer buffer);
+
+    bool HasBuffer() const{
+        return static_cast<bool>(buffer_);
+    }
+
+    // return memory to the pool, e.g. after the piece is saved to disk
+    void ReleaseBuffer();
+
+    size_t GetLength() const{
+        return length_;
+    }
+
     const size_t GetDownloadedBytes(){
         return localDownloadedBytes_;
     }
@@ -101,7 +128,15 @@ private:
     const size_t index_, length_;
     const std::string hash_;
     std::vector<Block> blocks_;
+    PieceBuffer buffer_;
     size_t localDownloadedBytes_;
+    // running hash over the contiguous prefix of retrieved blocks
+    Sha1Context hasher_;
+    size_t hashedBlocks_ = 0;
+    std::string dataHash_;  // set when every block is hashed
+
+    // feed newly contiguous blocks into hasher_
+    void AdvanceHash();
 };
 
 using PiecePtr = std::shared_ptr<Piece>;
@@ -0,0 +1,150 @@
+#include "piece_buffer_pool.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+
+namespace {
+    constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    size_t RoundUp(size_t value, size_t alignment){
+        return (value + alignment - 1) / alignment * alignment;
+    }
+}
+
+PieceBuffer::PieceBuffer(PieceBufferPool* pool, char* data, size_t size) : pool_(pool), data_(data), size_(size) {}
+
+PieceBuffer::PieceBuffer(PieceBuffer&& other) noexcept : pool_(other.pool_), data_(other.data_), size_(other.size_) {
+    other.pool_ = nullptr;
+    other.data_ = nullptr;
+    other.size_ = 0;
+}
+
+PieceBuffer& PieceBuffer::operator=(PieceBuffer&& other) noexcept{
+    if(this != &other){
+        Release();
+        pool_ = other.pool_;
+        data_ = other.data_;
+        size_ = other.size_;
+        other.pool_ = nullptr;
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+PieceBuffer::~PieceBuffer(){
+    Release();
+}
+
+void PieceBuffer::Release(){
+    if(data_ && pool_){
+        pool_->Return(data_);
+    }
+    pool_ = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+}
+
+
+PieceBufferPool::PieceBufferPool(size_t bufferSize, size_t maxInFlightBytes, bool useHugePages) :
+    bufferSize_(bufferSize),
+    mappedSize_(RoundUp(bufferSize, useHugePages ? HUGE_PAGE_SIZE : static_cast<size_t>(sysconf(_SC_PAGESIZE)))),
+    maxBuffers_(std::max<size_t>(1, bufferSize == 0 ? 1 : maxInFlightBytes / bufferSize)),
+    useHugePages_(useHugePages) {
+    l = spdlog::get("mainLogger");
+    if(bufferSize_ == 0){
+        throw std::invalid_argument("Piece buffer size can not be 0");
+    }
+    l->info("Piece buffer pool: buffer size {}, at most {} buffers in flight ({} bytes), huge pages {}",
+            bufferSize_, maxBuffers_, maxBuffers_ * bufferSize_, useHugePages_);
+}
+
+PieceBufferPool::~PieceBufferPool(){
+    std::lock_guard<std::mutex> lock(mtx);
+    if(buffersInFlight_ != 0){
+        l->warn("Piece buffer pool destroyed with {} buffers still in flight", buffersInFlight_);
+    }
+    for(char* slab : freeList_){
+        FreeSlab(slab);
+    }
+}
+
+char* PieceBufferPool::AllocateSlab(){
+    void* mem = MAP_FAILED;
+    if(useHugePages_){
+        mem = mmap(nullptr, mappedSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(mem == MAP_FAILED){
+            l->info("MAP_HUGETLB failed ({}), falling back to transparent huge pages", std::strerror(errno));
+            useHugePages_ = false;
+        }
+    }
+    if(mem == MAP_FAILED){
+        mem = mmap(nullptr, mappedSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mem == MAP_FAILED){
+            l->error("Failed to map piece buffer of {} bytes: {}", mappedSize_, std::strerror(errno));
+            throw std::bad_alloc();
+        }
+        if(mappedSize_ % HUGE_PAGE_SIZE == 0){
+            madvise(mem, mappedSize_, MADV_HUGEPAGE);
+        }
+    }
+    return static_cast<char*>(mem);
+}
+
+void PieceBufferPool::FreeSlab(char* slab){
+    munmap(slab, mappedSize_);
+}
+
+char* PieceBufferPool::TakeLocked(){
+    if(buffersInFlight_ >= maxBuffers_){
+        return nullptr;
+    }
+    char* data;
+    if(!freeList_.empty()){
+        data = freeList_.back();
+        freeList_.pop_back();
+    }else{
+        data = AllocateSlab();
+    }
+    buffersInFlight_++;
+    return data;
+}
+
+PieceBuffer PieceBufferPool::TryAcquire(){
+    std::lock_guard<std::mutex> lock(mtx);
+    char* data = TakeLocked();
+    if(!data){
+        return PieceBuffer();
+    }
+    return PieceBuffer(this, data, bufferSize_);
+}
+
+PieceBuffer PieceBufferPool::Acquire(std::chrono::milliseconds timeout){
+    std::unique_lock<std::mutex> lock(mtx);
+    if(!bufferReturned_.wait_for(lock, timeout, [this]() { return buffersInFlight_ < maxBuffers_; })){
+        return PieceBuffer();
+    }
+    return PieceBuffer(this, TakeLocked(), bufferSize_);
+}
+
+void PieceBufferPool::Return(char* data){
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        freeList_.push_back(data);
+        buffersInFlight_--;
+    }
+    bufferReturned_.notify_one();
+}
+
+bool PieceBufferPool::BudgetExhausted() const{
+    std::lock_guard<std::mutex> lock(mtx);
+    return buffersInFlight_ >= maxBuffers_;
+}
+
+size_t PieceBufferPool::BytesInFlight() const{
+    std::lock_guard<std::mutex> lock(mtx);
+    return buffersInFlight_ * bufferSize_;
+}
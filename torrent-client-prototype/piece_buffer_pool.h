@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "spdlog/spdlog.h"
+
+class PieceBufferPool;
+
+/*
+ * Fixed-size buffer that holds the data of one piece while it is being downloaded.
+ * The memory goes back to the owning pool when the buffer is released or destroyed.
+ */
+class PieceBuffer {
+public:
+    PieceBuffer() = default;
+    PieceBuffer(PieceBufferPool* pool, char* data, size_t size);
+    PieceBuffer(PieceBuffer&& other) noexcept;
+    PieceBuffer& operator=(PieceBuffer&& other) noexcept;
+    PieceBuffer(const PieceBuffer&) = delete;
+    PieceBuffer& operator=(const PieceBuffer&) = delete;
+    ~PieceBuffer();
+
+    char* Data() const{
+        return data_;
+    }
+
+    size_t Size() const{
+        return size_;
+    }
+
+    explicit operator bool() const{
+        return data_ != nullptr;
+    }
+
+    // give memory back to the pool, buffer becomes empty
+    void Release();
+
+private:
+    PieceBufferPool* pool_ = nullptr;
+    char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+/*
+ * Slab allocator for piece buffers. All buffers have the same size (torrent piece length),
+ * released buffers are kept in a free list and reused by the next piece.
+ * The total amount of memory held by pieces in flight is limited by `maxInFlightBytes`,
+ * when the limit is reached new buffers are not handed out until some piece is finished.
+ */
+class PieceBufferPool {
+public:
+    /*
+     * bufferSize -- size of one buffer, normally `torrentFile.pieceLength`
+     * maxInFlightBytes -- cap on bytes held by all acquired buffers, at least one buffer is always allowed
+     * useHugePages -- try to back buffers by huge pages (MAP_HUGETLB, falls back to transparent huge pages)
+     */
+    PieceBufferPool(size_t bufferSize, size_t maxInFlightBytes, bool useHugePages);
+    ~PieceBufferPool();
+
+    PieceBufferPool(const PieceBufferPool&) = delete;
+    PieceBufferPool& operator=(const PieceBufferPool&) = delete;
+
+    /*
+     * Get a buffer without waiting, empty buffer is returned if the in-flight limit is reached
+     */
+    PieceBuffer TryAcquire();
+
+    /*
+     * Get a buffer, wait up to `timeout` for another piece to release one if the limit is reached
+     */
+    PieceBuffer Acquire(std::chrono::milliseconds timeout);
+
+    // true if no more buffers can be handed out right now
+    bool BudgetExhausted() const;
+
+    size_t BytesInFlight() const;
+
+    size_t BufferSize() const{
+        return bufferSize_;
+    }
+
+private:
+    friend class PieceBuffer;
+
+    // called by PieceBuffer::Release
+    void Return(char* data);
+
+    // must be called with mtx locked
+    char* TakeLocked();
+
+    char* AllocateSlab();
+    void FreeSlab(char* slab);
+
+    const size_t bufferSize_;
+    const size_t mappedSize_;  // bufferSize_ rounded up to the page (or huge page) size
+    const size_t maxBuffers_;
+    bool useHugePages_;
+    mutable std::mutex mtx;
+    std::condition_variable bufferReturned_;
+    std::vector<char*> freeList_;
+    size_t buffersInFlight_ = 0;
+    std::shared_ptr<spdlog::logger> l;
+};
@@ -1,16 +1,71 @@
 #include "piece_storage.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
 
 
-PieceStorage::PieceStorage(TorrentFile& tf, const std::filesystem::path& outputDirectory, size_t percent, const std::vector<size_t>& selectedIndices, bool doCheck)
-    : tf_(tf), doCheck(doCheck) {
-    l = spdlog::get("mainLogger");
-    l->trace("constructor Piece storage init");
+PieceStorage::PieceStorage(TorrentFile& tf, const std::filesystem::path& outputDirectory, size_t percent, const std::vector<size_t>& selectedIndices, bool doCheck,
+                           size_t maxInFlightBytes, bool useHugePages)
+    : tf_(tf), l(spdlog::get("mainLogger")), bufferPool_(tf.pieceLength, maxInFlightBytes, useHugePages), doCheck(doCheck),
+      journal_(outputDirectory / ("." + tf.name + ".journal"), tf.infoHash) {
+    SPDLOG_LOGGER_TRACE(l, "constructor Piece storage init");
 
     if(!tf_.multipleFiles){
         initSingleFile(outputDirectory, percent);
     }else{
         initMultiFiles(outputDirectory, selectedIndices);
     }
+    servablePieces_.assign(tf_.pieceHashes.size(), false);
+    readFds_.assign(tf_.filesList.size(), -1);
+    unsyncedFiles_.assign(tf_.filesList.size(), false);
+
+    size_t workersCount = std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, 4);
+    l->info("Starting {} piece hashing workers", workersCount);
+    for(size_t i = 0; i < workersCount; ++i){
+        hashWorkers_.emplace_back(&PieceStorage::HashWorker, this);
+    }
+}
+
+PieceStorage::~PieceStorage(){
+    {
+        std::lock_guard<std::mutex> lock(verifyMtx_);
+        stopVerification_ = true;
+    }
+    verifyCv_.notify_all();
+    for(auto& worker : hashWorkers_){
+        worker.join();
+    }
+    for(int fd : readFds_){
+        if(fd >= 0){
+            close(fd);
+        }
+    }
+}
+
+void PieceStorage::HashWorker(){
+    while(true){
+        PiecePtr piece;
+        {
+            std::unique_lock<std::mutex> lock(verifyMtx_);
+            verifyCv_.wait(lock, [this]() { return stopVerification_ || !verifyQueue_.empty(); });
+            // finish the queue before stopping, pieces there are already downloaded
+            if(verifyQueue_.empty()){
+                return;
+            }
+            piece = std::move(verifyQueue_.front());
+            verifyQueue_.pop_front();
+        }
+        try{
+            VerifyPiece(piece);
+        }catch(const std::exception& e){
+            l->error("Hash worker failed to process piece {}: {}", piece->GetIndex(), e.what());
+        }
+        {
+            std::lock_guard<std::mutex> lock(verifyMtx_);
+            piecesBeingVerified_--;
+        }
+        verifyDoneCv_.notify_all();
+    }
 }
 
 void PieceStorage::initSingleFile(const std::filesystem::path& outputDirectory, size_t percent){
@@ -40,7 +95,7 @@ void PieceStorage::initSingleFile(const std::filesystem::path& outputDirectory,
         if(pieceEnd > f.length){
             pieceSize = f.length - i * tf_.pieceLength;
         }
-        remainPieces_.push(std::make_shared<Piece>(Piece(i, pieceSize, tf_.pieceHashes[i])));
+        remainPieces_.push_back(std::make_shared<Piece>(i, pieceSize, tf_.pieceHashes[i]));
     }
 
     std::filesystem::path filePath = outputDirectory / tf_.name;
@@ -118,7 +173,7 @@ void PieceStorage::initMultiFiles(const std::filesystem::path& outputDirectory,
         if (needed) {
             totalBytesToDownload += pieceSize;
             auto piecePtr = std::make_shared<Piece>(i, pieceSize, tf_.pieceHashes[i]);
-            remainPieces_.push(piecePtr);
+            remainPieces_.push_back(piecePtr);
             downloadedCount++;
         }
     }
@@ -131,32 +186,136 @@ void PieceStorage::initMultiFiles(const std::filesystem::path& outputDirectory,
 }
 
 
-PiecePtr PieceStorage::GetNextPieceToDownload() {
+PiecePtr PieceStorage::GetNextPieceToDownload(NoPieceReason& reason, std::chrono::milliseconds bufferWait) {
+    reason = NoPieceReason::None;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(QueueIsEmpty()){
+            l->info("QueueIsEmpty");
+            reason = NoPieceReason::QueueEmpty;
+            return nullptr;
+        }
+        // a piece given back with ReturnPiece already has its memory
+        if(remainPieces_.front()->HasBuffer()){
+            piecesInProgress++;
+            PiecePtr front = remainPieces_.front();
+            remainPieces_.pop_front();
+            return front;
+        }
+    }
+    // wait for memory outside of the storage lock, finishing pieces need it to save themselves
+    PieceBuffer buffer = bufferWait.count() > 0 ? bufferPool_.Acquire(bufferWait) : bufferPool_.TryAcquire();
+    if(!buffer){
+        SPDLOG_LOGGER_DEBUG(l, "In-flight piece memory budget exhausted, {} bytes in flight", bufferPool_.BytesInFlight());
+        reason = NoPieceReason::BudgetExhausted;
+        return nullptr;
+    }
     std::lock_guard<std::mutex> lock(mtx);
     if(QueueIsEmpty()){
         l->info("QueueIsEmpty");
+        reason = NoPieceReason::QueueEmpty;
+        return nullptr;
+    }
+    piecesInProgress++;
+    PiecePtr front = remainPieces_.front();
+    remainPieces_.pop_front();
+    if(!front->HasBuffer()){
+        front->AttachBuffer(std::move(buffer));
+    }
+    return front;
+}
+
+PiecePtr PieceStorage::TakePieceToDownload(size_t index) {
+    auto findQueued = [this, index]() {
+        return std::find_if(remainPieces_.begin(), remainPieces_.end(), [index](const PiecePtr& piece) {
+            return piece->GetIndex() == index;
+        });
+    };
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = findQueued();
+        if(it == remainPieces_.end()){
+            return nullptr;
+        }
+        if((*it)->HasBuffer()){
+            PiecePtr piece = *it;
+            remainPieces_.erase(it);
+            piecesInProgress++;
+            return piece;
+        }
+    }
+    PieceBuffer buffer = bufferPool_.TryAcquire();
+    if(!buffer){
         return nullptr;
-    } else {
-        piecesInProgress++;
-        PiecePtr front = remainPieces_.front();
-        remainPieces_.pop();
-        return front;
     }
+    std::lock_guard<std::mutex> lock(mtx);
+    // another peer could take it while we were getting the buffer
+    auto it = findQueued();
+    if(it == remainPieces_.end()){
+        return nullptr;
+    }
+    PiecePtr piece = *it;
+    remainPieces_.erase(it);
+    piecesInProgress++;
+    if(!piece->HasBuffer()){
+        piece->AttachBuffer(std::move(buffer));
+    }
+    return piece;
 }
 
 void PieceStorage::PieceProcessed(const PiecePtr& piece) {
-    if(piece->AllBlocksRetrieved() && piece->HashMatches()){
+    if(!piece->AllBlocksRetrieved()){
+        l->warn("Piece {} is not complete, resetting", piece->GetIndex());
+        RequeuePiece(piece);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(verifyMtx_);
+        verifyQueue_.push_back(piece);
+        piecesBeingVerified_++;
+    }
+    verifyCv_.notify_one();
+}
+
+void PieceStorage::ReturnPiece(const PiecePtr& piece) {
+    piece->ResetPendingBlocks();
+    std::lock_guard<std::mutex> lock(mtx);
+    remainPieces_.push_back(piece);
+    piecesInProgress--;
+}
+
+bool PieceStorage::VerifyPieceNow(const PiecePtr& piece) {
+    if(!piece->AllBlocksRetrieved()){
+        l->warn("Piece {} is not complete, resetting", piece->GetIndex());
+        RequeuePiece(piece);
+        return false;
+    }
+    return VerifyPiece(piece);
+}
+
+bool PieceStorage::VerifyPiece(const PiecePtr& piece) {
+    if(piece->HashMatches()){
         SavePieceToDisk(piece);
-    } else {
-        l->warn("Hashes do not match, resetting piece {}");
-        size_t piecesDownloadedBytes = piece->GetDownloadedBytes();
-        piece->Reset();
-        bytesDownloaded.fetch_sub(piecesDownloadedBytes, std::memory_order_relaxed);
-        
-        std::lock_guard<std::mutex> lock(mtx);
-        remainPieces_.push(piece);
-        piecesInProgress--;
+        return true;
     }
+    l->warn("Hashes do not match, resetting piece {}", piece->GetIndex());
+    RequeuePiece(piece);
+    return false;
+}
+
+void PieceStorage::RequeuePiece(const PiecePtr& piece) {
+    size_t piecesDownloadedBytes = piece->GetDownloadedBytes();
+    piece->Reset();
+    bytesDownloaded.fetch_sub(piecesDownloadedBytes, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(mtx);
+    remainPieces_.push_back(piece);
+    piecesInProgress--;
+}
+
+void PieceStorage::WaitForVerification() {
+    std::unique_lock<std::mutex> lock(verifyMtx_);
+    verifyDoneCv_.wait(lock, [this]() { return piecesBeingVerified_ == 0; });
 }
 
 bool PieceStorage::QueueIsEmpty() const {
@@ -170,6 +329,8 @@ size_t PieceStorage::PiecesSavedToDiscCount() const {
 }
 
 void PieceStorage::CloseOutputFile(){
+    WaitForVerification();
+    CommitJournal();
     std::lock_guard<std::mutex> lock(mtx);
     for (auto &f : tf_.filesList) {
         if (f.outStream.is_open()) {
@@ -187,21 +348,24 @@ size_t PieceStorage::TotalPiecesCount() const {
 }
 
 void PieceStorage::SavePieceToDisk(const PiecePtr& piece) {
-    std::lock_guard<std::mutex> lock(mtx);
+    std::unique_lock<std::mutex> lock(mtx);
 
     size_t index = piece->GetIndex();
-    size_t pieceSize = piece->GetData().size();
+    std::string_view pieceData = piece->GetDataView();
+    size_t pieceSize = pieceData.size();
     size_t pieceGlobalBegin = index * tf_.pieceLength;
     size_t pieceGlobalEnd = pieceGlobalBegin + pieceSize - 1;
 
+    bool servable = true;
     // For each mapped file, see if overlap
-    for (auto &f : tf_.filesList) {
+    for (size_t fileIndex = 0; fileIndex < tf_.filesList.size(); ++fileIndex) {
+        File& f = tf_.filesList[fileIndex];
         // If no overlap, skip
         if (pieceGlobalEnd < f.startOffset || pieceGlobalBegin > f.endOffset) {
             continue;
         }
         if (!f.isSelected && doCheck) {
-            l->trace("Save piece, file is NOT selected, open stream");
+            SPDLOG_LOGGER_TRACE(l, "Save piece, file is NOT selected, open stream");
             f.outStream.open(f.fullPath, std::ios::binary | std::ios::out);
         }
 
@@ -209,7 +373,7 @@ void PieceStorage::SavePieceToDisk(const PiecePtr& piece) {
         size_t overlapBegin = std::max(pieceGlobalBegin, f.startOffset);
         size_t overlapEnd = std::min(pieceGlobalEnd, f.endOffset);
         size_t overlapSize = overlapEnd - overlapBegin + 1;
-        l->trace("Save piece, index {}, overlapBegin {}, overlapEnd {}", index, overlapBegin, overlapEnd);
+        SPDLOG_LOGGER_TRACE(l, "Save piece, index {}, overlapBegin {}, overlapEnd {}", index, overlapBegin, overlapEnd);
         // Where to read from inside the piece's data
         size_t readOffsetInPiece = overlapBegin - pieceGlobalBegin;
 
@@ -217,15 +381,113 @@ void PieceStorage::SavePieceToDisk(const PiecePtr& piece) {
         std::streamoff writeOffsetInFile = overlapBegin - f.startOffset;
 
         f.outStream.seekp(writeOffsetInFile, std::ios::beg);
-        f.outStream.write(piece->GetData().data() + readOffsetInPiece, overlapSize);
+        f.outStream.write(pieceData.data() + readOffsetInPiece, overlapSize);
         f.outStream.flush(); 
+
+        // flushed data is in the page cache, uploads read it from there with sendfile
+        if (readFds_[fileIndex] < 0 && f.outStream.is_open()) {
+            readFds_[fileIndex] = open(f.fullPath.c_str(), O_RDONLY);
+        }
+        if (!f.outStream || readFds_[fileIndex] < 0) {
+            servable = false;
+        }
+        unsyncedFiles_[fileIndex] = true;
     }
     savedPieces.push_back(index);
+    servablePieces_[index] = servable;
     piecesInProgress--;
+    piece->ReleaseBuffer();
+
+    journal_.Stage(index);
+    bool commitDue = journal_.StagedCount() >= journalCommitPieces;
+    lock.unlock();
+
+    l->info("successfully saved piece {} to disk", index);
+    if(commitDue){
+        CommitJournal();
+    }
+}
+
+bool PieceStorage::HasPiece(size_t index) const{
+    std::lock_guard<std::mutex> lock(mtx);
+    return index < servablePieces_.size() && servablePieces_[index];
+}
+
+std::string PieceStorage::GetBitfield() const{
+    std::lock_guard<std::mutex> lock(mtx);
+    std::string bitfield((servablePieces_.size() + 7) / 8, char(0));
+    for(size_t i = 0; i < servablePieces_.size(); ++i){
+        if(servablePieces_[i]){
+            bitfield[i / 8] |= static_cast<char>(1 << (7 - i % 8));
+        }
+    }
+    return bitfield;
+}
+
+std::vector<size_t> PieceStorage::SavedPiecesSince(size_t from) const{
+    std::lock_guard<std::mutex> lock(mtx);
+    if(from >= savedPieces.size()){
+        return {};
+    }
+    return std::vector<size_t>(savedPieces.begin() + from, savedPieces.end());
+}
 
-    l->info("successfully saved piece {} to disk", piece->GetIndex());
+bool PieceStorage::GetBlockSlices(size_t index, size_t begin, size_t length, std::vector<FileSlice>& slices) const{
+    slices.clear();
+    std::lock_guard<std::mutex> lock(mtx);
+    if(index >= servablePieces_.size() || !servablePieces_[index] || length == 0){
+        return false;
+    }
+    size_t pieceBegin = index * tf_.pieceLength;
+    size_t pieceSize = std::min(tf_.pieceLength, tf_.length - pieceBegin);
+    if(begin + length > pieceSize){
+        return false;
+    }
+    size_t blockBegin = pieceBegin + begin;
+    size_t blockEnd = blockBegin + length - 1;
+    for(size_t fileIndex = 0; fileIndex < tf_.filesList.size(); ++fileIndex){
+        const File& f = tf_.filesList[fileIndex];
+        if(f.length == 0 || blockEnd < f.startOffset || blockBegin > f.endOffset){
+            continue;
+        }
+        size_t overlapBegin = std::max(blockBegin, f.startOffset);
+        size_t overlapEnd = std::min(blockEnd, f.endOffset);
+        slices.push_back(FileSlice{readFds_[fileIndex], static_cast<off_t>(overlapBegin - f.startOffset), overlapEnd - overlapBegin + 1});
+    }
+    return true;
 }
 
 size_t PieceStorage::PiecesInProgressCount() const{
     return piecesInProgress;
 }
+
+void PieceStorage::CommitJournal(){
+    // the commit lock first, so a later commit never writes the journal before an earlier one synced
+    std::lock_guard<std::mutex> commitLock(commitMtx_);
+    std::vector<size_t> pieces;
+    std::vector<int> fds;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        pieces = journal_.TakeStaged();
+        for (size_t fileIndex = 0; fileIndex < unsyncedFiles_.size(); ++fileIndex) {
+            if (!unsyncedFiles_[fileIndex]) {
+                continue;
+            }
+            unsyncedFiles_[fileIndex] = false;
+            if (readFds_[fileIndex] < 0) {
+                // the pieces are read back by the final check instead
+                l->warn("{} is not open to sync it, {} pieces are not journaled", tf_.filesList[fileIndex].fullPath.string(), pieces.size());
+                return;
+            }
+            fds.push_back(readFds_[fileIndex]);
+        }
+    }
+    if (pieces.empty()) {
+        return;
+    }
+    // saved data is flushed to the page cache already, the descriptors stay open until the storage is destroyed
+    for (int fd : fds) {
+        fdatasync(fd);
+    }
+    journal_.Commit(pieces);
+}
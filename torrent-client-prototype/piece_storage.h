@@ -2,32 +2,97 @@
 
 #include "torrent_file.h"
 #include "piece.h"
-#include <queue>
+#include "piece_buffer_pool.h"
+#include "verification_journal.h"
+#include <deque>
 #include <string>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
 #include <cmath>   
 #include <filesystem>
+#include <sys/types.h>
 #include "spdlog/spdlog.h"
 
+/*
+ * Part of a block inside one output file, the block is sent to a peer straight from the file
+ */
+struct FileSlice {
+    int fd;
+    off_t offset;
+    size_t length;
+};
+
+/*
+ * Why GetNextPieceToDownload returned nullptr
+ */
+enum class NoPieceReason {
+    None,
+    QueueEmpty,
+    BudgetExhausted,  // pieces are left, but the in-flight memory limit is reached
+};
+
 /*
  * Хранилище информации о частях скачиваемого файла.
  * В этом классе отслеживается информация о том, какие части файла осталось скачать
  */
 class PieceStorage {
 public:
-    PieceStorage(TorrentFile& tf, const std::filesystem::path& outputDirectory, size_t percent, const std::vector<size_t>& selectedIndices, bool doCheck);
+    /*
+     * maxInFlightBytes -- limit on memory held by pieces that are being downloaded
+     * useHugePages -- back piece buffers by huge pages if possible
+     */
+    PieceStorage(TorrentFile& tf, const std::filesystem::path& outputDirectory, size_t percent, const std::vector<size_t>& selectedIndices, bool doCheck,
+                 size_t maxInFlightBytes = defaultMaxInFlightBytes, bool useHugePages = false);
 
     /*
      * Отдает указатель на следующую часть файла, которую надо скачать
+     * Returns nullptr if the queue is empty or if the in-flight memory budget stays exhausted
+     * for `bufferWait`, `reason` tells which of the two happened.
+     * Peer threads pass a zero `bufferWait` and never block their event loop
+     */
+    PiecePtr GetNextPieceToDownload(NoPieceReason& reason, std::chrono::milliseconds bufferWait = bufferWaitTimeout);
+
+    /*
+     * Take the piece with the given index out of the queue, e.g. an Allowed Fast or suggested piece.
+     * Returns nullptr if the piece is not queued (downloaded or taken by another peer)
+     * or if no piece memory is available right now, never waits
      */
-    PiecePtr GetNextPieceToDownload();
+    PiecePtr TakePieceToDownload(size_t index);
+
+    static constexpr size_t defaultMaxInFlightBytes = 256 * 1024 * 1024;
+    static constexpr std::chrono::milliseconds bufferWaitTimeout{5000};
+
+    ~PieceStorage();
 
     /*
      * Эта функция вызывается из PeerConnect, когда скачивание одной части файла завершено.
      * В рамках данного задания требуется очистить очередь частей для скачивания как только хотя бы одна часть будет успешно скачана.
+     * Complete pieces are queued for the hashing workers and the call returns immediately,
+     * the workers save the piece to disk or put it back into the download queue.
+     * Incomplete pieces are reset and put back right away.
      */
     void PieceProcessed(const PiecePtr& piece);
 
+    /*
+     * Same as PieceProcessed, but the piece is hashed on the calling thread.
+     * For downloaders with their own thread that need the outcome, e.g. web seeds.
+     * Returns true if the piece was complete and its hash matched
+     */
+    bool VerifyPieceNow(const PiecePtr& piece);
+
+    /*
+     * Give an unfinished piece back to the end of the queue, e.g. when its peer stalls or disconnects.
+     * Unlike PieceProcessed the retrieved blocks and the buffer are kept, the next peer downloads only what is missing
+     */
+    void ReturnPiece(const PiecePtr& piece);
+
+    /*
+     * Block until every piece handed to PieceProcessed has been verified
+     */
+    void WaitForVerification();
+
     /*
      * Остались ли нескачанные части файла?
      */
@@ -45,9 +110,17 @@ public:
 
     /*
      * Закрыть поток вывода в файл
+     * Pending verifications are finished first
      */
     void CloseOutputFile();
 
+    /*
+     * Journal of pieces that were hash-checked in memory and synced to disk
+     */
+    const VerificationJournal& GetJournal() const{
+        return journal_;
+    }
+
     /*
      * Отдает список номеров частей файла, которые были сохранены на диск
      */
@@ -61,7 +134,32 @@ public:
     const size_t GetTotalBytesToDownload() const{
         return totalBytesToDownload;
     }
+
+    /*
+     * The piece is verified and saved, so it can be uploaded to peers
+     */
+    bool HasPiece(size_t index) const;
+
+    /*
+     * Bitfield message payload with the pieces we can upload
+     */
+    std::string GetBitfield() const;
+
+    /*
+     * Pieces saved after the first `from` saved ones, in the order they were saved.
+     * Peer connections use it to send Have for new pieces, `from` is the count they already announced
+     */
+    std::vector<size_t> SavedPiecesSince(size_t from) const;
+
+    /*
+     * Where the block [begin, begin + length) of a saved piece is on disk, one slice per output file it spans.
+     * Returns false if the piece is not saved or the block is outside of it.
+     * The descriptors stay open until the storage is destroyed
+     */
+    bool GetBlockSlices(size_t index, size_t begin, size_t length, std::vector<FileSlice>& slices) const;
+
     std::atomic<size_t> bytesDownloaded{0};
+    std::atomic<size_t> bytesUploaded{0};
 protected:
     size_t totalBytesToDownload = 0;
     
@@ -69,11 +167,42 @@ private:
     mutable std::mutex mtx; 
     TorrentFile& tf_;
     std::shared_ptr<spdlog::logger> l;
-    std::queue<PiecePtr> remainPieces_;
-    size_t piecesInProgress; // use atomic maybe?
+    PieceBufferPool bufferPool_; // declared before the pieces, so they give buffers back before the pool is destroyed
+    std::deque<PiecePtr> remainPieces_;
+    size_t piecesInProgress = 0; // use atomic maybe?
     size_t piecesToDownload; // Total number of piece that will be downloaded
     std::vector<size_t> savedPieces;
+    std::vector<bool> servablePieces_;  // saved pieces whose files are all open for reading
+    std::vector<int> readFds_;  // per file of tf_.filesList, -1 until a piece is saved into it
+    std::vector<bool> unsyncedFiles_;  // per file of tf_.filesList, written since the last journal commit
     bool doCheck;
+    VerificationJournal journal_;
+    std::mutex commitMtx_;  // one journal commit at a time, taken without mtx
+    static constexpr size_t journalCommitPieces = 32;  // sync data files and the journal every N saved pieces
+
+    /*
+     * Take the staged pieces and the files written since the last commit under mtx,
+     * then sync the files and append the pieces to the journal without holding it.
+     * mtx must not be locked
+     */
+    void CommitJournal();
+
+    // verification stage, complete pieces wait here for a hashing worker
+    std::mutex verifyMtx_;
+    std::condition_variable verifyCv_;
+    std::condition_variable verifyDoneCv_;
+    std::deque<PiecePtr> verifyQueue_;
+    size_t piecesBeingVerified_ = 0;
+    bool stopVerification_ = false;
+    std::vector<std::thread> hashWorkers_;
+
+    void HashWorker();
+
+    // check the hash of a complete piece, save it or put it back to the queue, true if saved
+    bool VerifyPiece(const PiecePtr& piece);
+
+    // drop piece data and put it back to the download queue
+    void RequeuePiece(const PiecePtr& piece);
     
     // if doCheck download previous whole piece even if the file is not selected
     /*
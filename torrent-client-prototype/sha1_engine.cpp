@@ -0,0 +1,307 @@
+#include "sha1_engine.h"
+#include <openssl/sha.h>
+#include <cstring>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+#include "spdlog/spdlog.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#define SHA1_ENGINE_X86 1
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace Sha1Engine {
+namespace {
+
+bool CpuHasShaExtensions(){
+#if defined(SHA1_ENGINE_X86)
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)){
+        return false;
+    }
+    return (ebx & (1u << 29)) != 0;  // CPUID.(EAX=7,ECX=0):EBX.SHA
+#elif defined(__aarch64__) && defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+#else
+    return false;
+#endif
+}
+
+Backend DetectBackend(){
+#if defined(SHA1_ENGINE_X86)
+    __builtin_cpu_init();
+    // 16 lanes outrun even SHA-NI on a single buffer (about 1.7x), narrower lanes do not
+    if(__builtin_cpu_supports("avx512f")){
+        return Backend::Avx512x16;
+    }
+    if(CpuHasShaExtensions()){
+        return Backend::ShaNi;
+    }
+    if(__builtin_cpu_supports("avx2")){
+        return Backend::Avx2x8;
+    }
+    return Backend::Sse2x4;  // always present on x86-64
+#else
+    if(CpuHasShaExtensions()){
+        return Backend::ArmCrypto;
+    }
+    return Backend::Generic;
+#endif
+}
+
+#if defined(SHA1_ENGINE_X86)
+
+/*
+ * Multi-buffer SHA1: lane i of every vector belongs to buffer i.
+ * Written with GCC vector extensions, the instruction set comes from the target attribute of the caller.
+ */
+template<size_t N>
+struct Lanes {
+    typedef uint32_t Vec __attribute__((vector_size(N * sizeof(uint32_t))));
+};
+
+inline uint32_t LoadBigEndian(const unsigned char* p){
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+// a macro, vectors passed by value to a function would change the ABI depending on the target
+#define SHA1_LANES_ROTL(v, bits) (((v) << (bits)) | ((v) >> (32 - (bits))))
+
+// process one 64-byte block from each lane, `offset` is the block position in every lane buffer
+template<size_t N>
+__attribute__((always_inline)) inline void CompressBlock(typename Lanes<N>::Vec* state, const unsigned char* const* data, size_t offset){
+    using Vec = typename Lanes<N>::Vec;
+    Vec w[16];
+    for(int t = 0; t < 16; ++t){
+        alignas(sizeof(Vec)) uint32_t words[N];
+        for(size_t lane = 0; lane < N; ++lane){
+            words[lane] = LoadBigEndian(data[lane] + offset + 4 * t);
+        }
+        std::memcpy(&w[t], words, sizeof(Vec));
+    }
+
+    Vec a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for(int t = 0; t < 80; ++t){
+        if(t >= 16){
+            w[t & 15] = SHA1_LANES_ROTL(w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15], 1);
+        }
+        Vec f;
+        uint32_t k;
+        if(t < 20){
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }else if(t < 40){
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }else if(t < 60){
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }else{
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        Vec tmp = SHA1_LANES_ROTL(a, 5) + f + e + k + w[t & 15];
+        e = d;
+        d = c;
+        c = SHA1_LANES_ROTL(b, 30);
+        b = a;
+        a = tmp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+// hash N buffers of the same `length`
+template<size_t N>
+__attribute__((always_inline)) inline void HashLanes(const unsigned char* const* data, size_t length, Sha1Digest* digests){
+    using Vec = typename Lanes<N>::Vec;
+    const uint32_t init[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    Vec state[5];
+    for(int i = 0; i < 5; ++i){
+        state[i] = Vec{} + init[i];
+    }
+
+    size_t fullBlocks = length / 64;
+    for(size_t block = 0; block < fullBlocks; ++block){
+        CompressBlock<N>(state, data, block * 64);
+    }
+
+    // padding: remainder, 0x80, zeros, 64-bit big-endian length in bits. Same layout for every lane
+    size_t remainder = length % 64;
+    size_t tailSize = (remainder + 9 <= 64) ? 64 : 128;
+    std::vector<unsigned char> tails(N * tailSize, 0);
+    const unsigned char* tailPtrs[N];
+    uint64_t bitLength = static_cast<uint64_t>(length) * 8;
+    for(size_t lane = 0; lane < N; ++lane){
+        unsigned char* tail = tails.data() + lane * tailSize;
+        std::memcpy(tail, data[lane] + fullBlocks * 64, remainder);
+        tail[remainder] = 0x80;
+        for(int i = 0; i < 8; ++i){
+            tail[tailSize - 1 - i] = static_cast<unsigned char>(bitLength >> (8 * i));
+        }
+        tailPtrs[lane] = tail;
+    }
+    for(size_t offset = 0; offset < tailSize; offset += 64){
+        CompressBlock<N>(state, tailPtrs, offset);
+    }
+
+    for(int i = 0; i < 5; ++i){
+        alignas(sizeof(Vec)) uint32_t words[N];
+        std::memcpy(words, &state[i], sizeof(Vec));
+        for(size_t lane = 0; lane < N; ++lane){
+            digests[lane][4 * i] = static_cast<unsigned char>(words[lane] >> 24);
+            digests[lane][4 * i + 1] = static_cast<unsigned char>(words[lane] >> 16);
+            digests[lane][4 * i + 2] = static_cast<unsigned char>(words[lane] >> 8);
+            digests[lane][4 * i + 3] = static_cast<unsigned char>(words[lane]);
+        }
+    }
+}
+
+void HashLanes4(const unsigned char* const* data, size_t length, Sha1Digest* digests){
+    HashLanes<4>(data, length, digests);
+}
+
+__attribute__((target("avx2"))) void HashLanes8(const unsigned char* const* data, size_t length, Sha1Digest* digests){
+    HashLanes<8>(data, length, digests);
+}
+
+__attribute__((target("avx512f"))) void HashLanes16(const unsigned char* const* data, size_t length, Sha1Digest* digests){
+    HashLanes<16>(data, length, digests);
+}
+
+#endif
+
+struct LaneKernel {
+    size_t lanes;
+    void (*hash)(const unsigned char* const*, size_t, Sha1Digest*);
+};
+
+// kernels worth using on this CPU, widest first
+std::vector<LaneKernel> AvailableKernels(Backend backend){
+    std::vector<LaneKernel> kernels;
+#if defined(SHA1_ENGINE_X86)
+    // with SHA-NI a single OpenSSL call beats 8 and 4 lanes
+    bool narrowLanes = !CpuHasShaExtensions();
+    if(backend == Backend::Avx512x16){
+        kernels.push_back({16, &HashLanes16});
+    }
+    if(narrowLanes && (backend == Backend::Avx512x16 || backend == Backend::Avx2x8)){
+        kernels.push_back({8, &HashLanes8});
+    }
+    if(narrowLanes && (backend == Backend::Avx512x16 || backend == Backend::Avx2x8 || backend == Backend::Sse2x4)){
+        kernels.push_back({4, &HashLanes4});
+    }
+#endif
+    return kernels;
+}
+
+} // namespace
+
+Backend GetBackend(){
+    static const Backend backend = [](){
+        Backend detected = DetectBackend();
+        if(auto l = spdlog::get("mainLogger")){
+            l->info("SHA1 engine backend: {}", BackendName(detected));
+        }
+        return detected;
+    }();
+    return backend;
+}
+
+const char* BackendName(Backend backend){
+    switch(backend){
+        case Backend::Generic: return "generic";
+        case Backend::ShaNi: return "SHA-NI";
+        case Backend::ArmCrypto: return "ARMv8 crypto";
+        case Backend::Sse2x4: return "multi-buffer SSE2 x4";
+        case Backend::Avx2x8: return "multi-buffer AVX2 x8";
+        case Backend::Avx512x16: return "multi-buffer AVX-512 x16";
+    }
+    return "unknown";
+}
+
+size_t PreferredBatchSize(){
+    static const size_t batchSize = [](){
+        auto kernels = AvailableKernels(GetBackend());
+        return kernels.empty() ? size_t(1) : kernels.front().lanes;
+    }();
+    return batchSize;
+}
+
+Sha1Digest Hash(std::span<const char> data){
+    Sha1Digest digest;
+    SHA1(reinterpret_cast<const unsigned char*>(data.data()), data.size(), digest.data());
+    return digest;
+}
+
+void HashBatch(std::span<const std::span<const char>> inputs, std::span<Sha1Digest> digests){
+    if(inputs.size() != digests.size()){
+        throw std::invalid_argument("HashBatch: inputs and digests sizes differ");
+    }
+    static const std::vector<LaneKernel> kernels = AvailableKernels(GetBackend());
+    if(kernels.empty() || inputs.size() < 2){
+        for(size_t i = 0; i < inputs.size(); ++i){
+            digests[i] = Hash(inputs[i]);
+        }
+        return;
+    }
+
+    // group buffers of the same length, only they can share lanes
+    std::vector<size_t> order(inputs.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&inputs](size_t a, size_t b) {
+        return inputs[a].size() < inputs[b].size();
+    });
+
+    const unsigned char* lanePtrs[16];
+    Sha1Digest laneDigests[16];
+    size_t pos = 0;
+    while(pos < order.size()){
+        size_t groupEnd = pos;
+        while(groupEnd < order.size() && inputs[order[groupEnd]].size() == inputs[order[pos]].size()){
+            groupEnd++;
+        }
+        while(pos < groupEnd){
+            size_t remaining = groupEnd - pos;
+            // widest kernel that would be at least half full, idle lanes repeat the last buffer
+            const LaneKernel* kernel = nullptr;
+            for(const auto& k : kernels){
+                if(remaining * 2 > k.lanes){
+                    kernel = &k;
+                    break;
+                }
+            }
+            if(!kernel || remaining < 2){
+                digests[order[pos]] = Hash(inputs[order[pos]]);
+                pos++;
+                continue;
+            }
+            size_t used = std::min(remaining, kernel->lanes);
+            for(size_t lane = 0; lane < kernel->lanes; ++lane){
+                size_t idx = order[pos + std::min(lane, used - 1)];
+                lanePtrs[lane] = reinterpret_cast<const unsigned char*>(inputs[idx].data());
+            }
+            kernel->hash(lanePtrs, inputs[order[pos]].size(), laneDigests);
+            for(size_t lane = 0; lane < used; ++lane){
+                digests[order[pos + lane]] = laneDigests[lane];
+            }
+            pos += used;
+        }
+    }
+}
+
+std::string ToString(const Sha1Digest& digest){
+    return std::string(reinterpret_cast<const char*>(digest.data()), digest.size());
+}
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <array>
+#include <span>
+#include <string>
+#include <cstdint>
+
+using Sha1Digest = std::array<unsigned char, 20>;
+
+/*
+ * SHA1 for piece verification.
+ * Single buffers are hashed by OpenSSL, which uses SHA-NI / ARMv8 crypto instructions when the CPU has them.
+ * Batches of equally sized buffers (all pieces except the last one) are hashed several at once in SIMD lanes:
+ * 16 with AVX-512 (faster than SHA-NI), and on CPUs without SHA instructions 8 with AVX2 or 4 with SSE2.
+ * The backend is chosen once, on the first call.
+ */
+namespace Sha1Engine {
+    enum class Backend {
+        Generic,     // OpenSSL without hardware SHA, no multi-buffer
+        ShaNi,       // x86 SHA extensions, single buffer through OpenSSL
+        ArmCrypto,   // ARMv8 crypto extensions, single buffer through OpenSSL
+        Sse2x4,      // multi-buffer, 4 lanes
+        Avx2x8,      // multi-buffer, 8 lanes
+        Avx512x16,   // multi-buffer, 16 lanes
+    };
+
+    Backend GetBackend();
+
+    const char* BackendName(Backend backend);
+
+    // How many buffers HashBatch hashes together, 1 if there is no multi-buffer path
+    size_t PreferredBatchSize();
+
+    Sha1Digest Hash(std::span<const char> data);
+
+    /*
+     * Hash `inputs[i]` into `digests[i]`, both spans must have the same size.
+     * Buffers do not have to be of the same length, but only equal-length buffers share SIMD lanes.
+     */
+    void HashBatch(std::span<const std::span<const char>> inputs, std::span<Sha1Digest> digests);
+
+    std::string ToString(const Sha1Digest& digest);
+}
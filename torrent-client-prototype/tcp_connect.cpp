@@ -5,20 +5,44 @@
 #include <arpa/inet.h>
 #include <stdexcept>
 #include <cstring>
+#include <algorithm>
 #include <chrono>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/poll.h>
+#include <sys/sendfile.h>
 #include <netdb.h>
 
 
 TcpConnect::TcpConnect(std::string ip, int port, std::chrono::milliseconds connectTimeout, std::chrono::milliseconds readTimeout) :
-    ip_(ip), port_(port), connectTimeout_(connectTimeout), readTimeout_(readTimeout){
+    ip_(ip), port_(port), peer_(ip, port), connectTimeout_(connectTimeout), readTimeout_(readTimeout){
         sock_ = -1;
         l = spdlog::get("mainLogger");
     }
 
+TcpConnect::TcpConnect(const Peer& peer, std::chrono::milliseconds connectTimeout, std::chrono::milliseconds readTimeout) :
+    ip_(peer.Ip()), port_(peer.port), peer_(peer), connectTimeout_(connectTimeout), readTimeout_(readTimeout){
+        sock_ = -1;
+        l = spdlog::get("mainLogger");
+    }
+
+TcpConnect::TcpConnect(int sock, const Peer& peer, std::chrono::milliseconds readTimeout) :
+    ip_(peer.Ip()), port_(peer.port), peer_(peer), connectTimeout_(0), readTimeout_(readTimeout), sock_(sock){
+        l = spdlog::get("mainLogger");
+        if (fcntl(sock_, F_SETFL, O_NONBLOCK) < 0) {
+            l->warn("fcntl error setting nonblock for accepted socket: {}", std::strerror(errno));
+        }
+    }
+
+TcpConnect::TcpConnect(TcpConnect&& other) noexcept :
+    leftover_(std::move(other.leftover_)), leftoverBegin_(other.leftoverBegin_), leftoverEnd_(other.leftoverEnd_),
+    ip_(other.ip_), port_(other.port_), peer_(other.peer_), connectTimeout_(other.connectTimeout_), readTimeout_(other.readTimeout_),
+    sock_(other.sock_), l(std::move(other.l)){
+        other.sock_ = -1;
+        other.leftoverBegin_ = other.leftoverEnd_ = 0;
+    }
+
 TcpConnect::~TcpConnect(){
     if (sock_ != -1) {
         close(sock_);
@@ -27,110 +51,147 @@ TcpConnect::~TcpConnect(){
 
 
 void TcpConnect::EstablishConnection(){
-    struct addrinfo hints;
+    if (sock_ != -1) {
+        return;
+    }
     struct addrinfo* serverResult = NULL;
-    struct addrinfo* receivedNode = NULL; 
-    memset(&hints, 0, sizeof(hints));
-
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    int getaddinfoStatus = getaddrinfo(ip_.c_str(), std::string(std::to_string(port_)).c_str(), &hints, &serverResult);
-    if (getaddinfoStatus != 0) {
-        l->warn("getaddrinfo fail: {}", gai_strerror(getaddinfoStatus));
-        throw std::runtime_error(
-            "getaddrinfo fail: " + std::string(gai_strerror(getaddinfoStatus)));
-    }
-
-    
-    for(receivedNode = serverResult; receivedNode != NULL; receivedNode = receivedNode->ai_next){
-        sock_ = socket(receivedNode->ai_family, receivedNode->ai_socktype, receivedNode->ai_protocol);
-        if(sock_ < 0){
-            continue;
+    // a binary address is the only one to try, a host name is resolved
+    sockaddr_storage peerAddr;
+    struct addrinfo peerNode;
+    memset(&peerNode, 0, sizeof(peerNode));
+    if (peer_.Valid()) {
+        peerNode.ai_addrlen = peer_.ToSockaddr(peerAddr);
+        peerNode.ai_addr = reinterpret_cast<sockaddr*>(&peerAddr);
+        peerNode.ai_family = peerAddr.ss_family;
+        peerNode.ai_socktype = SOCK_STREAM;
+    } else {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        // both address families, a host with IPv4 and IPv6 addresses is raced below
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int getaddinfoStatus = getaddrinfo(ip_.c_str(), std::string(std::to_string(port_)).c_str(), &hints, &serverResult);
+        if (getaddinfoStatus != 0) {
+            l->warn("getaddrinfo fail: {}", gai_strerror(getaddinfoStatus));
+            throw std::runtime_error(
+                "getaddrinfo fail: " + std::string(gai_strerror(getaddinfoStatus)));
+        }
+    }
+    const addrinfo* candidates = peer_.Valid() ? &peerNode : serverResult;
+    auto freeResolved = [serverResult]() {
+        if (serverResult) {
+            freeaddrinfo(serverResult);
         }
-        int yes = 1;
-        setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-
-        // Set nonblocking
-        int fcntlStatus = fcntl(sock_, F_SETFL, O_NONBLOCK);
-        if (fcntlStatus < 0) {
-            l->warn("fcntl error setting nonblock: {}", std::strerror(errno));
-            close(sock_);
-            sock_ = -1;
-            // try next address
-            continue;  
+    };
+
+    // Happy Eyeballs, RFC 8305: alternate the families, start the next attempt every `connectAttemptDelay`
+    // while the earlier ones are still running and keep whichever connects first
+    std::vector<const addrinfo*> v4, v6, addresses;
+    for(const addrinfo* node = candidates; node != NULL; node = node->ai_next){
+        (node->ai_family == AF_INET6 ? v6 : v4).push_back(node);
+    }
+    const std::vector<const addrinfo*>& first = (candidates->ai_family == AF_INET6) ? v6 : v4;
+    const std::vector<const addrinfo*>& second = (candidates->ai_family == AF_INET6) ? v4 : v6;
+    for(size_t i = 0; i < std::max(first.size(), second.size()); ++i){
+        if (i < first.size()) {
+            addresses.push_back(first[i]);
+        }
+        if (i < second.size()) {
+            addresses.push_back(second[i]);
         }
+    }
 
+    std::vector<pollfd> attempts;
+    auto closeAttempts = [&attempts](int keep) {
+        for (const pollfd& attempt : attempts) {
+            if (attempt.fd != keep) {
+                close(attempt.fd);
+            }
+        }
+        attempts.clear();
+    };
 
-        int connect_status = connect(sock_, receivedNode->ai_addr, receivedNode->ai_addrlen );
-        if(connect_status < 0){
-            // waiting for the socket 
-            if(errno == EINPROGRESS){
-                struct timeval tv;
-                tv.tv_sec = connectTimeout_.count() / 1000;
-                tv.tv_usec = (connectTimeout_.count() % 1000) * 1000;
-                
-                fd_set writefds;
-                FD_ZERO(&writefds);
-                FD_SET(sock_, &writefds);
-
-                int selectStatus = select(sock_ + 1, NULL, &writefds, NULL, &tv); 
-                if(selectStatus < 0 && errno != EINTR){
-                    l->warn("Establish connection, select < 0");
-                }else if(selectStatus > 0){
-                    if (!FD_ISSET(sock_, &writefds)) {
-                        l->warn("select() indicated ready, but socket not in writefds");
-                        close(sock_);
-                        sock_ = -1;
-                        continue;
-                    }
-                    // Check for connect errors via getsockopt
-                    int valopt;
-                    socklen_t lon = sizeof(valopt);
-                    if (getsockopt(sock_, SOL_SOCKET, SO_ERROR, &valopt, &lon) < 0) {
-                        l->warn("getsockopt() error after select: {}", std::strerror(errno));
-                        close(sock_);
-                        sock_ = -1;
-                        continue;
-                    }
-                    if (valopt != 0) {
-                        l->warn("Delayed connection error: {}", std::strerror(valopt));   
-                        close(sock_);
-                        sock_ = -1;
-                        continue;
-                    }
-                    // connection success!
-                    freeaddrinfo(serverResult);
-                    return;
-                }else{
-                    l->warn("Timeout in select() - Cancelling!");
-                    // throw std::runtime_error("Timeout in select() - Cancelling!");
-                } 
-                close(sock_);
-                sock_ = -1;
+    auto deadline = std::chrono::steady_clock::now() + connectTimeout_;
+    auto nextAttempt = std::chrono::steady_clock::now();
+    size_t next = 0;
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            l->warn("Timeout connecting to {}:{}", ip_, port_);
+            break;
+        }
+        if (next < addresses.size() && (attempts.empty() || now >= nextAttempt)) {
+            const addrinfo* address = addresses[next++];
+            nextAttempt = now + connectAttemptDelay;
+            int sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (sock < 0) {
                 continue;
-            }else{
-                // Error other than EINPROGRESS
+            }
+            int yes = 1;
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+            if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+                l->warn("fcntl error setting nonblock: {}", std::strerror(errno));
+                close(sock);
+                continue;
+            }
+            if (connect(sock, address->ai_addr, address->ai_addrlen) == 0) {
+                // connected immediately
+                closeAttempts(-1);
+                sock_ = sock;
+                freeResolved();
+                return;
+            }
+            if (errno != EINPROGRESS) {
                 l->warn("Immediate error in connect(): {}", std::strerror(errno));
-                close(sock_);
-                sock_ = -1;
-                continue; 
+                close(sock);
+                continue;
             }
-        }else {
-            // connect() returned 0 immediately; we are connected
-            freeaddrinfo(serverResult);
-            return;
+            attempts.push_back(pollfd{sock, POLLOUT, 0});
+            continue;
+        }
+        if (attempts.empty()) {
+            break;  // every address failed
+        }
+
+        auto wakeUp = (next < addresses.size()) ? std::min(deadline, nextAttempt) : deadline;
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(wakeUp - now);
+        int pollStatus = poll(attempts.data(), attempts.size(), static_cast<int>(std::max<int64_t>(wait.count(), 1)));
+        if (pollStatus < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            l->warn("Establish connection, poll error: {}", std::strerror(errno));
+            break;
+        }
+        for (size_t i = 0; i < attempts.size();) {
+            if (!attempts[i].revents) {
+                ++i;
+                continue;
+            }
+            // Check for connect errors via getsockopt
+            int valopt = 0;
+            socklen_t lon = sizeof(valopt);
+            if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &valopt, &lon) == 0 && valopt == 0) {
+                int sock = attempts[i].fd;
+                closeAttempts(sock);
+                sock_ = sock;
+                freeResolved();
+                return;
+            }
+            l->warn("Delayed connection error: {}", std::strerror(valopt ? valopt : errno));
+            close(attempts[i].fd);
+            attempts.erase(attempts.begin() + i);
         }
     }
+    closeAttempts(-1);
 
     // If we got here, we tried all addresses, but failed
-    if (serverResult) {
-        freeaddrinfo(serverResult);
-    }
+    freeResolved();
     l->warn("Failed to connect to any resolved address");
     throw std::runtime_error("Unable to connect to the given IP/port");
 }
 
-void TcpConnect::SendData(const std::string& data) const{
+void TcpConnect::SendData(std::string_view data) const{
     if (sock_ < 0) {
         l->warn("Invalid socket in send");
         throw std::runtime_error("Invalid socket in send");
@@ -143,13 +204,14 @@ void TcpConnect::SendData(const std::string& data) const{
     size_t dataSize = data.size();
     const char* rawDataPtr = data.data();
     while(totalSent < dataSize){
-        size_t dataSent = send(sock_, rawDataPtr + totalSent, dataSize - totalSent, 0);
-        if(totalSent < 0){
+        ssize_t dataSent = send(sock_, rawDataPtr + totalSent, dataSize - totalSent, 0);
+        if(dataSent < 0){
             if(errno == EINTR){ // signal interrupt, resend
                 continue;
             }else if(errno == EAGAIN || errno == EWOULDBLOCK){
-                l->error("Error in send data, EAGAIN or EWOULDBLOCK");
-                throw std::runtime_error("Error in send data, EAGAIN or EWOULDBLOCK");
+                // send buffer is full, e.g. while uploading to the peer
+                WaitWritable();
+                continue;
             }else{
                 l->error("Error in send data");
                 throw std::runtime_error("Error in send data ?");
@@ -159,6 +221,51 @@ void TcpConnect::SendData(const std::string& data) const{
     }
 }
 
+void TcpConnect::SendFile(int fd, off_t offset, size_t count) const{
+    if (sock_ < 0) {
+        l->warn("Invalid socket in sendfile");
+        throw std::runtime_error("Invalid socket in sendfile");
+    }
+    while (count > 0) {
+        ssize_t dataSent = sendfile(sock_, fd, &offset, count);
+        if (dataSent < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                WaitWritable();
+                continue;
+            }
+            l->error("Error in sendfile: {}", std::strerror(errno));
+            throw std::runtime_error(std::string("Error in sendfile: ") + std::strerror(errno));
+        }
+        if (dataSent == 0) {
+            // the file is shorter than expected
+            throw std::runtime_error("sendfile reached the end of file");
+        }
+        count -= static_cast<size_t>(dataSent);
+    }
+}
+
+void TcpConnect::WaitWritable() const{
+    pollfd p;
+    p.fd = sock_;
+    p.events = POLLOUT;
+    int pollRes;
+    do {
+        pollRes = poll(&p, 1, static_cast<int>(readTimeout_.count()));
+    } while (pollRes < 0 && errno == EINTR);
+    if (pollRes < 0) {
+        throw std::runtime_error(std::string("Poll error: ") + std::strerror(errno));
+    }
+    if (pollRes == 0) {
+        l->warn("Send timed out, peer {}", ip_);
+        throw std::runtime_error("Timeout while sending data");
+    }
+    if (!(p.revents & POLLOUT)) {
+        throw std::runtime_error("Socket is not writable");
+    }
+}
+
 std::string TcpConnect::ReceiveFixedSize(size_t bytesWanted) {
 
     if (bytesWanted == 0) {
@@ -173,10 +280,10 @@ std::string TcpConnect::ReceiveFixedSize(size_t bytesWanted) {
     data.reserve(bytesWanted);
 
     // try looking in leftover buffer first
-    if (!leftover_.empty()) {
-        size_t canTake = std::min(bytesWanted, leftover_.size());
-        data.append(leftover_, 0, canTake);
-        leftover_.erase(0, canTake);
+    if (LeftoverSize() > 0) {
+        size_t canTake = std::min(bytesWanted, LeftoverSize());
+        data.append(Leftover().substr(0, canTake));
+        ConsumeLeftover(canTake);
 
         if (data.size() == bytesWanted) {
             // We already have enough from leftover
@@ -193,41 +300,54 @@ std::string TcpConnect::ReceiveFixedSize(size_t bytesWanted) {
         }
         // After reading, leftover_ might contain more bytes
         size_t needed = bytesWanted - data.size();
-        size_t canTake = std::min(needed, leftover_.size());
-        data.append(leftover_, 0, canTake);
-        leftover_.erase(0, canTake);
+        size_t canTake = std::min(needed, LeftoverSize());
+        data.append(Leftover().substr(0, canTake));
+        ConsumeLeftover(canTake);
         
     }
     return data; 
 }
 bool TcpConnect::ReadIntoLeftover(){
+    return ReadIntoLeftover(readTimeout_);
+}
+
+bool TcpConnect::ReadIntoLeftover(std::chrono::milliseconds timeout){
 
     pollfd p;
     p.fd = sock_;
     p.events = POLLIN;
 
-    size_t pollRes = poll(&p, 1, static_cast<int>(readTimeout_.count()));
+    int pollRes = poll(&p, 1, static_cast<int>(timeout.count()));
     if (pollRes < 0) {
         l->warn("ReadIntoLeftover, poll < 0, peer {}", ip_);
         throw std::runtime_error(std::string("Poll error: ") + std::strerror(errno));
     }
     if (pollRes == 0) {
         // Timed out
-        l->warn("ReadIntoLeftover, poll timed out, peer {}", ip_);
+        SPDLOG_LOGGER_DEBUG(l, "ReadIntoLeftover, poll timed out, peer {}", ip_);
         return false;
     }
 
     if (!(p.revents & POLLIN)) {
         // events like POLLHUP, POLLERR, etc. 
         l->warn("ReadIntoLeftover, poll even is NOT pollin, peer {}", ip_);
-        return false;
+        throw std::runtime_error("Socket error or hangup");
     }
 
     bool didReadAnything = false;
 
+    // drop consumed bytes, views returned earlier are invalidated from here on
+    if (leftoverBegin_ > 0) {
+        std::copy(leftover_.begin() + leftoverBegin_, leftover_.begin() + leftoverEnd_, leftover_.begin());
+        leftoverEnd_ -= leftoverBegin_;
+        leftoverBegin_ = 0;
+    }
+
     while (true) {
-        char buf[4096];
-        ssize_t received = recv(sock_, buf, sizeof(buf), MSG_DONTWAIT);
+        if (leftover_.size() - leftoverEnd_ < minRecvSpace) {
+            leftover_.resize(std::max(leftover_.size() * 2, leftoverEnd_ + minRecvSpace));
+        }
+        ssize_t received = recv(sock_, leftover_.data() + leftoverEnd_, leftover_.size() - leftoverEnd_, MSG_DONTWAIT);
 
         if (received < 0) {
             // If no data is left, EAGAIN or EWOULDBLOCK => break out
@@ -238,13 +358,17 @@ bool TcpConnect::ReadIntoLeftover(){
             throw std::runtime_error(std::string("recv error: ") + std::strerror(errno));
         }
         else if (received == 0) {
+            if (didReadAnything) {
+                // hand out what arrived before the close, the next read reports it
+                break;
+            }
             // Peer closed the connection
             l->warn("ReadIntoLeftover, recv == 0, connection closed, peer {}", sock_);
             throw std::runtime_error("Connection closed by peer");
         }
         else {
-            // We got some data, append to leftover
-            leftover_.append(buf, static_cast<size_t>(received));
+            // We got some data, it is already in leftover
+            leftoverEnd_ += static_cast<size_t>(received);
             didReadAnything = true;
             // Keep reading until EAGAIN
         }
@@ -255,39 +379,62 @@ bool TcpConnect::ReadIntoLeftover(){
 
 
 std::string TcpConnect::ReceiveOneMessage(){
+    return std::string(ReceiveOneMessageView());
+}
+
+bool TcpConnect::TakeBufferedMessage(std::string_view& message){
     // We need at least 4 bytes for the length prefix
-    while (leftover_.size() < 4) {
-        if (!ReadIntoLeftover()) {
-            // Timeout or no data arrived
-            l->warn("ReceiveOneMessage, ReadIntoLeftover false, peer {}", ip_);
-            throw std::runtime_error("Timeout or no data while waiting for length prefix");
-        }
+    if (LeftoverSize() < 4) {
+        return false;
     }
 
     // Parse the 4-byte length
-    uint32_t msgSize = BytesToInt(leftover_.substr(0, 4));
-    leftover_.erase(0, 4);
+    uint32_t msgSize = BytesToInt(Leftover());
 
     // Check size constraints
     if (msgSize > ((1 << 19) - 1)) {
         throw std::runtime_error("Message size too large");
     }
 
-    // Now read until we have the entire message in leftover_
-    while (leftover_.size() < msgSize) {
-        if (!ReadIntoLeftover()) {
-            l->warn("ReceiveOneMessage, ReadIntoLeftover false, full message was not received peer {}", ip_);
-            throw std::runtime_error("Timeout or no data while receiving message payload");
-        }
+    // length prefix is consumed with the message
+    if (LeftoverSize() < 4 + msgSize) {
+        return false;
     }
 
     // Extract the message
-    std::string message = leftover_.substr(0, msgSize);
-    leftover_.erase(0, msgSize);
+    message = Leftover().substr(4, msgSize);
+    ConsumeLeftover(4 + msgSize);
+    return true;
+}
 
+std::string_view TcpConnect::ReceiveOneMessageView(){
+    std::string_view message;
+    while (!TakeBufferedMessage(message)) {
+        if (!ReadIntoLeftover()) {
+            // Timeout or no data arrived
+            l->warn("ReceiveOneMessage, ReadIntoLeftover false, full message was not received peer {}", ip_);
+            throw std::runtime_error("Timeout or no data while receiving message");
+        }
+    }
     return message;
 }
 
+const std::vector<std::string_view>& TcpConnect::ReceiveMessages(std::chrono::milliseconds timeout){
+    batch_.clear();
+    std::string_view message;
+    if (!TakeBufferedMessage(message)) {
+        if (!ReadIntoLeftover(timeout) || !TakeBufferedMessage(message)) {
+            // nothing or only a part of a message arrived in time
+            return batch_;
+        }
+    }
+    // no reads from here on, earlier views stay valid
+    do {
+        batch_.push_back(message);
+    } while (TakeBufferedMessage(message));
+    return batch_;
+}
+
 
 std::string TcpConnect::ReceiveData(size_t bufferSize) {
     if (sock_ < 0) {
@@ -1,20 +1,40 @@
 #pragma once
 
+#include "peer.h"
 #include <string>
+#include <string_view>
+#include <vector>
 #include "spdlog/spdlog.h"
 #include <chrono>
+#include <sys/types.h>
 
 /*
  * Обертка над низкоуровневой структурой сокета.
  */
 class TcpConnect {
 public:
+    // `ip` may be a host name, it is resolved by EstablishConnection
     TcpConnect(std::string ip, int port, std::chrono::milliseconds connectTimeout, std::chrono::milliseconds readTimeout);
+
+    // connects to the address as is, without getaddrinfo
+    TcpConnect(const Peer& peer, std::chrono::milliseconds connectTimeout, std::chrono::milliseconds readTimeout);
+
+    /*
+     * Wrap a socket that is already connected (accepted by PeerListener), EstablishConnection does nothing for it.
+     * The socket is closed by this object
+     */
+    TcpConnect(int sock, const Peer& peer, std::chrono::milliseconds readTimeout);
+
+    TcpConnect(TcpConnect&& other) noexcept;
+    TcpConnect(const TcpConnect&) = delete;
+    TcpConnect& operator=(const TcpConnect&) = delete;
     ~TcpConnect();
 
     /*
      * Установить tcp соединение.
      * Если соединение занимает более `connectTimeout` времени, то прервать подключение и выбросить исключение.
+     * Nothing to do if the socket is connected already.
+     * A host with several addresses, e.g. IPv4 and IPv6, is connected to over all of them at once, the first connection wins.
      * Полезная информация:
      * - https://man7.org/linux/man-pages/man7/socket.7.html
      * - https://man7.org/linux/man-pages/man2/connect.2.html
@@ -32,7 +52,13 @@ public:
      * Полезная информация:
      * - https://man7.org/linux/man-pages/man2/send.2.html
      */
-    void SendData(const std::string& data) const;
+    void SendData(std::string_view data) const;
+
+    /*
+     * Send `count` bytes of the file `fd` starting at `offset` without copying them through user space
+     * - https://man7.org/linux/man-pages/man2/sendfile.2.html
+     */
+    void SendFile(int fd, off_t offset, size_t count) const;
 
     /*
      * Прочитать данные из сокета.
@@ -53,27 +79,75 @@ public:
     // read avaliable data from socket
     bool ReadIntoLeftover();
 
+    // same, waiting at most `timeout` for data, false if none arrived
+    bool ReadIntoLeftover(std::chrono::milliseconds timeout);
+
     // read exactly one message, 
     std::string ReceiveOneMessage();
 
+    /*
+     * Same as ReceiveOneMessage, but returns a view into the receive buffer instead of a copy.
+     * The view is valid until the next Receive* / ReadIntoLeftover call.
+     */
+    std::string_view ReceiveOneMessageView();
+
+    /*
+     * Return every complete message that is in the receive buffer, in order.
+     * The socket is read only if no complete message is buffered yet, then one poll of at most `timeout` + drain of the socket.
+     * The batch is empty if no complete message arrived in time, the caller's event loop decides when the peer is too quiet.
+     * Views are valid until the next Receive* / ReadIntoLeftover call.
+     */
+    const std::vector<std::string_view>& ReceiveMessages(std::chrono::milliseconds timeout);
+
 
     /*
      * Закрыть сокет
      */
     void CloseConnection();
 
-    // Update connection timeout if keep alive received 
-    void updateConnectionTimeout(){
-        return;
-    }
-
     const std::string& GetIp() const;
     int GetPort() const;
+
+    // binary address, not Valid if the connection was made by a host name that is not resolved yet
+    const Peer& GetPeer() const{
+        return peer_;
+    }
 private:
-    std::string leftover_;
+    // received but not yet consumed bytes are [leftoverBegin_, leftoverEnd_) of leftover_,
+    // recv writes right after them, consumed bytes are dropped lazily before the next read
+    std::vector<char> leftover_;
+    size_t leftoverBegin_ = 0;
+    size_t leftoverEnd_ = 0;
+
+    size_t LeftoverSize() const{
+        return leftoverEnd_ - leftoverBegin_;
+    }
+
+    std::string_view Leftover() const{
+        return std::string_view(leftover_.data() + leftoverBegin_, LeftoverSize());
+    }
+
+    void ConsumeLeftover(size_t bytes){
+        leftoverBegin_ += bytes;
+        if(leftoverBegin_ == leftoverEnd_){
+            leftoverBegin_ = leftoverEnd_ = 0;
+        }
+    }
+
+    // true and `message` set if a whole message is buffered, the message is consumed
+    bool TakeBufferedMessage(std::string_view& message);
+
+    // wait up to readTimeout_ until the socket accepts more data, throws otherwise
+    void WaitWritable() const;
+
+    std::vector<std::string_view> batch_;  // result of ReceiveMessages
+
     const std::string ip_;
     const int port_;
+    Peer peer_;
     std::chrono::milliseconds connectTimeout_, readTimeout_;
+    static constexpr std::chrono::milliseconds connectAttemptDelay{250};  // between racing connects to one host's addresses
+    static constexpr size_t minRecvSpace = 1 << 16;  // free space in leftover_ before each recv
     int sock_;
     std::shared_ptr<spdlog::logger> l;
 };
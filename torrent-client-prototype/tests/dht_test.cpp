@@ -0,0 +1,102 @@
+#include "dht.h"
+#include "test_util.h"
+#include "spdlog/sinks/stdout_sinks.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * DHT nodes on 127.0.0.1 find each other with pings, one of them announces a torrent
+ * and another one finds it with get_peers. A node restarted from its cache keeps its id.
+ * Exits with a non-zero code if any check fails
+ */
+
+namespace {
+    constexpr int nodesCount = 8;
+    constexpr int basePort = 27100;
+    constexpr uint16_t announcedPort = 6881;
+    constexpr std::chrono::seconds pollPeriod{1};
+
+    std::string ReadId(const std::filesystem::path& cache) {
+        std::ifstream file(cache, std::ios::binary);
+        std::string id(20, '\0');
+        file.read(id.data(), static_cast<std::streamsize>(id.size()));
+        return file ? id : std::string();
+    }
+}
+
+int main() {
+    spdlog::stdout_logger_mt("mainLogger")->set_level(spdlog::level::warn);
+    std::filesystem::path directory = std::filesystem::temp_directory_path() / "dht_test";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    auto cachePath = [&directory](int i) {
+        return directory / ("node" + std::to_string(i));
+    };
+
+    std::vector<std::unique_ptr<Dht>> nodes;
+    for (int i = 0; i < nodesCount; ++i) {
+        nodes.push_back(std::make_unique<Dht>("127.0.0.1", basePort + i, cachePath(i)));
+    }
+
+    // peers' PORT messages end up in PingNode as well
+    for (int i = 0; i < nodesCount; ++i) {
+        for (int j = 0; j < nodesCount; ++j) {
+            if (i != j) {
+                nodes[i]->PingNode(Peer("127.0.0.1", basePort + j));
+            }
+        }
+    }
+    bool filled = WaitFor([&nodes]() {
+        for (const auto& node : nodes) {
+            if (node->NodeCount() < nodesCount - 1) {
+                return false;
+            }
+        }
+        return true;
+    }, pollPeriod);
+    Check(filled, "pinged nodes are added to the routing tables");
+
+    const std::string infoHash(20, 'h');
+    const Peer announced("127.0.0.1", announcedPort);
+    std::mutex mtx;
+    std::vector<Peer> found;
+    nodes[1]->AddTorrent(infoHash, announcedPort, [](const std::vector<Peer>&) {});
+    // adding the torrent again starts a new get_peers lookup right away
+    auto search = [&]() {
+        nodes[nodesCount - 1]->AddTorrent(infoHash, announcedPort + 1, [&](const std::vector<Peer>& peers) {
+            std::lock_guard<std::mutex> lock(mtx);
+            found.insert(found.end(), peers.begin(), peers.end());
+        });
+    };
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    search();
+    bool announceFound = WaitFor([&]() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return std::find(found.begin(), found.end(), announced) != found.end();
+    }, pollPeriod, search);
+    Check(announceFound, "get_peers finds the peer of announce_peer");
+    nodes[1]->RemoveTorrent(infoHash);
+    nodes[nodesCount - 1]->RemoveTorrent(infoHash);
+
+    // a restart from the cache keeps the id and finds the others again without pings
+    nodes[0].reset();
+    std::string id = ReadId(cachePath(0));
+    Check(id.size() == 20, "node cache is saved");
+    nodes[0] = std::make_unique<Dht>("127.0.0.1", basePort, cachePath(0));
+    bool rejoined = WaitFor([&nodes]() {
+        return nodes[0]->NodeCount() > 0;
+    }, pollPeriod);
+    Check(rejoined, "restarted node bootstraps from its cached nodes");
+    nodes[0].reset();
+    Check(!id.empty() && ReadId(cachePath(0)) == id, "restarted node keeps its id");
+
+    nodes.clear();
+    std::filesystem::remove_all(directory);
+    return TestsFailed() ? 1 : 0;
+}
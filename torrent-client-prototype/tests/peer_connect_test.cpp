@@ -0,0 +1,44 @@
+#include "peer_connect.h"
+#include "bencode.h"
+#include "test_util.h"
+#include "spdlog/sinks/stdout_sinks.h"
+#include <memory>
+#include <string>
+
+/*
+ * Extended handshake offers ut_pex for public torrents only, private torrents (BEP 27) get peers from their trackers.
+ * Exits with a non-zero code if any check fails
+ */
+
+namespace {
+    // the "m" dictionary of an extended handshake payload, nullptr if it is malformed
+    std::unique_ptr<Bencode::bencodeDict> SupportedExtensions(const std::string& payload) {
+        if (payload.empty() || payload[0] != 0) {
+            return nullptr;
+        }
+        auto handshake = Bencode::ParseDictRec(payload.substr(1)).first;
+        auto m = handshake->elements.find("m");
+        if (m == handshake->elements.end()) {
+            return nullptr;
+        }
+        auto* supported = std::get_if<std::unique_ptr<Bencode::bencodeDict>>(&m->second);
+        return supported ? std::move(*supported) : nullptr;
+    }
+}
+
+int main() {
+    spdlog::stdout_logger_mt("mainLogger")->set_level(spdlog::level::warn);
+
+    TorrentFile tf;
+    tf.isPrivate = false;
+    auto publicSupported = SupportedExtensions(PeerConnect::ExtendedHandshake(tf));
+    Check(publicSupported != nullptr, "extended handshake has an m dictionary");
+    Check(publicSupported && publicSupported->elements.contains("ut_pex"), "public torrent offers ut_pex");
+
+    tf.isPrivate = true;
+    auto privateSupported = SupportedExtensions(PeerConnect::ExtendedHandshake(tf));
+    Check(privateSupported != nullptr, "private torrent still sends an extended handshake");
+    Check(privateSupported && !privateSupported->elements.contains("ut_pex"), "private torrent does not offer ut_pex");
+
+    return TestsFailed() ? 1 : 0;
+}
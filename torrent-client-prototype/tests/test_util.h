@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+/*
+ * Checks shared by the test executables, each test returns `TestsFailed() ? 1 : 0` from main
+ */
+
+inline bool testsFailed = false;
+
+inline bool TestsFailed() {
+    return testsFailed;
+}
+
+inline void Check(bool condition, const std::string& what) {
+    std::cout << (condition ? "ok   " : "FAIL ") << what << std::endl;
+    testsFailed = testsFailed || !condition;
+}
+
+inline constexpr std::chrono::seconds waitLimit{20};
+
+// poll `done` every `period` until it is true or `waitLimit` passes, `retry` is called after every poll
+template <typename Done, typename Retry>
+bool WaitFor(Done done, std::chrono::milliseconds period, Retry retry) {
+    auto deadline = std::chrono::steady_clock::now() + waitLimit;
+    while (!done()) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(period);
+        retry();
+    }
+    return true;
+}
+
+template <typename Done>
+bool WaitFor(Done done, std::chrono::milliseconds period) {
+    return WaitFor(done, period, []() {});
+}
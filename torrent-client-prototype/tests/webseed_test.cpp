@@ -0,0 +1,316 @@
+#include "webseed.h"
+#include "byte_tools.h"
+#include "test_util.h"
+#include "spdlog/sinks/stdout_sinks.h"
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Web seeds download small torrents from an HTTP server on 127.0.0.1.
+ * The server honors Range, ignores it or corrupts a piece; pieces are checked to be saved
+ * through VerifyPieceNow and the seed is checked to give up on the last two servers.
+ * Exits with a non-zero code if any check fails
+ */
+
+namespace {
+    constexpr size_t pieceLength = 32 * 1024;
+    constexpr std::chrono::milliseconds pollPeriod{50};
+
+    std::string Pattern(size_t length, size_t seed) {
+        std::string data(length, '\0');
+        for (size_t i = 0; i < length; ++i) {
+            data[i] = static_cast<char>((i * 31 + seed * 7 + i / 251) & 0xFF);
+        }
+        return data;
+    }
+
+    /*
+     * One-connection-at-a-time HTTP/1.1 server, every answer closes the connection
+     */
+    class HttpServer {
+    public:
+        enum class Mode {
+            HonorRange,
+            IgnoreRange,  // 200 with the whole file
+            Corrupt,  // honors Range, but one byte of `corruptPath` is wrong
+        };
+
+        HttpServer(std::map<std::string, std::string> files, Mode mode, std::string corruptPath = "", size_t corruptOffset = 0) :
+            files_(std::move(files)), mode_(mode) {
+            if (mode_ == Mode::Corrupt) {
+                files_.at(corruptPath)[corruptOffset] ^= 0x5A;
+            }
+            sock_ = socket(AF_INET, SOCK_STREAM, 0);
+            int on = 1;
+            setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = 0;
+            socklen_t addrLen = sizeof(addr);
+            if (bind(sock_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(sock_, 16) < 0 ||
+                getsockname(sock_, reinterpret_cast<sockaddr*>(&addr), &addrLen) < 0) {
+                throw std::runtime_error("Test HTTP server cannot listen");
+            }
+            port_ = ntohs(addr.sin_port);
+            thread_ = std::thread(&HttpServer::Run, this);
+        }
+
+        ~HttpServer() {
+            stop_.store(true);
+            thread_.join();
+            close(sock_);
+        }
+
+        std::string Url(const std::string& path) const {
+            return "http://127.0.0.1:" + std::to_string(port_) + path;
+        }
+
+        size_t RangeRequests() const {
+            return rangeRequests_.load();
+        }
+
+    private:
+        void Run() {
+            while (!stop_.load()) {
+                pollfd p{sock_, POLLIN, 0};
+                if (poll(&p, 1, 100) <= 0) {
+                    continue;
+                }
+                int client = accept(sock_, nullptr, nullptr);
+                if (client < 0) {
+                    continue;
+                }
+                Serve(client);
+                close(client);
+            }
+        }
+
+        void Serve(int client) {
+            std::string request;
+            char buf[4096];
+            while (request.find("\r\n\r\n") == std::string::npos) {
+                ssize_t received = recv(client, buf, sizeof(buf), 0);
+                if (received <= 0) {
+                    return;
+                }
+                request.append(buf, static_cast<size_t>(received));
+            }
+            size_t pathBegin = request.find(' ') + 1;
+            std::string path = request.substr(pathBegin, request.find(' ', pathBegin) - pathBegin);
+            auto file = files_.find(path);
+            if (file == files_.end()) {
+                Send(client, "404 Not Found", "", "");
+                return;
+            }
+            const std::string& content = file->second;
+            size_t rangeAt = request.find("Range: bytes=");
+            if (rangeAt == std::string::npos || mode_ == Mode::IgnoreRange) {
+                Send(client, "200 OK", "", content);
+                return;
+            }
+            rangeAt += std::string("Range: bytes=").size();
+            size_t dash = request.find('-', rangeAt);
+            size_t first = std::stoul(request.substr(rangeAt, dash - rangeAt));
+            size_t last = std::stoul(request.substr(dash + 1));
+            rangeRequests_++;
+            if (first >= content.size() || last < first) {
+                Send(client, "416 Range Not Satisfiable", "", "");
+                return;
+            }
+            last = std::min(last, content.size() - 1);
+            std::string contentRange = "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) +
+                                       "/" + std::to_string(content.size()) + "\r\n";
+            Send(client, "206 Partial Content", contentRange, content.substr(first, last - first + 1));
+        }
+
+        void Send(int client, const std::string& status, const std::string& headers, const std::string& body) {
+            std::string response = "HTTP/1.1 " + status + "\r\n" + headers +
+                                   "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            size_t sent = 0;
+            while (sent < response.size()) {
+                ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    return;
+                }
+                sent += static_cast<size_t>(n);
+            }
+        }
+
+        std::map<std::string, std::string> files_;
+        Mode mode_;
+        int sock_ = -1;
+        uint16_t port_ = 0;
+        std::atomic<bool> stop_{false};
+        std::atomic<size_t> rangeRequests_{0};
+        std::thread thread_;
+    };
+
+    // torrent over `contents`, laid out like LoadTorrentFile does
+    TorrentFile MakeTorrent(const std::string& name, const std::vector<std::pair<std::vector<std::string>, std::string>>& contents, bool multipleFiles) {
+        TorrentFile tf;
+        tf.l = spdlog::get("mainLogger");
+        tf.name = name;
+        tf.pieceLength = pieceLength;
+        tf.multipleFiles = multipleFiles;
+        tf.infoHash = std::string(20, 'w');
+        std::string all;
+        for (const auto& [path, content] : contents) {
+            File f;
+            f.length = content.size();
+            f.path = multipleFiles ? path : std::vector<std::string>{name};
+            f.startOffset = all.size();
+            f.endOffset = all.size() + f.length - 1;
+            tf.filesList.push_back(std::move(f));
+            all += content;
+        }
+        tf.length = all.size();
+        for (size_t begin = 0; begin < all.size(); begin += pieceLength) {
+            tf.pieceHashes.push_back(CalculateSHA1(all.substr(begin, pieceLength)));
+        }
+        return tf;
+    }
+
+    std::vector<size_t> AllFiles(const TorrentFile& tf) {
+        std::vector<size_t> indices;
+        for (size_t i = 0; i < tf.filesList.size(); ++i) {
+            indices.push_back(i);
+        }
+        return indices;
+    }
+
+    std::string ReadFile(const std::filesystem::path& path) {
+        std::ifstream file(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    bool FilesMatch(const TorrentFile& tf, const std::vector<std::pair<std::vector<std::string>, std::string>>& contents) {
+        for (size_t i = 0; i < contents.size(); ++i) {
+            if (ReadFile(tf.filesList[i].fullPath) != contents[i].second) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool AllSaved(const PieceStorage& pieces) {
+        return pieces.PiecesSavedToDiscCount() == pieces.TotalPiecesCount();
+    }
+}
+
+int main() {
+    spdlog::stdout_logger_mt("mainLogger")->set_level(spdlog::level::err);
+    std::filesystem::path directory = std::filesystem::temp_directory_path() / "webseed_test";
+    std::filesystem::remove_all(directory);
+    // the journal is created in the output directory, which the client makes before the storage
+    auto outputDir = [&directory](const std::string& name) {
+        std::filesystem::create_directories(directory / name);
+        return directory / name;
+    };
+
+    // file boundaries fall inside pieces, piece 0 spans the first two files and piece 1 the next three
+    const std::vector<std::pair<std::vector<std::string>, std::string>> multi = {
+        {{"a.bin"}, Pattern(20000, 1)},
+        {{"sub dir", "b.bin"}, Pattern(30000, 2)},
+        {{"sub dir", "c.bin"}, Pattern(3000, 3)},
+        {{"d.bin"}, Pattern(60000, 4)},
+    };
+    // paths of a multi-file torrent are url/name/path..., with every part url-encoded
+    const std::map<std::string, std::string> multiFiles = {
+        {"/seed/multi/a.bin", multi[0].second},
+        {"/seed/multi/sub%20dir/b.bin", multi[1].second},
+        {"/seed/multi/sub%20dir/c.bin", multi[2].second},
+        {"/seed/multi/d.bin", multi[3].second},
+    };
+
+    {
+        HttpServer server(multiFiles, HttpServer::Mode::HonorRange);
+        TorrentFile tf = MakeTorrent("multi", multi, true);
+        PieceStorage pieces(tf, outputDir("honor"), 100, AllFiles(tf), false);
+        // runs that start in the middle of a file go first, the held back piece is fetched after it is returned
+        NoPieceReason reason;
+        PiecePtr first = pieces.GetNextPieceToDownload(reason);
+        WebSeed seed(server.Url("/seed"), tf, pieces);
+        bool rest = WaitFor([&pieces]() { return pieces.PiecesSavedToDiscCount() == pieces.TotalPiecesCount() - 1; }, pollPeriod);
+        Check(rest, "multi-file run starting inside a file is saved");
+        pieces.ReturnPiece(first);
+        Check(WaitFor([&pieces]() { return AllSaved(pieces); }, pollPeriod), "returned piece is fetched by the seed");
+        Check(seed.Active(), "seed stays active with nothing left to fetch");
+        Check(server.RangeRequests() > multi.size(), "pieces are fetched with Range requests");
+        seed.Terminate();
+        pieces.CloseOutputFile();
+        Check(FilesMatch(tf, multi), "multi-file data is written to every file");
+        Check(pieces.GetJournal().ReadVerifiedPieces().size() == pieces.TotalPiecesCount(), "saved pieces are journaled");
+    }
+
+    {
+        // a run over whole files is fine without Range support
+        HttpServer server(multiFiles, HttpServer::Mode::IgnoreRange);
+        TorrentFile tf = MakeTorrent("multi", multi, true);
+        PieceStorage pieces(tf, outputDir("whole"), 100, AllFiles(tf), false);
+        WebSeed seed(server.Url("/seed/"), tf, pieces);
+        Check(WaitFor([&pieces]() { return AllSaved(pieces); }, pollPeriod), "whole files are taken from a server ignoring Range");
+        seed.Terminate();
+        pieces.CloseOutputFile();
+        Check(FilesMatch(tf, multi), "whole-file answers are written correctly");
+    }
+
+    {
+        HttpServer server(multiFiles, HttpServer::Mode::IgnoreRange);
+        TorrentFile tf = MakeTorrent("multi", multi, true);
+        PieceStorage pieces(tf, outputDir("norange"), 100, AllFiles(tf), false);
+        NoPieceReason reason;
+        PiecePtr first = pieces.GetNextPieceToDownload(reason);
+        WebSeed seed(server.Url("/seed"), tf, pieces);
+        Check(WaitFor([&seed]() { return !seed.Active(); }, pollPeriod), "seed without Range support is given up");
+        Check(pieces.PiecesSavedToDiscCount() == 0, "nothing is saved from a server ignoring Range");
+        Check(pieces.PiecesInProgressCount() == 1, "pieces of the given up seed are returned to the queue");
+        pieces.ReturnPiece(first);
+    }
+
+    {
+        // piece 2 starts at 65536, inside d.bin
+        HttpServer server(multiFiles, HttpServer::Mode::Corrupt, "/seed/multi/d.bin", 65536 - 53000 + 100);
+        TorrentFile tf = MakeTorrent("multi", multi, true);
+        PieceStorage pieces(tf, outputDir("corrupt"), 100, AllFiles(tf), false);
+        WebSeed seed(server.Url("/seed"), tf, pieces);
+        Check(WaitFor([&seed]() { return !seed.Active(); }, pollPeriod), "seed sending bad pieces is given up");
+        Check(pieces.PiecesSavedToDiscCount() == pieces.TotalPiecesCount() - 1, "good pieces of a corrupting seed are saved");
+        Check(!pieces.HasPiece(2), "corrupted piece is not saved");
+        Check(!pieces.QueueIsEmpty(), "corrupted piece is back in the queue");
+    }
+
+    const std::vector<std::pair<std::vector<std::string>, std::string>> single = {
+        {{}, Pattern(pieceLength * 2 + 777, 5)},
+    };
+    const std::map<std::string, std::string> singleFiles = {
+        {"/files/single%20file.bin", single[0].second},
+        {"/direct.bin", single[0].second},
+    };
+    HttpServer singleServer(singleFiles, HttpServer::Mode::HonorRange);
+    // a single-file url ending with '/' is a directory holding the file, otherwise it is the file itself
+    for (const std::string& path : {std::string("/files/"), std::string("/direct.bin")}) {
+        TorrentFile tf = MakeTorrent("single file.bin", single, false);
+        PieceStorage pieces(tf, outputDir("single" + std::to_string(path.size())), 100, {}, false);
+        WebSeed seed(singleServer.Url(path), tf, pieces);
+        Check(WaitFor([&pieces]() { return AllSaved(pieces); }, pollPeriod), "single-file torrent is fetched from " + path);
+        seed.Terminate();
+        pieces.CloseOutputFile();
+        Check(FilesMatch(tf, single), "single-file data from " + path + " is written");
+    }
+
+    std::filesystem::remove_all(directory);
+    return TestsFailed() ? 1 : 0;
+}
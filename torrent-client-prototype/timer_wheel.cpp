@@ -0,0 +1,101 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick, Clock::time_point start) : tick_(tick), start_(start) {
+}
+
+TimerWheel::Slot& TimerWheel::SlotFor(uint64_t expiry) {
+    uint64_t delta = expiry - currentTick_;
+    for (size_t level = 0; level + 1 < levels; ++level) {
+        if (delta < (uint64_t(1) << (levelBits * (level + 1)))) {
+            return wheel_[level][(expiry >> (levelBits * level)) & slotMask];
+        }
+    }
+    // beyond the last level the timer waits in the farthest slot and cascades again later
+    uint64_t maxDelta = (uint64_t(1) << (levelBits * levels)) - 1;
+    uint64_t clamped = currentTick_ + std::min(delta, maxDelta);
+    return wheel_[levels - 1][(clamped >> (levelBits * (levels - 1))) & slotMask];
+}
+
+void TimerWheel::Place(Slot& from, Slot::iterator it) {
+    Slot& to = SlotFor(it->expiry);
+    to.splice(to.end(), from, it);
+    timers_[it->id] = Location{&to, it};
+}
+
+TimerWheel::TimerId TimerWheel::Schedule(std::chrono::milliseconds delay, Callback callback) {
+    uint64_t ticks = std::max<int64_t>(1, (delay.count() + tick_.count() - 1) / tick_.count());
+    TimerId id = nextId_++;
+    Slot pending;
+    pending.push_back(Timer{id, currentTick_ + ticks, std::move(callback)});
+    Place(pending, pending.begin());
+    return id;
+}
+
+bool TimerWheel::Cancel(TimerId id) {
+    auto found = timers_.find(id);
+    if (found == timers_.end()) {
+        return false;
+    }
+    found->second.slot->erase(found->second.it);
+    timers_.erase(found);
+    return true;
+}
+
+void TimerWheel::Cascade(size_t level) {
+    Slot& slot = wheel_[level][(currentTick_ >> (levelBits * level)) & slotMask];
+    while (!slot.empty()) {
+        Place(slot, slot.begin());
+    }
+}
+
+void TimerWheel::Advance(Clock::time_point now) {
+    if (now < start_) {
+        return;
+    }
+    uint64_t target = static_cast<uint64_t>((now - start_) / tick_);
+    while (currentTick_ < target) {
+        if (timers_.empty()) {
+            // nothing can expire on the way
+            currentTick_ = target;
+            return;
+        }
+        currentTick_++;
+        // on each turn of a level refill it from the level above, the highest level first
+        for (size_t level = levels - 1; level > 0; --level) {
+            uint64_t lowerTicks = uint64_t(1) << (levelBits * level);
+            if (currentTick_ % lowerTicks == 0) {
+                Cascade(level);
+            }
+        }
+        Slot& slot = wheel_[0][currentTick_ & slotMask];
+        // one at a time, a callback may cancel other timers of this slot
+        while (!slot.empty()) {
+            Timer timer = std::move(slot.front());
+            slot.pop_front();
+            timers_.erase(timer.id);
+            if (timer.expiry > currentTick_) {
+                // clamped timer from the last level that is still not due
+                Slot pending;
+                pending.push_back(std::move(timer));
+                Place(pending, pending.begin());
+                continue;
+            }
+            timer.callback();
+        }
+    }
+}
+
+std::chrono::milliseconds TimerWheel::UntilNextTick(Clock::time_point now) const {
+    if (now < start_) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(start_ - now) + tick_;
+    }
+    auto sinceStart = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_);
+    auto nextTick = tick_ * (currentTick_ + 1);
+    if (sinceStart >= nextTick) {
+        return std::chrono::milliseconds(0);
+    }
+    return nextTick - sinceStart;
+}
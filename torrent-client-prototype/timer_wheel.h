@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+/*
+ * Hierarchical timer wheel: schedule, cancel and expiry are O(1) per timer.
+ * Time goes in ticks of `tick`, the first level has one slot per tick, each next level one slot per turn of the previous one.
+ * Timers far in the future sit in an upper level and cascade down as the wheel turns.
+ * Not thread safe, it is meant to be driven by the event loop that owns it:
+ * wait for at most UntilNextTick(), then Advance() to run what expired.
+ */
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+    using TimerId = uint64_t;
+    using Callback = std::function<void()>;
+
+    static constexpr TimerId noTimer = 0;  // never returned by Schedule
+
+    explicit TimerWheel(std::chrono::milliseconds tick, Clock::time_point start = Clock::now());
+
+    /*
+     * Run `callback` once, after at least `delay` (rounded up to whole ticks, at least one tick)
+     */
+    TimerId Schedule(std::chrono::milliseconds delay, Callback callback);
+
+    /*
+     * Returns false if the timer already fired or was cancelled, noTimer is accepted
+     */
+    bool Cancel(TimerId id);
+
+    /*
+     * Move the wheel to `now` and run the callbacks of every expired timer, in expiry order.
+     * Callbacks may schedule and cancel timers
+     */
+    void Advance(Clock::time_point now);
+
+    /*
+     * How long the event loop may sleep before the next Advance is needed
+     */
+    std::chrono::milliseconds UntilNextTick(Clock::time_point now) const;
+
+    size_t Size() const{
+        return timers_.size();
+    }
+
+private:
+    static constexpr size_t levelBits = 6;
+    static constexpr size_t slotsPerLevel = 1 << levelBits;
+    static constexpr size_t levels = 4;  // with a 500ms tick the last level reaches ~97 days
+    static constexpr uint64_t slotMask = slotsPerLevel - 1;
+
+    struct Timer {
+        TimerId id;
+        uint64_t expiry;  // in ticks
+        Callback callback;
+    };
+    using Slot = std::list<Timer>;
+
+    struct Location {
+        Slot* slot;
+        Slot::iterator it;
+    };
+
+    // put the timer into the slot matching its distance from currentTick_
+    void Place(Slot& from, Slot::iterator it);
+    Slot& SlotFor(uint64_t expiry);
+
+    // move the timers of the current slot of `level` down, they are due within the level below
+    void Cascade(size_t level);
+
+    const std::chrono::milliseconds tick_;
+    const Clock::time_point start_;
+    uint64_t currentTick_ = 0;  // every tick up to this one was processed
+    TimerId nextId_ = 1;
+    std::array<std::array<Slot, slotsPerLevel>, levels> wheel_;
+    std::unordered_map<TimerId, Location> timers_;
+};
@@ -7,18 +7,39 @@
 
 
 
+void populateAnnounceTier(const Bencode::bencodeList& list, std::vector<std::string>& tier){
+    for (const auto& el : list.elements) {
+        std::visit([&tier](const auto& value) {
+            using T = std::decay_t<decltype(value)>; 
+            if constexpr (std::is_same_v<T, std::string>) {
+                tier.push_back(value);
+            } else if constexpr (std::is_same_v<T, size_t>) {
+                throw std::runtime_error("Torrent parser visit integer in announce list");
+            } else if constexpr (std::is_same_v<T, std::unique_ptr<Bencode::bencodeList>>) {
+                populateAnnounceTier(*value, tier);
+            }
+        }, el);
+    }
+}
+
+// announce-list is a list of tiers, every tier is a list of urls
 void populateAnnounceList(const Bencode::bencodeList& list, TorrentFile& TFile){
     for (const auto& el : list.elements) {
-        std::visit([&TFile](const auto& value) {
+        std::vector<std::string> tier;
+        std::visit([&tier](const auto& value) {
             using T = std::decay_t<decltype(value)>; 
             if constexpr (std::is_same_v<T, std::string>) {
-                TFile.announceList.push_back(value);
+                tier.push_back(value);  // not a list, take the url as a tier of its own
             } else if constexpr (std::is_same_v<T, size_t>) {
                 throw std::runtime_error("Torrent parser visit integer in announce list");
             } else if constexpr (std::is_same_v<T, std::unique_ptr<Bencode::bencodeList>>) {
-                populateAnnounceList(*value, TFile);
+                populateAnnounceTier(*value, tier);
             }
         }, el);
+        if (!tier.empty()) {
+            TFile.announceList.insert(TFile.announceList.end(), tier.begin(), tier.end());
+            TFile.announceTiers.push_back(std::move(tier));
+        }
     }
 }
 
@@ -50,6 +71,7 @@ TorrentFile LoadTorrentFile(const std::string& filename){
             auto res = Bencode::ParseString(data.substr(cur_pos));
             if(TFile.announceList.empty()){
                 TFile.announceList.emplace_back(res.first);
+                TFile.announceTiers.push_back({res.first});
             }
             cur_pos += res.second;
         }
@@ -209,21 +231,21 @@ TorrentFile LoadTorrentFile(const std::string& filename){
             catch(std::exception& e){
                 TFile.l->error("Load torrent file exception in info: {}", e.what());
             }
-            TFile.l->trace("after info");
+            SPDLOG_LOGGER_TRACE(TFile.l, "after info");
         }else if(global_key.first == "announce-list"){
-            // need to change for backups rather then a single list 
             // auto res = Bencode::ParseList(data.substr(cur_pos));
             auto res = Bencode::ParseListRec(data.substr(cur_pos));
             cur_pos += res.second;
             if(!TFile.announceList.empty()){
                 TFile.announceList.clear();
+                TFile.announceTiers.clear();
             }
             
             populateAnnounceList(*res.first, TFile);
 
-            TFile.l->info("announce list called, total links: {}", TFile.announceList.size());
-            for (const auto& elem : TFile.announceList) {
-                TFile.l->trace("{}", elem);
+            TFile.l->info("announce list called, total links: {}, tiers: {}", TFile.announceList.size(), TFile.announceTiers.size());
+            for ([[maybe_unused]] const auto& elem : TFile.announceList) {
+                SPDLOG_LOGGER_TRACE(TFile.l, "{}", elem);
             }
         }else if(global_key.first == "creation date"){
             TFile.l->info("creation date was called");
@@ -242,11 +264,25 @@ TorrentFile LoadTorrentFile(const std::string& filename){
             cur_pos += res.second;
         }else if(global_key.first == "url-list"){
             TFile.l->info("url-list was called");
-            auto res = Bencode::ParseListRec(data.substr(cur_pos));
-            cur_pos += res.second;
-            // std::cout << "url-list does not supported in this task"<< std::endl;
+            // BEP 19: a single url or a list of them
+            if (data[cur_pos] == 'l') {
+                auto res = Bencode::ParseListRec(data.substr(cur_pos));
+                cur_pos += res.second;
+                for (const auto& el : res.first->elements) {
+                    if (const std::string* url = std::get_if<std::string>(&el); url && !url->empty()) {
+                        TFile.urlList.push_back(*url);
+                    }
+                }
+            } else {
+                auto res = Bencode::ParseString(data.substr(cur_pos));
+                cur_pos += res.second;
+                if (!res.first.empty()) {
+                    TFile.urlList.push_back(res.first);
+                }
+            }
+            TFile.l->info("url-list has {} web seeds", TFile.urlList.size());
         }else if (global_key.first == "httpseeds"){
-            TFile.l->info("httpseeds was called");
+            TFile.l->info("httpseeds was called, BEP 17 seeds are not supported");
             auto res = Bencode::ParseListRec(data.substr(cur_pos));
             cur_pos += res.second;
         }else if (global_key.first == "encoding"){
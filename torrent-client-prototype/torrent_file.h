@@ -25,6 +25,8 @@ struct File{
 
 struct TorrentFile {
     std::vector<std::string> announceList;
+    std::vector<std::vector<std::string>> announceTiers; // BEP 12 tiers, announceList has the same urls in one list
+    std::vector<std::string> urlList; // BEP 19 web seeds
     std::string comment;
     std::vector<std::string> pieceHashes;
     size_t pieceLength;
@@ -37,7 +39,7 @@ struct TorrentFile {
     std::string publisher;
     std::string publisherURL;
     bool multipleFiles;
-    bool isPrivate;
+    bool isPrivate = false;
     std::vector<File> filesList;
     std::shared_ptr<spdlog::logger> l;
 };
@@ -1,11 +1,19 @@
 #include "torrent_tracker.h"
 #include "bencode.h"
 #include "byte_tools.h"
+#include "peer_pool.h"
+#include "dns_cache.h"
+#include "http_session_pool.h"
 #include <cpr/cpr.h>
 
 
 TorrentTracker::TorrentTracker(const std::string& url){
     l = spdlog::get("mainLogger");
+    if (url.rfind("udp://", 0) == 0) {
+        url_ = url;
+        udp_ = std::make_unique<UdpTracker>(url);
+        return;
+    }
     long long pos = url.find("?");
     // fix for bt.t-ru.org
     // parse pk value and set as param
@@ -30,19 +38,52 @@ cpr::Proxies proxies{
         {"https", "socks5://127.0.0.1:20170"}  // Proxy for HTTPS traffic
     };
 
-void TorrentTracker::UpdatePeers(const TorrentFile& tf, std::string peerId, int port){
-    l->trace("Before update peers call");
-    cpr::Session session;
+void TorrentTracker::UpdatePeers(const TorrentFile& tf, std::string peerId, int port, const AnnounceParams& params){
+    if (udp_) {
+        UdpAnnounceResponse response = udp_->Announce(tf.infoHash, peerId, port, params.downloaded, params.left,
+                                                      params.uploaded, params.event);
+        SPDLOG_LOGGER_DEBUG(l, "UDP tracker {}: {} seeders, {} leechers, interval {}s", url_,
+                            response.seeders, response.leechers, response.interval.count());
+        peers_ = std::move(response.peers);
+        interval_ = response.interval;
+        minInterval_ = std::chrono::seconds(0);
+        return;
+    }
+    UpdatePeersHttp(tf, peerId, port, params);
+}
+
+void TorrentTracker::UpdatePeersHttp(const TorrentFile& tf, const std::string& peerId, int port, const AnnounceParams& announce){
+    SPDLOG_LOGGER_TRACE(l, "Before update peers call");
+    peers_.clear();
+    UrlOrigin origin;
+    if (!ParseUrlOrigin(url_, origin)) {
+        throw std::runtime_error("Tracker url is not http(s): " + url_);
+    }
+    // the connection of the last announce to this server is kept alive and reused
+    HttpSessionPool::Lease session = HttpSessionPool::Shared().Acquire(origin);
     cpr::Url url{url_};
     cpr::Header header{
-            {"Connection", "Close"},
             {"User-Agent", "Custom-user-agent/1.0"}
         };
     cpr::Timeout timeout{2000};
-    session.SetUrl(url);
-    session.SetHeader(header);
-    session.SetTimeout(timeout);
-    session.SetProxies(proxies);
+    session->SetUrl(url);
+    session->SetHeader(header);
+    session->SetTimeout(timeout);
+    session->SetProxies(proxies);
+    // curl connects to the cached addresses instead of looking the host up on every announce,
+    // given as a list it tries the next one when a connect fails
+    std::vector<Peer> addresses = DnsCache::Shared().Resolve(origin.host, origin.port);
+    if (addresses.empty()) {
+        throw std::runtime_error("Can not resolve tracker " + origin.host);
+    }
+    std::string addressList;
+    for (const Peer& address : addresses) {
+        if (!addressList.empty()) {
+            addressList += ',';
+        }
+        addressList += address.IsV4() ? address.Ip() : "[" + address.Ip() + "]";
+    }
+    session->SetResolve(cpr::Resolve{origin.host, addressList, {static_cast<uint16_t>(origin.port)}});
     cpr::Parameters params;
     if (!pk.empty()) {
         params.Add({
@@ -53,70 +94,90 @@ void TorrentTracker::UpdatePeers(const TorrentFile& tf, std::string peerId, int
                 {"info_hash", tf.infoHash},
                 {"peer_id", peerId},
                 {"port", std::to_string(port)},
-                {"uploaded", std::to_string(0)},
-                {"downloaded", std::to_string(0)},
-                {"left", std::to_string(tf.length)},
+                {"uploaded", std::to_string(announce.uploaded)},
+                {"downloaded", std::to_string(announce.downloaded)},
+                {"left", std::to_string(announce.left)},
                 {"compact", std::to_string(1)}
                 });
-    session.SetParameters(params);
-    cpr::Response res = session.Get();
+    switch (announce.event) {
+        case TrackerEvent::Started:
+            params.Add({"event", "started"});
+            break;
+        case TrackerEvent::Completed:
+            params.Add({"event", "completed"});
+            break;
+        case TrackerEvent::Stopped:
+            params.Add({"event", "stopped"});
+            break;
+        case TrackerEvent::None:
+            break;
+    }
+    session->SetParameters(params);
+    cpr::Response res = session->Get();
+    if (res.error) {
+        session.Discard();
+        if (res.error.code == cpr::ErrorCode::COULDNT_CONNECT || res.error.code == cpr::ErrorCode::OPERATION_TIMEDOUT) {
+            // every cached address failed, the host may have moved
+            DnsCache::Shared().Forget(origin.host);
+        }
+    }
     if(res.status_code != 200){
         l->error("Update peers, hash {} \n\n {}", tf.infoHash, res.text);
         throw std::runtime_error("status code " + std::to_string(res.status_code));
     }
-    l->trace("Update peers, get respsonse, status code  {}\n {}",res.status_code, res.text);
+    SPDLOG_LOGGER_TRACE(l, "Update peers, get respsonse, status code  {}\n {}",res.status_code, res.text);
 
     auto dict_response = Bencode::ParseDictRec(res.text); // Parse response
     auto& map_from_response = dict_response.first->elements; // get data out of pair 
-    std::string peers;
     if(map_from_response.find("failure reason") != map_from_response.end()){
         l->error("failed to update peers, error: {}", std::get<std::string>(map_from_response["failure reason"]));
         throw std::runtime_error("failed to update peers, error:" + std::get<std::string>(map_from_response["failure reason"]));
     }
-    try{
-        peers = std::get<std::string>(map_from_response["peers"]); // get raw peers string
-    }catch(const std::exception& e){
-        l->error("Torrent tracker peers not string");
-        throw std::runtime_error("123123 torrent tracker failed");
-    }
-    int peers_position = res.text.find("peers");    // shortcuts for a correct determination of number of peers
-    int peers_colon_position = res.text.find(":", peers_position);
-    int len_of_peers = std::stoi(res.text.substr(peers_position + 5, peers_colon_position - peers_position - 5 ));
-
-    // loop over all peers
-    for(int k = 0; k < len_of_peers; k += 6){
-        long long id = 0;
-        std::string id_str;
-
-        // Convert chars to a 4 byte hex
-        for(int i = 0; i < 4; ++i){
-            unsigned long long x = (unsigned char)(peers[i + k]);
-            id += (x << (24 - 8 * i));
+    auto seconds = [&map_from_response](const std::string& key) {
+        auto it = map_from_response.find(key);
+        const size_t* value = it == map_from_response.end() ? nullptr : std::get_if<size_t>(&it->second);
+        return std::chrono::seconds(value ? *value : 0);
+    };
+    interval_ = seconds("interval");
+    minInterval_ = seconds("min interval");
+    auto peers = map_from_response.find("peers");
+    if (peers == map_from_response.end()) {
+        if (!map_from_response.contains("peers6")) {
+            l->error("Torrent tracker response has no peers");
+            throw std::runtime_error("torrent tracker response has no peers");
         }
-
-        //convert each byte to it's corresponding digit
-        id_str += std::to_string((id & 0xFF000000) >> 24);
-        id_str += ".";
-        id_str += std::to_string((id & 0x00FF0000) >> 16);
-        id_str += ".";
-        id_str += std::to_string((id & 0x0000FF00) >> 8);
-        id_str += ".";
-        id_str += std::to_string((id & 0x000000FF));
-            
-        // std::cout << id_str << std::endl << std::endl;
-
-        // convert port just to hex
-        int port_ = 0;
-        for(int i = 4; i < 6; ++i){
-            unsigned long long x = (unsigned char)(peers[i + k]);
-            port_ += (x << (8 - 8 * (i - 4)));
+    } else if (const std::string* compact = std::get_if<std::string>(&peers->second)) {
+        peers_ = ParseCompactPeers(*compact);
+    } else if (const auto* list = std::get_if<std::unique_ptr<Bencode::bencodeList>>(&peers->second)) {
+        // dictionary model: "ip" and "port" of every peer, the ip may be a host name
+        for (const auto& element : (*list)->elements) {
+            const auto* peerDict = std::get_if<std::unique_ptr<Bencode::bencodeDict>>(&element);
+            if (!peerDict) {
+                continue;
+            }
+            const auto& fields = (*peerDict)->elements;
+            auto ip = fields.find("ip");
+            auto port = fields.find("port");
+            if (ip == fields.end() || port == fields.end() ||
+                !std::holds_alternative<std::string>(ip->second) || !std::holds_alternative<size_t>(port->second)) {
+                continue;
+            }
+            Peer peer;
+            if (ResolvePeer(std::get<std::string>(ip->second), static_cast<int>(std::get<size_t>(port->second)), peer)) {
+                peers_.push_back(peer);
+            }
         }
+    } else {
+        l->error("Torrent tracker peers are neither a string nor a list");
+        throw std::runtime_error("torrent tracker peers are neither a string nor a list");
+    }
 
-        // construct Peer from data provided
-        Peer current_peer;
-        current_peer.ip = id_str;
-        current_peer.port = port_;
-        peers_.push_back(current_peer);
+    // BEP 7: IPv6 peers come in a list of their own
+    auto peers6 = map_from_response.find("peers6");
+    if (peers6 != map_from_response.end()) {
+        if (const std::string* compact = std::get_if<std::string>(&peers6->second)) {
+            std::vector<Peer> parsed = ParseCompactPeers6(*compact);
+            peers_.insert(peers_.end(), parsed.begin(), parsed.end());
+        }
     }
-        
 }
\ No newline at end of file
@@ -3,8 +3,22 @@
 #include <string>
 #include "torrent_file.h"
 #include "peer.h"
+#include "udp_tracker.h"
+#include <memory>
+#include <chrono>
+#include <cstdint>
 #include "spdlog/spdlog.h"
 
+/*
+ * Transfer state sent with an announce
+ */
+struct AnnounceParams {
+    uint64_t uploaded = 0;
+    uint64_t downloaded = 0;
+    uint64_t left = 0;
+    TrackerEvent event = TrackerEvent::None;
+};
+
 class TorrentTracker {
 public:
     /*
@@ -20,19 +34,36 @@ public:
      *
      * tf: структура с разобранными данными из .torrent файла из предыдущего домашнего задания.
      * peerId: id, под которым представляется наш клиент.
-     * port: порт, на котором наш клиент будет слушать входящие соединения (пока что мы не слушаем и на этот порт никто
-     *  не сможет подключиться).
+     * port: порт, на котором наш клиент будет слушать входящие соединения.
+     * params: uploaded/downloaded/left and the event to report
      */
-    void UpdatePeers(const TorrentFile& tf, std::string peerId, int port);
+    void UpdatePeers(const TorrentFile& tf, std::string peerId, int port, const AnnounceParams& params);
 
     /*
      * Отдает полученный ранее список пиров
      */
     const std::vector<Peer>& GetPeers() const;
 
+    /*
+     * Re-announce period asked by the tracker in the last answer, 0 if it did not send one.
+     * Min interval is how soon we may announce again without an event
+     */
+    std::chrono::seconds GetInterval() const{
+        return interval_;
+    }
+
+    std::chrono::seconds GetMinInterval() const{
+        return minInterval_;
+    }
+
 private:
+    void UpdatePeersHttp(const TorrentFile& tf, const std::string& peerId, int port, const AnnounceParams& announce);
+
     std::string url_;
+    std::unique_ptr<UdpTracker> udp_;  // set for udp:// trackers
     std::vector<Peer> peers_;
+    std::chrono::seconds interval_{0};
+    std::chrono::seconds minInterval_{0};
     // especially for bt.t-ru.org
     std::string pk;
     std::shared_ptr<spdlog::logger> l;
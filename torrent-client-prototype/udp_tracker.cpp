@@ -0,0 +1,241 @@
+#include "udp_tracker.h"
+#include "byte_tools.h"
+#include "peer_pool.h"
+#include "dns_cache.h"
+
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <unistd.h>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+    constexpr uint64_t protocolId = 0x41727101980;
+    // largest UDP payload over IPv4, an IPv6 announce reply carries 18 bytes per peer
+    constexpr size_t maxDatagramSize = 65507;
+
+    void AppendInt(std::string& out, uint64_t num, size_t bytes){
+        for(size_t i = bytes; i > 0; --i){
+            out += static_cast<char>((num >> (8 * (i - 1))) & 0xFF);
+        }
+    }
+
+    // BytesToInt sign-extends values with the high bit set
+    uint32_t ReadInt32(std::string_view bytes){
+        return static_cast<uint32_t>(BytesToInt(bytes));
+    }
+
+    uint64_t ReadInt64(std::string_view bytes){
+        return (static_cast<uint64_t>(ReadInt32(bytes)) << 32) | ReadInt32(bytes.substr(4));
+    }
+
+    // no answer or an ICMP error from the tracker's address, another address of the host may work
+    struct Unreachable : std::runtime_error {
+        using std::runtime_error::runtime_error;
+    };
+}
+
+
+UdpTracker::UdpTracker(const std::string& url) : random_(std::random_device{}()) {
+    l = spdlog::get("mainLogger");
+    // udp://host:port/announce
+    std::string rest = url.substr(url.find("://") == std::string::npos ? 0 : url.find("://") + 3);
+    rest = rest.substr(0, rest.find('/'));
+    size_t colon = rest.rfind(':');
+    if (colon != std::string::npos) {
+        host_ = rest.substr(0, colon);
+        port_ = rest.substr(colon + 1);
+    } else {
+        host_ = rest;
+    }
+    // IPv6 literal, udp://[::1]:6969
+    if (host_.size() >= 2 && host_.front() == '[' && host_.back() == ']') {
+        host_ = host_.substr(1, host_.size() - 2);
+    }
+}
+
+UdpTracker::~UdpTracker() {
+    if (sock_ != -1) {
+        close(sock_);
+    }
+}
+
+void UdpTracker::Open() {
+    if (sock_ != -1) {
+        return;
+    }
+    if (host_.empty() || port_.empty()) {
+        throw std::runtime_error("UDP tracker url has no host or port");
+    }
+    if (addresses_.empty()) {
+        addresses_ = DnsCache::Shared().Resolve(host_, std::atoi(port_.c_str()));
+        addressIndex_ = 0;
+        if (addresses_.empty()) {
+            throw std::runtime_error("Can not resolve UDP tracker " + host_);
+        }
+    }
+    const Peer& address = addresses_[addressIndex_];
+    sockaddr_storage addr;
+    socklen_t addrLen = address.ToSockaddr(addr);
+    int sock = socket(addr.ss_family, SOCK_DGRAM, 0);
+    // connected UDP socket, datagrams from other addresses are dropped by the kernel
+    if (sock < 0 || connect(sock, reinterpret_cast<sockaddr*>(&addr), addrLen) < 0) {
+        std::string err = std::strerror(errno);
+        if (sock >= 0) {
+            close(sock);
+        }
+        throw Unreachable("Can not open socket to UDP tracker " + address.ToString() + ": " + err);
+    }
+    ipv6_ = !address.IsV4();
+    sock_ = sock;
+}
+
+void UdpTracker::SkipAddress() {
+    if (sock_ != -1) {
+        close(sock_);
+        sock_ = -1;
+    }
+    connected_ = false;
+    if (++addressIndex_ < addresses_.size()) {
+        SPDLOG_LOGGER_DEBUG(l, "UDP tracker {}: trying address {}", host_, addresses_[addressIndex_].ToString());
+        return;
+    }
+    // all of them failed, the next request resolves the host again
+    addresses_.clear();
+    addressIndex_ = 0;
+    DnsCache::Shared().Forget(host_);
+}
+
+std::string UdpTracker::Transact(std::string request, Action action, size_t minResponseSize) {
+    uint32_t transactionId = random_();
+    std::string tid;
+    AppendInt(tid, transactionId, 4);
+    request.replace(12, 4, tid);
+
+    std::string buf(maxDatagramSize, '\0');
+    for (int attempt = 0; attempt <= maxRetransmits; ++attempt) {
+        if (send(sock_, request.data(), request.size(), 0) < 0) {
+            throw Unreachable(std::string("UDP tracker send error: ") + std::strerror(errno));
+        }
+        auto deadline = std::chrono::steady_clock::now() + retransmitBase * (1 << attempt);
+        while (true) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (left.count() <= 0) {
+                break;
+            }
+            pollfd p{sock_, POLLIN, 0};
+            int ready = poll(&p, 1, static_cast<int>(left.count()));
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready <= 0) {
+                break;
+            }
+            ssize_t received = recv(sock_, buf.data(), buf.size(), 0);
+            if (received < 8) {
+                // ICMP port unreachable shows up as an error here, a dead tracker
+                if (received < 0 && errno != EAGAIN && errno != EINTR) {
+                    throw Unreachable(std::string("UDP tracker receive error: ") + std::strerror(errno));
+                }
+                continue;
+            }
+            std::string_view response(buf.data(), static_cast<size_t>(received));
+            if (ReadInt32(response.substr(4)) != transactionId) {
+                continue;  // late answer to an earlier attempt
+            }
+            uint32_t responseAction = ReadInt32(response);
+            if (responseAction == Error) {
+                throw std::runtime_error("UDP tracker error: " + std::string(response.substr(8)));
+            }
+            if (responseAction != action || response.size() < minResponseSize) {
+                throw std::runtime_error("UDP tracker sent a malformed response");
+            }
+            return std::string(response);
+        }
+        SPDLOG_LOGGER_DEBUG(l, "UDP tracker {} did not answer, attempt {}", host_, attempt + 1);
+    }
+    throw Unreachable("UDP tracker " + host_ + " timed out");
+}
+
+std::string UdpTracker::TransactConnected(std::string request, Action action, size_t minResponseSize) {
+    try {
+        return Transact(std::move(request), action, minResponseSize);
+    } catch (const Unreachable&) {
+        // the next request starts over with another address
+        SkipAddress();
+        throw;
+    }
+}
+
+void UdpTracker::EnsureConnected() {
+    if (sock_ != -1 && connected_ && std::chrono::steady_clock::now() - connectedAt_ < connectionIdLifetime) {
+        return;
+    }
+    while (true) {
+        try {
+            Open();
+            std::string request;
+            AppendInt(request, protocolId, 8);
+            AppendInt(request, Connect, 4);
+            AppendInt(request, 0, 4);  // transaction id
+            std::string response = Transact(std::move(request), Connect, 16);
+            connectionId_ = ReadInt64(std::string_view(response).substr(8));
+            connectedAt_ = std::chrono::steady_clock::now();
+            connected_ = true;
+            SPDLOG_LOGGER_DEBUG(l, "Connected to UDP tracker {} at {}", host_, addresses_[addressIndex_].ToString());
+            return;
+        } catch (const Unreachable& e) {
+            l->warn("UDP tracker {} at {}: {}", host_, addresses_[addressIndex_].ToString(), e.what());
+            SkipAddress();
+            if (addresses_.empty()) {
+                throw;
+            }
+        }
+    }
+}
+
+UdpAnnounceResponse UdpTracker::Announce(const std::string& infoHash, const std::string& peerId, int port,
+                                         uint64_t downloaded, uint64_t left, uint64_t uploaded, TrackerEvent event) {
+    EnsureConnected();
+    std::string request;
+    AppendInt(request, connectionId_, 8);
+    AppendInt(request, AnnounceAction, 4);
+    AppendInt(request, 0, 4);  // transaction id
+    request += infoHash;
+    request += peerId;
+    AppendInt(request, downloaded, 8);
+    AppendInt(request, left, 8);
+    AppendInt(request, uploaded, 8);
+    AppendInt(request, static_cast<uint32_t>(event), 4);
+    AppendInt(request, 0, 4);  // our address, the tracker takes it from the datagram
+    AppendInt(request, random_(), 4);  // key
+    AppendInt(request, static_cast<uint32_t>(-1), 4);  // num_want, the tracker default
+    AppendInt(request, static_cast<uint16_t>(port), 2);
+
+    std::string response = TransactConnected(std::move(request), AnnounceAction, 20);
+    std::string_view view(response);
+    UdpAnnounceResponse result;
+    result.interval = std::chrono::seconds(ReadInt32(view.substr(8)));
+    result.leechers = ReadInt32(view.substr(12));
+    result.seeders = ReadInt32(view.substr(16));
+    // the tracker answers with peers of the address family we reached it by, BEP 15
+    result.peers = ipv6_ ? ParseCompactPeers6(view.substr(20)) : ParseCompactPeers(view.substr(20));
+    return result;
+}
+
+UdpScrapeResponse UdpTracker::Scrape(const std::string& infoHash) {
+    EnsureConnected();
+    std::string request;
+    AppendInt(request, connectionId_, 8);
+    AppendInt(request, ScrapeAction, 4);
+    AppendInt(request, 0, 4);  // transaction id
+    request += infoHash;
+
+    std::string response = TransactConnected(std::move(request), ScrapeAction, 20);
+    std::string_view view(response);
+    UdpScrapeResponse result;
+    result.seeders = ReadInt32(view.substr(8));
+    result.completed = ReadInt32(view.substr(12));
+    result.leechers = ReadInt32(view.substr(16));
+    return result;
+}
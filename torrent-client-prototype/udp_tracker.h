@@ -0,0 +1,99 @@
+#pragma once
+
+#include "peer.h"
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include "spdlog/spdlog.h"
+
+/*
+ * Announce event, the values are the ones of the UDP protocol
+ */
+enum class TrackerEvent : uint32_t {
+    None = 0,
+    Completed = 1,
+    Started = 2,
+    Stopped = 3,
+};
+
+struct UdpAnnounceResponse {
+    std::chrono::seconds interval{0};
+    uint32_t leechers = 0;
+    uint32_t seeders = 0;
+    std::vector<Peer> peers;
+};
+
+struct UdpScrapeResponse {
+    uint32_t seeders = 0;
+    uint32_t completed = 0;
+    uint32_t leechers = 0;
+};
+
+/*
+ * Client of the UDP tracker protocol, https://www.bittorrent.org/beps/bep_0015.html
+ * A connect exchange gives a connection id that is valid for a minute, announces and scrapes use it.
+ * Every request is retransmitted with a doubling timeout, errors of the tracker are thrown as exceptions.
+ * A host with several addresses is tried address by address: one that times out or answers with
+ * an ICMP error is skipped for the next one, the DNS cache entry is dropped when all of them failed.
+ */
+class UdpTracker {
+public:
+    /*
+     * url -- udp://host:port[/announce], the host is resolved on the first request
+     */
+    explicit UdpTracker(const std::string& url);
+    ~UdpTracker();
+
+    UdpTracker(const UdpTracker&) = delete;
+    UdpTracker& operator=(const UdpTracker&) = delete;
+
+    UdpAnnounceResponse Announce(const std::string& infoHash, const std::string& peerId, int port,
+                                 uint64_t downloaded, uint64_t left, uint64_t uploaded, TrackerEvent event);
+
+    UdpScrapeResponse Scrape(const std::string& infoHash);
+
+    // BEP 15 waits 15 * 2^n seconds, we announce to many trackers and give up sooner
+    static constexpr std::chrono::seconds retransmitBase{3};
+    static constexpr int maxRetransmits = 2;
+    static constexpr std::chrono::seconds connectionIdLifetime{60};
+
+private:
+    enum Action : uint32_t {
+        Connect = 0,
+        AnnounceAction = 1,
+        ScrapeAction = 2,
+        Error = 3,
+    };
+
+    // resolve the host and open the socket to the current address if not done yet
+    void Open();
+
+    // close the socket of an unreachable address and move to the next one
+    void SkipAddress();
+
+    // get a connection id if there is no valid one, unreachable addresses are skipped
+    void EnsureConnected();
+
+    /*
+     * Send `request` (its transaction id is filled in here) and wait for the matching response,
+     * retransmitting on timeout. Returns the whole response datagram
+     */
+    std::string Transact(std::string request, Action action, size_t minResponseSize);
+
+    // Transact after EnsureConnected, an unreachable address is skipped for the next request
+    std::string TransactConnected(std::string request, Action action, size_t minResponseSize);
+
+    std::string host_;
+    std::string port_;
+    std::vector<Peer> addresses_;  // of the host, empty until resolved
+    size_t addressIndex_ = 0;  // the one the socket is connected to
+    int sock_ = -1;
+    bool ipv6_ = false;  // the tracker resolved to an IPv6 address, peers come in 18 bytes
+    uint64_t connectionId_ = 0;
+    std::chrono::steady_clock::time_point connectedAt_;
+    bool connected_ = false;
+    std::mt19937 random_;
+    std::shared_ptr<spdlog::logger> l;
+};
@@ -0,0 +1,88 @@
+#include "verification_journal.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdexcept>
+
+namespace {
+    std::string ToHex(const std::string& bytes){
+        static const char digits[] = "0123456789abcdef";
+        std::string res;
+        res.reserve(bytes.size() * 2);
+        for(unsigned char c : bytes){
+            res.push_back(digits[c >> 4]);
+            res.push_back(digits[c & 0x0F]);
+        }
+        return res;
+    }
+
+    void SyncPath(const std::filesystem::path& path){
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0){
+            return;
+        }
+        fdatasync(fd);
+        close(fd);
+    }
+}
+
+VerificationJournal::VerificationJournal(const std::filesystem::path& path, const std::string& infoHash) :
+    path_(path), header_("journal v1 " + ToHex(infoHash)) {
+    l = spdlog::get("mainLogger");
+    out_.open(path_, std::ios::out | std::ios::trunc);
+    if(!out_.is_open()){
+        l->error("Failed to open verification journal {}", path_.string());
+        throw std::runtime_error("Failed to open verification journal: " + path_.string());
+    }
+    out_ << header_ << '\n';
+    out_.flush();
+    l->info("Verification journal {}", path_.string());
+}
+
+void VerificationJournal::Stage(size_t pieceIndex){
+    staged_.push_back(pieceIndex);
+}
+
+std::vector<size_t> VerificationJournal::TakeStaged(){
+    std::vector<size_t> pieces;
+    pieces.swap(staged_);
+    return pieces;
+}
+
+void VerificationJournal::Commit(const std::vector<size_t>& pieces){
+    if(pieces.empty()){
+        return;
+    }
+    for(size_t index : pieces){
+        out_ << index << '\n';
+    }
+    out_.flush();
+    if(!out_.good()){
+        l->error("Failed to write verification journal {}", path_.string());
+        throw std::runtime_error("Failed to write verification journal");
+    }
+    SyncPath(path_);
+    SPDLOG_LOGGER_DEBUG(l, "Verification journal: committed {} pieces", pieces.size());
+}
+
+std::vector<size_t> VerificationJournal::ReadVerifiedPieces() const{
+    std::vector<size_t> pieces;
+    std::ifstream in(path_);
+    std::string line;
+    if(!in.is_open() || !std::getline(in, line) || line != header_){
+        l->warn("Verification journal {} is missing or belongs to another torrent", path_.string());
+        return pieces;
+    }
+    while(std::getline(in, line)){
+        if(line.empty()){
+            continue;
+        }
+        try{
+            pieces.push_back(std::stoull(line));
+        }catch(const std::exception& e){
+            // torn last record after a crash, everything before it is valid
+            l->warn("Verification journal: bad record '{}', stop reading", line);
+            break;
+        }
+    }
+    return pieces;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include "spdlog/spdlog.h"
+
+/*
+ * Append-only record of pieces that passed the in-memory hash check and were durably written to disk.
+ * The final integrity check may trust these pieces instead of reading them back.
+ *
+ * Format: a header line "journal v1 <hex info hash>", then one piece index per line.
+ * Records are staged first and written by Commit, the caller has to sync the data files before that,
+ * so a journaled piece is always on disk.
+ */
+class VerificationJournal {
+public:
+    /*
+     * Start a new journal at `path` for the torrent with `infoHash`, an old journal is truncated
+     * (output files are recreated on every run as well)
+     */
+    VerificationJournal(const std::filesystem::path& path, const std::string& infoHash);
+
+    // remember a verified piece until the next Commit
+    void Stage(size_t pieceIndex);
+
+    size_t StagedCount() const{
+        return staged_.size();
+    }
+
+    // staged pieces, handed to Commit once their data is synced
+    std::vector<size_t> TakeStaged();
+
+    /*
+     * Append the pieces to the journal file and fsync it.
+     * Data of the pieces must already be synced to disk, concurrent calls are not allowed.
+     */
+    void Commit(const std::vector<size_t>& pieces);
+
+    /*
+     * Read committed piece indices back from the journal file.
+     * Returns nothing if the file is missing or belongs to another torrent.
+     */
+    std::vector<size_t> ReadVerifiedPieces() const;
+
+    const std::filesystem::path& GetPath() const{
+        return path_;
+    }
+
+private:
+    std::filesystem::path path_;
+    std::string header_;
+    std::ofstream out_;
+    std::vector<size_t> staged_;
+    std::shared_ptr<spdlog::logger> l;
+};
@@ -0,0 +1,218 @@
+#include "webseed.h"
+#include "byte_tools.h"
+
+#include <cpr/cpr.h>
+#include <algorithm>
+
+
+WebSeed::WebSeed(const std::string& url, const TorrentFile& tf, PieceStorage& pieces) :
+    url_(url), tf_(tf), pieces_(pieces) {
+    l = spdlog::get("mainLogger");
+    thread_ = std::thread(&WebSeed::Run, this);
+}
+
+WebSeed::~WebSeed() {
+    Terminate();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void WebSeed::Terminate() {
+    terminated_.store(true);
+}
+
+bool WebSeed::Wait(std::chrono::milliseconds duration) const {
+    using namespace std::chrono_literals;
+    auto deadline = std::chrono::steady_clock::now() + duration;
+    while (!terminated_.load()) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return true;
+        }
+        std::this_thread::sleep_for(100ms);
+    }
+    return false;
+}
+
+void WebSeed::Run() {
+    l->info("Web seed {} started", url_);
+    try {
+        Loop();
+    } catch (const std::exception& e) {
+        l->error("Web seed {} error: {}", url_, e.what());
+    }
+    active_.store(false);
+    l->info("Web seed {} stopped", url_);
+}
+
+void WebSeed::Loop() {
+    int failures = 0;
+    while (!terminated_.load()) {
+        std::vector<PiecePtr> run = TakeRun();
+        if (run.empty()) {
+            if (!Wait(idleWait)) {
+                break;
+            }
+            continue;
+        }
+        FetchResult result = FetchRun(run);
+        if (result == FetchResult::Ok) {
+            failures = 0;
+            continue;
+        }
+        if (result == FetchResult::HashMismatch) {
+            failures = 0;
+            if (hashFailures_ >= maxHashFailures) {
+                l->warn("Web seed {} sent {} pieces with a wrong hash, giving it up", url_, hashFailures_);
+                break;
+            }
+            continue;
+        }
+        for (const PiecePtr& piece : run) {
+            pieces_.ReturnPiece(piece);
+        }
+        if (result == FetchResult::NoRangeSupport) {
+            l->warn("Web seed {} does not support Range requests, giving it up", url_);
+            break;
+        }
+        if (terminated_.load()) {
+            break;
+        }
+        failures++;
+        if (failures >= maxFailures) {
+            l->warn("Web seed {} failed {} requests in a row, giving it up", url_, failures);
+            break;
+        }
+        if (!Wait(retryDelay * (1 << (failures - 1)))) {
+            break;
+        }
+    }
+}
+
+std::vector<PiecePtr> WebSeed::TakeRun() {
+    std::vector<PiecePtr> run;
+    NoPieceReason reason;
+    PiecePtr first = pieces_.GetNextPieceToDownload(reason);
+    if (!first) {
+        return run;
+    }
+    run.push_back(first);
+    size_t runBytes = first->GetLength();
+    while (runBytes + tf_.pieceLength <= maxRunBytes) {
+        PiecePtr next = pieces_.TakePieceToDownload(first->GetIndex() + run.size());
+        if (!next) {
+            break;
+        }
+        runBytes += next->GetLength();
+        run.push_back(std::move(next));
+    }
+    return run;
+}
+
+WebSeed::FetchResult WebSeed::FetchRun(const std::vector<PiecePtr>& run) {
+    size_t begin = run.front()->GetIndex() * tf_.pieceLength;
+    size_t length = 0;
+    for (const PiecePtr& piece : run) {
+        length += piece->GetLength();
+    }
+    SPDLOG_LOGGER_DEBUG(l, "Web seed {}: pieces {}-{}, {} bytes", url_, run.front()->GetIndex(), run.back()->GetIndex(), length);
+
+    std::string data;
+    data.reserve(length);
+    for (const FileRange& range : RangesFor(begin, length)) {
+        if (terminated_.load()) {
+            return FetchResult::Failed;
+        }
+        FetchResult result = Fetch(range, data);
+        if (result != FetchResult::Ok) {
+            return result;
+        }
+    }
+    if (data.size() != length) {
+        l->warn("Web seed {} has no data for bytes {}-{}", url_, begin + data.size(), begin + length - 1);
+        return FetchResult::Failed;
+    }
+
+    // blocks peers already brought in are kept, the rest is taken from the answer
+    size_t pieceStart = 0;
+    bool hashMismatch = false;
+    for (const PiecePtr& piece : run) {
+        bool fromSeed = false;
+        for (Block* block = piece->FirstMissingBlock(); block; block = piece->FirstMissingBlock()) {
+            std::string_view blockData(data.data() + pieceStart + block->offset, block->length);
+            if (!piece->SaveBlock(block->offset, blockData)) {
+                break;
+            }
+            fromSeed = true;
+            pieces_.bytesDownloaded.fetch_add(block->length, std::memory_order_relaxed);
+        }
+        pieceStart += piece->GetLength();
+        // a piece made of peers' blocks only says nothing about the seed
+        if (!pieces_.VerifyPieceNow(piece) && fromSeed) {
+            l->warn("Web seed {} sent piece {} with a wrong hash", url_, piece->GetIndex());
+            hashFailures_++;
+            hashMismatch = true;
+        }
+    }
+    return hashMismatch ? FetchResult::HashMismatch : FetchResult::Ok;
+}
+
+WebSeed::FetchResult WebSeed::Fetch(const FileRange& range, std::string& data) {
+    std::string bytes = "bytes=" + std::to_string(range.offset) + "-" + std::to_string(range.offset + range.length - 1);
+    cpr::Response res = cpr::Get(
+        cpr::Url{range.url},
+        cpr::Header{{"Range", bytes}},
+        cpr::Timeout{std::chrono::duration_cast<std::chrono::milliseconds>(requestTimeout)}
+    );
+    if (res.error) {
+        l->warn("Web seed request {} failed: {}", range.url, res.error.message);
+        return FetchResult::Failed;
+    }
+    if (res.status_code == 206 && res.text.size() == range.length) {
+        data += res.text;
+        return FetchResult::Ok;
+    }
+    if (res.status_code == 200) {
+        // the Range header was ignored, that is only right when the range is the whole file
+        if (range.offset == 0 && res.text.size() == range.length) {
+            data += res.text;
+            return FetchResult::Ok;
+        }
+        l->warn("Web seed {} ignored the range {} and sent {} bytes", range.url, bytes, res.text.size());
+        return FetchResult::NoRangeSupport;
+    }
+    l->warn("Web seed {} answered {} with {} bytes for {}", range.url, res.status_code, res.text.size(), bytes);
+    return FetchResult::Failed;
+}
+
+std::vector<WebSeed::FileRange> WebSeed::RangesFor(size_t begin, size_t length) const {
+    std::vector<FileRange> ranges;
+    size_t end = begin + length;
+    size_t fileStart = 0;
+    for (const File& f : tf_.filesList) {
+        size_t fileEnd = fileStart + f.length;
+        if (fileEnd > begin && fileStart < end) {
+            size_t overlapBegin = std::max(begin, fileStart);
+            size_t overlapEnd = std::min(end, fileEnd);
+            ranges.push_back(FileRange{FileUrl(f), overlapBegin - fileStart, overlapEnd - overlapBegin});
+        }
+        fileStart = fileEnd;
+    }
+    return ranges;
+}
+
+std::string WebSeed::FileUrl(const File& file) const {
+    if (!tf_.multipleFiles) {
+        // the url names the file itself unless it is a directory
+        return url_.ends_with('/') ? url_ + URLEncode(tf_.name) : url_;
+    }
+    std::string url = url_;
+    if (!url.ends_with('/')) {
+        url += '/';
+    }
+    url += URLEncode(tf_.name);
+    for (const std::string& part : file.path) {
+        url += '/' + URLEncode(part);
+    }
+    return url;
+}
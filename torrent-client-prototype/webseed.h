@@ -0,0 +1,99 @@
+#pragma once
+
+#include "torrent_file.h"
+#include "piece_storage.h"
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "spdlog/spdlog.h"
+
+/*
+ * HTTP web seed, https://www.bittorrent.org/beps/bep_0019.html
+ * A server that has the torrent's files and works like one more peer on its own thread: it takes pieces from
+ * the same PieceStorage queue, a run of consecutive queued pieces at a time, fetches their bytes with HTTP
+ * Range requests and hash-checks every piece with PieceStorage::VerifyPieceNow.
+ * A seed that fails `maxFailures` requests in a row, sends `maxHashFailures` bad pieces
+ * or does not support Range requests is given up.
+ */
+class WebSeed {
+public:
+    /*
+     * url -- entry of the url-list, the torrent's name (and file paths for a multi-file torrent)
+     * is appended to it as described in BEP 19
+     */
+    WebSeed(const std::string& url, const TorrentFile& tf, PieceStorage& pieces);
+
+    // stops the thread, a run being fetched is given back to the queue
+    ~WebSeed();
+
+    WebSeed(const WebSeed&) = delete;
+    WebSeed& operator=(const WebSeed&) = delete;
+
+    void Terminate();
+
+    // false once the seed is given up or terminated
+    bool Active() const{
+        return active_.load();
+    }
+
+    const std::string& GetUrl() const{
+        return url_;
+    }
+
+    static constexpr size_t maxRunBytes = 4 * 1024 * 1024;  // pieces fetched with one request per file
+    static constexpr int maxFailures = 5;
+    static constexpr int maxHashFailures = 3;  // pieces with a wrong hash over the seed's lifetime
+    static constexpr std::chrono::seconds retryDelay{5};  // doubled after every failure in a row
+    static constexpr std::chrono::seconds requestTimeout{30};
+
+private:
+    enum class FetchResult {
+        Ok,
+        Failed,  // network error or unexpected answer, retried later
+        HashMismatch,  // the data came, but some piece of it has a wrong hash
+        NoRangeSupport,  // the server sends whole files only
+    };
+
+    // part of the torrent's data inside one file of the seed
+    struct FileRange {
+        std::string url;
+        size_t offset;  // in the file
+        size_t length;
+    };
+
+    void Run();
+    void Loop();
+
+    // the next queued piece and the queued pieces right after it, empty if nothing can be taken now
+    std::vector<PiecePtr> TakeRun();
+
+    /*
+     * Download the run into its pieces and verify them. Pieces are given back to the queue
+     * by the caller unless the result is Ok or HashMismatch (bad pieces are requeued by the check)
+     */
+    FetchResult FetchRun(const std::vector<PiecePtr>& run);
+
+    // one HTTP request, appends exactly range.length bytes to `data` if the result is Ok
+    FetchResult Fetch(const FileRange& range, std::string& data);
+
+    // files covering the torrent bytes [begin, begin + length)
+    std::vector<FileRange> RangesFor(size_t begin, size_t length) const;
+
+    std::string FileUrl(const File& file) const;
+
+    // sleep for `duration` unless terminated, false if terminated
+    bool Wait(std::chrono::milliseconds duration) const;
+
+    std::string url_;
+    const TorrentFile& tf_;
+    PieceStorage& pieces_;
+    std::atomic<bool> terminated_{false};
+    std::atomic<bool> active_{true};
+    int hashFailures_ = 0;  // pieces from this seed that failed the hash check
+    std::thread thread_;
+    std::shared_ptr<spdlog::logger> l;
+
+    static constexpr std::chrono::seconds idleWait{1};  // all queued pieces are taken by peers
+};